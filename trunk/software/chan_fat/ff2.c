@@ -2998,7 +2998,7 @@ FRESULT f_getcwd (
 #endif
 			for (n = 0; tp[n]; n++) ;
 			if (i < n + 3) {
-				res = FR_NOT_ENOUGH_CORE; break;
+				res = FR_NO_MEMORY; break;
 			}
 			while (n) buff[--i] = tp[--n];
 			buff[--i] = '/';
@@ -3075,7 +3075,7 @@ FRESULT f_lseek (
 			if (ulen <= tlen)
 				*tbl = 0;		/* Terminate table */
 			else
-				res = FR_NOT_ENOUGH_CORE;	/* Given table size is smaller than required */
+				res = FR_NO_MEMORY;	/* Given table size is smaller than required */
 
 		} else {						/* Fast seek */
 			if (ofs > fp->fsize)		/* Clip offset at the file size */
@@ -7,6 +7,8 @@
 #include "itu.h"
 #endif
 
+#define SORT_BLOCK 20 // runs sorted by insertion, before merging
+
 template <class T>
 class IndexedList
 {
@@ -36,6 +38,40 @@ private:
 		element_array = new_array;
 		removal = new_removal;
 	}
+
+	// Stable sort helpers: runs of SORT_BLOCK elements are sorted by
+	// insertion, and then merged from one array into the other, doubling
+	// the run length every pass. The removal flags move along with their
+	// elements.
+	template <class Compare>
+	static void sort_insertion(T *e, uint8_t *r, int a, int b, Compare &compare) {
+		for(int i=a+1;i<b;i++) {
+			T el = e[i];
+			uint8_t rem = r[i];
+			int j = i;
+			for(;(j>a) && (compare(el, e[j-1]) < 0);j--) {
+				e[j] = e[j-1];
+				r[j] = r[j-1];
+			}
+			e[j] = el;
+			r[j] = rem;
+		}
+	}
+
+	// merges the sorted runs [a,m) and [m,b) of src into dst
+	template <class Compare>
+	static void sort_merge(T *se, uint8_t *sr, T *de, uint8_t *dr, int a, int m, int b, Compare &compare) {
+		int i = a, j = m;
+		for(int k=a;k<b;k++) {
+			if ((i < m) && ((j >= b) || (compare(se[j], se[i]) >= 0))) {
+				de[k] = se[i];
+				dr[k] = sr[i++];
+			} else {
+				de[k] = se[j];
+				dr[k] = sr[j++];
+			}
+		}
+	}
 public:
     IndexedList(int initial, T def) : empty(def) {
 		if(initial) {
@@ -158,37 +194,44 @@ public:
 		return element_array[i];
 	}
 
-    void sort(int (*compare)(IndexedList<T> *, int, int)) {
-		int swaps;
-	    int i;
-	    int gap;
-
-		if(elements < 2)
+	// Sorts with compare(T a, T b), which returns <0, 0 or >0 like strcmp.
+	// Elements that compare equal keep their order. The sort works on a copy,
+	// such that the list is only locked once, to store the result.
+	template <class Compare>
+	void sort(Compare compare) {
+		int n = elements;
+		if(n < 2)
 			return;
 
-	    gap = elements-1;
+		T *e = new T[2 * n];
+		uint8_t *r = new uint8_t[2 * n];
+		for(int i=0;i<n;i++) {
+			e[i] = element_array[i];
+			r[i] = removal[i];
+		}
+
+		for(int a=0;a<n;a+=SORT_BLOCK)
+			sort_insertion(e, r, a, (a+SORT_BLOCK < n) ? a+SORT_BLOCK : n, compare);
 
-/*
-		printf("Sorting:\n");
-		for(int i=0;i<elements;i++) {
-			printf("%d: %p\n", i, children[i]);
+		int src = 0; // offset of the array that holds the runs
+		for(int block=SORT_BLOCK;block<n;block*=2) {
+			int dst = n - src;
+			for(int a=0;a<n;a+=2*block) {
+				int m = (a+block < n) ? a+block : n;
+				int b = (a+2*block < n) ? a+2*block : n;
+				sort_merge(e+src, r+src, e+dst, r+dst, a, m, b, compare);
+			}
+			src = dst;
+		}
+
+		ENTER_SAFE_SECTION
+		for(int i=0;i<n;i++) {
+			element_array[i] = e[src+i];
+			removal[i] = r[src+i];
 		}
-*/
-	    do {
-	        //update the gap value for a next comb
-	        if (gap > 1) {
-	            gap = (10 * gap)/13;
-	            if ((gap == 10) || (gap == 9))
-	                gap = 11;
-	        }
-
-	        for(i=0,swaps=0;(i+gap)<elements;i++) {
-	            if (compare(this, i, i+gap) > 0) {
-	                swap(i, i+gap);
-	                swaps++;
-	            }
-	        }
-	    } while(swaps || (gap > 1));
+		LEAVE_SAFE_SECTION
+		delete[] e;
+		delete[] r;
 	}
 };
 #endif
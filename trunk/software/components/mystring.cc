@@ -16,26 +16,51 @@ mstring :: mstring()
 mstring :: mstring(const char *k)
 {
 //    printf("Create mstring from char*. Source = %s\n", k);
-    alloc = 1+strlen(k);
+    alloc = 0;
     temporary = 0;
-    cp = new char[alloc];
+    cp = NULL;
+    reserve(strlen(k), false);
     strcpy(cp, k);
 }
 
 mstring :: mstring(mstring &ref)
 {
 //    printf("Creating mstring from reference. (source: %s)\n", ref.cp);
-    alloc = ref.alloc;
+    alloc = 0;
     temporary = 0;
-    cp = new char[alloc];
-    strcpy(cp, ref.cp);
+    cp = NULL;
+    reserve(ref.length(), false);
+    strcpy(cp, ref.c_str());
 }
 
 mstring :: ~mstring()
 {
 //    printf("Deleting mstring %s (this=%p)\n", cp, this);
-    if(cp)
+    if(cp && (cp != local))
+        delete[] cp;
+}
+
+// Makes room for n characters and the terminator. Short strings are kept
+// in the object itself; longer ones go to the heap.
+void mstring :: reserve(int n, bool keep)
+{
+    if(n < alloc)
+        return;
+    char *new_cp;
+    if(!cp && (n < MSTRING_LOCAL)) {
+        new_cp = local;
+        alloc = MSTRING_LOCAL;
+    } else {
+        new_cp = new char[n+1];
+        alloc = n+1;
+    }
+    if(keep && cp)
+        strcpy(new_cp, cp);
+    else
+        new_cp[0] = 0;
+    if(cp && (cp != local))
         delete[] cp;
+    cp = new_cp;
 }
 
 const char *mstring :: c_str(void)
@@ -60,12 +85,7 @@ int mstring :: allocated_space(void)
 mstring& mstring :: operator=(const char *rhs)
 {
 //    printf("Operator = char*rhs=%s. This = %p.\n", rhs, this);
-    int n = strlen(rhs);
-    if((n+1) > alloc) {    
-        delete[] cp;
-        cp = new char[n+1];
-        alloc = n+1;
-    }
+    reserve(strlen(rhs), false);
     strcpy(cp, rhs);
     return *this;
 }
@@ -74,12 +94,8 @@ mstring& mstring :: operator=(mstring &rhs)
 {
 //    printf("Assignment operator. Left = %s(%p), Right = %s(%p)\n", c_str(), this, rhs.c_str(), &rhs);
     if(this != &rhs) {
-        if((rhs.length()+1) > alloc) {
-            delete[] cp;
-            cp = new char[rhs.alloc];
-            alloc = rhs.alloc;
-        }
-        strcpy(cp, rhs.cp);
+        reserve(rhs.length(), false);
+        strcpy(cp, rhs.c_str());
         if(rhs.temporary)
             delete &rhs;
     }
@@ -88,54 +104,27 @@ mstring& mstring :: operator=(mstring &rhs)
 
 mstring& mstring :: operator+=(const char rhs)
 {
-    int n = length() + 2;
-    if(n > alloc) { // doesnt fit
-        char *new_cp = new char[n];
-        alloc = n;
-        strcpy(new_cp, cp);
-        new_cp[n-2] = rhs;
-        new_cp[n-1] = 0;
-        delete[] cp;
-        cp = new_cp;
-    } else { // fits
-        cp[n-2] = rhs;
-        cp[n-1] = 0;
-    }
+    int n = length() + 1;
+    reserve(n, true);
+    cp[n-1] = rhs;
+    cp[n] = 0;
     return *this;
 }
 
 mstring& mstring :: operator+=(const char *rhs)
 {
-    int n = length() + strlen(rhs) + 1;
-//    printf("New n = %d.\n", n);
-    if(n > alloc) { // doesnt fit
-        char *new_cp = new char[n];
-        alloc = n;
-        strcpy(new_cp, cp);
-        strcat(new_cp, rhs);
-        delete[] cp;
-        cp = new_cp;
-//        printf("%s\n", new_cp);
-    } else { // fits
-//        printf("Fits!");
-        strcat(cp, rhs);
-    }
+    reserve(length() + strlen(rhs), true);
+    strcat(cp, rhs);
     return *this;
 }
 
 mstring& mstring :: operator+=(mstring &rhs)
 {
-    int n = length() + rhs.length() + 1;
-    if(n > alloc) { // doesnt fit
-        char *new_cp = new char[n];
-        alloc = n;
-        strcpy(new_cp, cp);
-        strcat(new_cp, rhs.cp);
-        delete[] cp;
-        cp = new_cp;
-    } else { // fits
-        strcat(cp, rhs.cp);
-    }
+    int n = length();
+    int m = rhs.length();
+    reserve(n + m, true); // may move our own characters, so rhs can be this
+    memmove(cp + n, (&rhs == this) ? cp : rhs.c_str(), m);
+    cp[n + m] = 0;
     return *this;
 }
 
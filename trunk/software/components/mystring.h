@@ -5,12 +5,17 @@
 #define NULL (0)
 #endif
 
+#define MSTRING_LOCAL 64 // strings up to this size, including the terminator, are not put on the heap
+
 class mstring
 {
 private:
     short temporary;
     short alloc;
     char *cp;
+    char local[MSTRING_LOCAL];
+
+    void reserve(int n, bool keep);
 public:
     mstring();
     mstring(const char *k);
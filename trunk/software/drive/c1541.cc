@@ -42,6 +42,8 @@ t_1541_rom rom_modes[] = { e_rom_1541, e_rom_1541c, e_rom_1541ii, e_rom_custom }
 #define CFG_C1541_C64RESET  0xD8
 #define CFG_C1541_GCRALIGN  0xDA
 #define CFG_C1541_STOPFREEZ 0xDB
+#define CFG_C1541_LAZYCONV  0xDC
+#define CFG_C1541_CACHESIZE 0xDD
 
 struct t_cfg_definition c1541_config[] = {
     { CFG_C1541_POWERED,   CFG_TYPE_ENUM,   "1541 Drive",                 "%s", en_dis,     0,  1, 1 },
@@ -52,6 +54,8 @@ struct t_cfg_definition c1541_config[] = {
     { CFG_C1541_C64RESET,  CFG_TYPE_ENUM,   "1541 Resets when C64 resets","%s", yes_no,     0,  1, 1 },
     { CFG_C1541_STOPFREEZ, CFG_TYPE_ENUM,   "1541 Freezes in menu",       "%s", yes_no,     0,  1, 1 },
     { CFG_C1541_GCRALIGN,  CFG_TYPE_ENUM,   "GCR Save Align Tracks",      "%s", yes_no,     0,  1, 1 },
+    { CFG_C1541_LAZYCONV,  CFG_TYPE_ENUM,   "1541 Lazy D64 Conversion",   "%s", yes_no,     0,  1, 1 },
+    { CFG_C1541_CACHESIZE, CFG_TYPE_VALUE,  "1541 Disk Image Cache",      "%d disks", NULL, 0,  DISK_CACHE_MAX_ENTRIES, 4 },
     
 //    { CFG_C1541_LASTMOUNT, CFG_TYPE_ENUM,   "Load last mounted disk",  "%s", yes_no,     0,  1, 0 },
     { 0xFF, CFG_TYPE_END,    "", "", NULL, 0, 0, 0 }
@@ -96,6 +100,10 @@ C1541 :: C1541(volatile uint8_t *regs, char letter) : SubSystem((letter == 'A')?
 
     gcr_image = new GcrImage();
     bin_image = new BinImage(drive_name.c_str());
+    disk_cache = new DiskImageCache(drive_name.c_str());
+    cache_fs = NULL;
+    cache_inode = 0;
+    cache_type = e_no_disk;
     
     sprintf(buffer, "1541 Drive %c Settings", letter);    
     register_store((uint32_t)regs, buffer, c1541_config);
@@ -106,17 +114,31 @@ C1541 :: C1541(volatile uint8_t *regs, char letter) : SubSystem((letter == 'A')?
     large_rom = false;
 
     taskHandle = 0;
+    writebackHandle = 0;
+    freeSlots = 0;
+    pendingSlots = 0;
+    binLock = 0;
+    slots = NULL;
+    memset(&wb_stats, 0, sizeof(wb_stats));
 }
 
 C1541 :: ~C1541()
 {
+	close_mount_file();
+	if (writebackHandle) {
+		vTaskDelete(writebackHandle);
+		vQueueDelete(freeSlots);
+		vQueueDelete(pendingSlots);
+		vSemaphoreDelete(binLock);
+		delete[] slots;
+	}
+
 	if(gcr_image)
 		delete gcr_image;
 	if(bin_image)
 		delete bin_image;
-
-	if(mount_file)
-		fm->fclose(mount_file);
+	if(disk_cache)
+		delete disk_cache;
 
 	// turn the drive off on destruction
     drive_power(false);
@@ -145,6 +167,8 @@ void C1541 :: effectuate_settings(void)
     set_hw_address(cfg->get_value(CFG_C1541_BUS_ID));
     set_sw_address(cfg->get_value(CFG_C1541_BUS_ID));
 
+    disk_cache->set_size(cfg->get_value(CFG_C1541_CACHESIZE));
+
     t_1541_rom rom = rom_modes[cfg->get_value(CFG_C1541_ROMSEL)];
     if((rom != current_rom)||
        (rom == e_rom_custom)) {
@@ -173,6 +197,15 @@ void C1541 :: init(void)
     registers[C1541_INSERTED] = 0;
     disk_state = e_no_disk;
 
+	slots = new t_track_snapshot[C1541_WRITEBACK_SLOTS];
+	freeSlots = xQueueCreate(C1541_WRITEBACK_SLOTS, sizeof(t_track_snapshot *));
+	pendingSlots = xQueueCreate(C1541_WRITEBACK_SLOTS, sizeof(t_track_snapshot *));
+	binLock = xSemaphoreCreateMutex();
+	for(int i=0;i<C1541_WRITEBACK_SLOTS;i++) {
+		t_track_snapshot *snap = &slots[i];
+		xQueueSend(freeSlots, &snap, 0);
+	}
+	xTaskCreate( C1541 :: writeback_task, "1541 Write Back", C1541_WRITEBACK_STACK, this, tskIDLE_PRIORITY + 1, &writebackHandle );
 	xTaskCreate( C1541 :: run, (const char *)(this->drive_name.c_str()), configMINIMAL_STACK_SIZE, this, tskIDLE_PRIORITY + 1, &taskHandle );
     effectuate_settings();
 }
@@ -189,6 +222,10 @@ int  C1541 :: fetch_task_items(Path *path, IndexedList<Action*> &item_list)
 		item_list.append(new Action(buffer, getID(), MENU_1541_REMOVE, 0));
 		items++;
 
+        sprintf(buffer, "Drive %c write-back status", drive_letter);
+		item_list.append(new Action(buffer, getID(), MENU_1541_WBSTATS, 0));
+		items++;
+
 		if (fm->is_path_writable(path))
         {
             sprintf(buffer, "Save disk in drive %c as D64", drive_letter);
@@ -375,18 +412,71 @@ void C1541 :: insert_disk(bool protect, GcrImage *image)
     last_mounted_drive = this;
 }
 
-void C1541 :: mount_d64(bool protect, uint8_t *image, uint32_t size)
+void C1541 :: convert_d64(void)
 {
-	if(mount_file) {
-		fm->fclose(mount_file);
+	if(cfg->get_value(CFG_C1541_LAZYCONV)) {
+		// only encode the directory track now; the rest follows once the drive runs
+		gcr_image->prepare_disk_bin2gcr(bin_image);
+		gcr_image->convert_pending_track(17);
+	} else {
+		gcr_image->convert_disk_bin2gcr(bin_image, NULL);
 	}
-	mount_file = NULL;
+}
+
+// Keeps the image of the disk that is about to be replaced in the cache,
+// but only when it matches the file it was loaded from. Closes the file.
+void C1541 :: stash_disk(void)
+{
+	if(!cache_inode)
+		return;
+	flush_writeback();
+	if(registers[C1541_ANYDIRTY] || write_skip) {
+		printf("Disk in drive %c has changes that are not in its file; not cached.\n", drive_letter);
+		cache_inode = 0;
+		return;
+	}
+	// Only once the file is closed, its time stamp is final; the close also
+	// drops any entry of this file that was cached before.
+	close_mount_file();
+	FileInfo info(INFO_SIZE);
+	if((fm->fstat(cache_path.c_str(), info) == FR_OK) && (info.fs == cache_fs) && (info.cluster == cache_inode)) {
+		if(disk_cache->store(&info, cache_type, &gcr_image, &bin_image)) {
+			printf("Disk in drive %c kept in cache.\n", drive_letter);
+		}
+	}
+	cache_inode = 0;
+}
+
+// Exchanges the current images for the cached images of this file, if any.
+bool C1541 :: fetch_cached(File *file, t_disk_state type)
+{
+	FileInfo info(INFO_SIZE);
+
+	cache_inode = 0;
+	if(fm->fstat(file->get_path(), info) != FR_OK)
+		return false;
+	cache_path  = file->get_path();
+	cache_fs    = info.fs;
+	cache_inode = info.cluster;
+	cache_type  = type;
+
+	if(disk_cache->take(&info, type, &gcr_image, &bin_image)) {
+		printf("Disk found in cache.\n");
+		return true;
+	}
+	return false;
+}
+
+void C1541 :: mount_d64(bool protect, uint8_t *image, uint32_t size)
+{
+	stash_disk();
+	close_mount_file();
 	remove_disk();
 
 	printf("Loading...");
 	bin_image->copy(image, size);
 	printf("Converting...");
-	gcr_image->convert_disk_bin2gcr(bin_image, NULL);
+	convert_d64();
 	printf("Inserting...");
 	insert_disk(protect, gcr_image);
 	printf("Done\n");
@@ -395,16 +485,17 @@ void C1541 :: mount_d64(bool protect, uint8_t *image, uint32_t size)
 
 void C1541 :: mount_d64(bool protect, File *file)
 {
-	if(mount_file) {
-		fm->fclose(mount_file);
-	}
+	stash_disk();
+	close_mount_file();
 	mount_file = file;
 	remove_disk();
 
-	printf("Loading...");
-	bin_image->load(file);
-	printf("Converting...");
-	gcr_image->convert_disk_bin2gcr(bin_image, NULL);
+	if(!fetch_cached(file, e_d64_disk)) {
+		printf("Loading...");
+		bin_image->load(file);
+		printf("Converting...");
+		convert_d64();
+	}
 	printf("Inserting...");
 	insert_disk(protect, gcr_image);
 	printf("Done\n");
@@ -413,14 +504,15 @@ void C1541 :: mount_d64(bool protect, File *file)
 
 void C1541 :: mount_g64(bool protect, File *file)
 {
-	if(mount_file) {
-		fm->fclose(mount_file);
-	}
+	stash_disk();
+	close_mount_file();
 	mount_file = file;
 	remove_disk();
 
-	printf("Loading...");
-	gcr_image->load(file);
+	if(!fetch_cached(file, e_gcr_disk)) {
+		printf("Loading...");
+		gcr_image->load(file);
+	}
 	printf("Inserting...");
 	insert_disk(protect, gcr_image);
 	printf("Done\n");
@@ -429,10 +521,8 @@ void C1541 :: mount_g64(bool protect, File *file)
 
 void C1541 :: mount_blank()
 {
-	if(mount_file) {
-		fm->fclose(mount_file);
-	}
-	mount_file = NULL;
+	stash_disk();
+	close_mount_file();
 	remove_disk();
     wait_ms(250);
 	gcr_image->blank();
@@ -495,7 +585,7 @@ void C1541 :: swap_disk()
 
             printf("Disk Swap: %s -> %s\n", mount_file->get_path(), path);
 
-            if (strncmp(type, "D64", 3) == 0) {
+            if ((strncmp(type, "D64", 3) == 0) || (strncmp(type, "D71", 3) == 0)) {
                 mount_d64(false, f);
             }
             else if(strncmp(type, "G64", 3) == 0) {
@@ -520,18 +610,58 @@ void C1541 :: run(void *a)
 {
 	C1541 *drv = (C1541 *)a;
 	while(1) {
+		bool busy = false;
 		if(drv->lock(drv->drive_name.c_str())) {
+			busy = drv->convert_lazy_tracks();
 			drv->poll();
 			drv->unlock();
 		}
-		vTaskDelay(50);
+		vTaskDelay(busy ? 1 : 50); // stay close to the head while tracks are still being encoded
+	}
+}
+
+// Encodes the tracks of a lazily mounted D64: the track under the head
+// first, then its neighbours, then whatever is left, a few per call.
+// Returns true as long as there are tracks left to encode.
+bool C1541 :: convert_lazy_tracks() // called under mutex
+{
+	if(!gcr_image->pending_tracks())
+		return false;
+
+	int head = registers[C1541_TRACK] >> 1;
+	int order[] = { head, head + 1, head - 1, head + 2, head - 2 };
+	int converted = 0;
+
+	for(int i=0;(i<5) && (converted < 3);i++) {
+		if(convert_lazy_track(order[i]))
+			converted++;
+	}
+	for(int tr=0;(tr<C1541_MAXTRACKS/2) && (converted == 0);tr++) {
+		if(convert_lazy_track(tr))
+			converted++;
+	}
+	return (gcr_image->pending_tracks() != 0);
+}
+
+bool C1541 :: convert_lazy_track(int tr)
+{
+	if((tr < 0) || (tr >= C1541_MAXTRACKS/2))
+		return false;
+	// the drive may have formatted the track already; its data wins
+	if(registers[C1541_DIRTYFLAGS + tr]) {
+		gcr_image->skip_pending_track(tr);
+		return false;
 	}
+	// the write back task may be updating the binary image
+	xSemaphoreTake(binLock, portMAX_DELAY);
+	bool converted = gcr_image->convert_pending_track(tr);
+	xSemaphoreGive(binLock);
+	return converted;
 }
 
 void C1541 :: poll() // called under mutex
 {
 	int tr;
-	int written;
 
 //	printf("%02d ", registers[C1541_TRACK]);
 
@@ -541,8 +671,7 @@ void C1541 :: poll() // called under mutex
 	if (!mount_file->isValid()) {
         printf("C1541: File was invalidated..\n");
         disk_state = e_disk_file_closed;
-        fm->fclose(mount_file);
-        mount_file = NULL;
+        close_mount_file();
         return;
     }
     if((disk_state != e_gcr_disk)&&(disk_state != e_d64_disk)) {
@@ -554,26 +683,12 @@ void C1541 :: poll() // called under mutex
 			registers[C1541_ANYDIRTY] = 0;  // clear flag once we didn't skip anything anymore
 		}
 		write_skip = 0;
-		for(tr=0,written=0;tr<C1541_MAXTRACKS/2;tr++) {
+		for(tr=0;tr<C1541_MAXTRACKS/2;tr++) {
 			if(registers[C1541_DIRTYFLAGS + tr]) {
 				if((!(registers[C1541_STATUS] & DRVSTAT_MOTOR)) || ((registers[C1541_TRACK] >> 1) != tr)) {
-					registers[C1541_DIRTYFLAGS + tr] = 0;
-					switch(disk_state) {
-					case e_gcr_disk:
-						printf("Writing back GCR track %d.0...\n", tr+1);
-						gcr_image->write_track(tr*2, mount_file, cfg->get_value(CFG_C1541_GCRALIGN));
-						break;
-					case e_d64_disk:
-						printf("Writing back binary track %d...\n", tr+1);
-						bin_image->write_track(tr, gcr_image, mount_file);
-						break;
-                    case e_disk_file_closed:
-                        printf("Track %d cant be written back to closed file. Lost..\n", tr+1);
-                        break;
-					default:
-						printf("Diskstate error, can't output track %d.\n", tr+1);
+					if(!queue_track(tr)) {
+						write_skip ++; // no free slot; try again on the next poll
 					}
-					written++;
 				} else {
 //                    printf("C1541 writeback: Skip: TR %d. CUR %d. ST: %b\n", tr, registers[C1541_TRACK] >> 1, registers[C1541_STATUS]);
 					write_skip ++;
@@ -583,6 +698,127 @@ void C1541 :: poll() // called under mutex
 	}
 }
 
+// Takes a snapshot of a dirty track and hands it to the write back task.
+// Returns false when not enough slots are free; the track then stays dirty.
+// The dirty flag covers the half track above the track as well, so on G64
+// files that have a place for it, that one is written back too.
+bool C1541 :: queue_track(int tr)
+{
+	bool half = (disk_state == e_gcr_disk) && gcr_image->track_in_file(2*tr + 1);
+
+	if((int)uxQueueMessagesWaiting(freeSlots) < (half ? 2 : 1)) {
+		wb_stats.stalls++;
+		return false;
+	}
+	// clear the flag before copying, such that writes during the copy mark it again.
+	// What the drive wrote is in the track now; it is never encoded from the binary
+	// image anymore, as that one is only updated once the snapshot has been written.
+	gcr_image->skip_pending_track(tr);
+	registers[C1541_DIRTYFLAGS + tr] = 0;
+
+	if(gcr_image->track_address[2*tr] != gcr_image->dummy_track) {
+		queue_snapshot(2*tr);
+	}
+	if(half) {
+		queue_snapshot(2*tr + 1);
+	}
+
+	int in_use = C1541_WRITEBACK_SLOTS - (int)uxQueueMessagesWaiting(freeSlots);
+	if(in_use > wb_stats.peak)
+		wb_stats.peak = in_use;
+	return true;
+}
+
+// Copies one track of the image (half tracks included) into a free slot.
+// Only the drive task takes slots, so the caller can check for them in advance.
+void C1541 :: queue_snapshot(int index)
+{
+	t_track_snapshot *snap;
+
+	if(!xQueueReceive(freeSlots, &snap, 0)) {
+		return;
+	}
+	int length = gcr_image->track_length[index];
+	if(length > C1541_MAXTRACKLEN)
+		length = C1541_MAXTRACKLEN;
+
+	snap->track  = index >> 1;
+	snap->half   = (index & 1) != 0;
+	snap->length = length;
+	snap->offset = gcr_image->get_track_offset(index);
+	snap->align  = (cfg->get_value(CFG_C1541_GCRALIGN) != 0);
+	snap->state  = disk_state;
+	snap->file   = mount_file;
+	memcpy(snap->data, gcr_image->track_address[index], length);
+
+	xQueueSend(pendingSlots, &snap, 0);
+	wb_stats.queued++;
+}
+
+// static member
+void C1541 :: writeback_task(void *a)
+{
+	C1541 *drv = (C1541 *)a;
+	t_track_snapshot *snap;
+	while(1) {
+		if(xQueueReceive(drv->pendingSlots, &snap, portMAX_DELAY)) {
+			drv->write_snapshot(snap);
+			// flush once the queue has drained, rather than after every track
+			if(uxQueueMessagesWaiting(drv->pendingSlots) == 0) {
+				snap->file->sync();
+			}
+			xQueueSend(drv->freeSlots, &snap, portMAX_DELAY);
+		}
+	}
+}
+
+void C1541 :: write_snapshot(t_track_snapshot *snap)
+{
+	int sectors;
+
+	switch(snap->state) {
+	case e_gcr_disk:
+		printf("Writing back GCR track %d.%d...\n", snap->track+1, (snap->half)?5:0);
+		if(!GcrImage :: write_track(snap->data, snap->length, snap->offset, snap->file, snap->align)) {
+			wb_stats.errors++;
+		}
+		break;
+	case e_d64_disk:
+		xSemaphoreTake(binLock, portMAX_DELAY);
+		sectors = bin_image->write_track(snap->track, snap->data, snap->length, snap->file);
+		xSemaphoreGive(binLock);
+		printf("Writing back binary track %d: %d sectors changed.\n", snap->track+1, sectors);
+		if(sectors < 0) {
+			wb_stats.errors++;
+		}
+		break;
+	default:
+		printf("Diskstate error, can't output track %d.\n", snap->track+1);
+		wb_stats.errors++;
+	}
+	wb_stats.written++;
+}
+
+// Waits until all queued tracks have been written. Must be called before
+// the mounted file is closed, or the binary image is used for anything else.
+void C1541 :: flush_writeback(void)
+{
+	if(!freeSlots)
+		return;
+	while(uxQueueMessagesWaiting(freeSlots) != C1541_WRITEBACK_SLOTS) {
+		vTaskDelay(1);
+	}
+}
+
+void C1541 :: close_mount_file(void)
+{
+	flush_writeback();
+	if(mount_file) {
+		fm->fclose(mount_file);
+	}
+	mount_file = NULL;
+}
+
 int C1541 :: executeCommand(SubsysCommand *cmd)
 {
 	bool g64;
@@ -708,10 +944,8 @@ int C1541 :: executeCommand(SubsysCommand *cmd)
 		break;
 	case MENU_1541_REMOVE:
         check_if_save_needed(cmd);
-		if(mount_file) {
-			fm->fclose(mount_file);
-			mount_file = NULL;
-		}
+		stash_disk();
+		close_mount_file();
 		remove_disk();
 		break;
     case MENU_1541_BLANK:
@@ -728,6 +962,9 @@ int C1541 :: executeCommand(SubsysCommand *cmd)
     case MENU_1541_SWAP:
         swap_disk();
         break;
+    case MENU_1541_WBSTATS:
+        show_writeback_stats(cmd);
+        break;
 	default:
 		printf("Unhandled menu item for C1541.\n");
 		return -1;
@@ -738,10 +975,17 @@ int C1541 :: executeCommand(SubsysCommand *cmd)
 void C1541 :: unlink(void)
 {
 	disk_state = e_disk_file_closed;
-	if(mount_file) {
-		fm->fclose(mount_file);
-		mount_file = NULL;
-	}
+	close_mount_file();
+}
+
+void C1541 :: show_writeback_stats(SubsysCommand *cmd)
+{
+	char buffer[64];
+	int in_use = C1541_WRITEBACK_SLOTS - (int)uxQueueMessagesWaiting(freeSlots);
+	int stack_free = (int)uxTaskGetStackHighWaterMark(writebackHandle);
+	sprintf(buffer, "Q:%d W:%d Busy:%d/%d Stall:%d Err:%d Stk:%d", wb_stats.queued, wb_stats.written,
+			in_use, wb_stats.peak, wb_stats.stalls, wb_stats.errors, stack_free);
+	cmd->user_interface->popup(buffer, BUTTON_OK);
 }
 
 void C1541 :: save_disk_to_file(SubsysCommand *cmd)
@@ -753,6 +997,8 @@ void C1541 :: save_disk_to_file(SubsysCommand *cmd)
 
 	res = cmd->user_interface->string_box("Give name for image file..", buffer, 24);
 	if(res > 0) {
+		flush_writeback(); // the write back task may still be using the binary image
+		gcr_image->convert_all_pending();
 		set_extension(buffer, (cmd->mode)?(char *)".g64":(char *)".d64", 32);
 		fix_filename(buffer);
 		fres = fm->fopen(cmd->path.c_str(), buffer, FA_WRITE | FA_CREATE_ALWAYS | FA_CREATE_NEW, &file);
@@ -762,7 +1008,7 @@ void C1541 :: save_disk_to_file(SubsysCommand *cmd)
 				gcr_image->save(file, (cfg->get_value(CFG_C1541_GCRALIGN)!=0), cmd->user_interface);
 				cmd->user_interface->hide_progress();
 			} else {
-				cmd->user_interface->show_progress("Converting disk...", 2*bin_image->num_tracks);
+				cmd->user_interface->show_progress("Converting disk...", 2 * bin_image->gcr_tracks());
 				gcr_image->convert_disk_gcr2bin(bin_image, cmd->user_interface);
 				cmd->user_interface->update_progress("Saving D64...", 0);
 				bin_image->save(file, cmd->user_interface);
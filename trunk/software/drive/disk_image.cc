@@ -9,6 +9,7 @@
 #include "filemanager.h"
 
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -34,36 +35,37 @@ __inline uint32_t le_to_cpu_32(uint32_t a)
 
 extern uint8_t bam_header[];
 
-#define HARDWARE_ENCODING 1
-
-// Single nibble GCR table
-const uint8_t gcr_table[] = { 0x0A, 0x0B, 0x12, 0x13, 0x0E, 0x0F, 0x16, 0x17,
-                           0x09, 0x19, 0x1A, 0x1B, 0x0D, 0x1D, 0x1E, 0x15 };
-
 const int track_lengths[] =      { 0x1E00, 0x1BE0, 0x1A00, 0x1860, 0x1E00, 0x1BE0, 0x1A00, 0x1860 };
 const int sectors_per_track [] = { 21, 19, 18, 17, 21, 19, 18, 17 };
 const int region_end[] =         { 17, 24, 30, 35, 52, 59, 65, 70 };
 const int sector_gap_lengths[] = {  9, 19, 13, 10,  9, 19, 13, 10 };
 
-#if HARDWARE_ENCODING == 0
-static uint8_t gcr_table_hi_0[256];
-static uint8_t gcr_table_lo_0[256];
-static uint8_t gcr_table_hi_2[256];
-static uint8_t gcr_table_lo_2[256];
-static uint8_t gcr_table_hi_4[256];
-static uint8_t gcr_table_lo_4[256];
-static uint8_t gcr_table_hi_6[256];
-static uint8_t gcr_table_lo_6[256];
-static bool gcr_table_initialized = false;
-#endif
+const t_disk_geometry geometry_d64 = { "D64", 1, C1541_MAXTRACKS/2, 35, 4,
+		region_end, sectors_per_track, track_lengths, sector_gap_lengths };
+const t_disk_geometry geometry_d71 = { "D71", 2, 35, 70, 8,
+		region_end, sectors_per_track, track_lengths, sector_gap_lengths };
 
-int track_to_region(int track)
+int t_disk_geometry :: region(int track) const
 {
-    for(int i=0;i<4;i++) {
+    for(int i=0;i<regions;i++) {
         if(track < region_end[i])
             return i;
     }
-    return 3; // illegal
+    return regions - 1; // extended tracks use the slowest zone
+}
+
+uint32_t t_disk_geometry :: data_size(int tracks) const
+{
+    uint32_t size = 0;
+    for(int i=0;i<tracks;i++) {
+        size += 256 * sectors(i);
+    }
+    return size;
+}
+
+int track_to_region(int track)
+{
+    return geometry_d64.region(track);
 }
 
 int total_sectors_before_track(int track)
@@ -78,26 +80,7 @@ int count = 0;
 
 GcrImage :: GcrImage(void)
 {
-#if HARDWARE_ENCODING == 0
-    WORD gcr;
-    if(!(gcr_table_initialized)) {
-        for(int i=0;i<256;i++) {
-            gcr = gcr_table[i & 15] | (WORD(gcr_table[i >> 4]) << 5);
-            gcr_table_hi_0[i] = uint8_t(gcr >> 8);
-            gcr_table_lo_0[i] = uint8_t(gcr & 0xFF);
-            gcr <<= 2;
-            gcr_table_hi_2[i] = uint8_t(gcr >> 8);
-            gcr_table_lo_2[i] = uint8_t(gcr & 0xFF);
-            gcr <<= 2;
-            gcr_table_hi_4[i] = uint8_t(gcr >> 8);
-            gcr_table_lo_4[i] = uint8_t(gcr & 0xFF);
-            gcr <<= 2;
-            gcr_table_hi_6[i] = uint8_t(gcr >> 8);
-            gcr_table_lo_6[i] = uint8_t(gcr & 0xFF);
-        }
-        gcr_table_initialized = true;
-    }
-#endif
+    GcrCodec :: init();
     gcr_image = gcr_data; // point to my own array
 //    mounted_on = NULL;
 
@@ -110,6 +93,9 @@ GcrImage :: GcrImage(void)
 
 void GcrImage :: invalidate(void)
 {
+    lazy_source = NULL;
+    lazy_pending = 0;
+    loaded_size = 0;
     for(int i=0;i<C1541_MAXTRACKS;i++) {
     	track_address[i] = dummy_track;
     	track_length[i] = C1541_MAX_GCR_LEN;
@@ -118,6 +104,7 @@ void GcrImage :: invalidate(void)
 
 void GcrImage :: blank(void)
 {
+    invalidate();
 	memset(gcr_data, 0x00, C1541_MAX_GCR_LEN);
 
     uint8_t *gcr = gcr_image; // internal storage
@@ -132,41 +119,53 @@ void GcrImage :: blank(void)
         track_length[i + 1] = length;
         gcr += length;
     }
+    allocate_half_tracks(gcr, 0x00);
 }
-    
-GcrImage :: ~GcrImage(void)
+
+// Gives the half tracks that have no data of their own a buffer in the free
+// part of gcr_data, with the length of the track before it. This way, data
+// that the drive writes onto a half track is kept, instead of going to the
+// dummy track that all missing tracks share.
+void GcrImage :: allocate_half_tracks(uint8_t *free, uint8_t fill)
 {
-//    if(mounted_on)
-//        mounted_on->remove_disk();
+    for(int i=1;i<C1541_MAXTRACKS;i+=2) {
+        if((track_address[i] != dummy_track) || (track_address[i-1] == dummy_track))
+            continue;
+        int length = track_length[i-1];
+        if((free + length) > dummy_track)
+            break;
+        memset(free, fill, length);
+        track_address[i] = free;
+        track_length[i] = length;
+        free += length;
+    }
 }
 
-// aaaabbbb ccccdddd eeeeffff gggghhhh
-// AAAAABBB BBCCCCCD DDDDEEEE EFFFFFGG GGGHHHHH
-// ab => 0/1, shift = 6;
-// cd => 1/2, shift = 4;
-// ef => 2/3, shift = 2;
-// gh => 3/4, shift = 0;
-
-uint8_t *GcrImage :: convert_block_bin2gcr(uint8_t *bin, uint8_t *gcr, int len)
+// A track that is filled with one value only has never been written.
+bool GcrImage :: is_blank_track(int track)
 {
-    uint32_t *dw = (uint32_t *)bin;
-	for(int i=0;i<len;i+=4) {
-#if HARDWARE_ENCODING > 0
-    	GCR_ENCODER_BIN_IN_32 = *(dw++);
-		*(gcr++) = GCR_ENCODER_GCR_OUT0;
-    	*(gcr++) = GCR_ENCODER_GCR_OUT1;
-    	*(gcr++) = GCR_ENCODER_GCR_OUT2;
-    	*(gcr++) = GCR_ENCODER_GCR_OUT3;
-    	*(gcr++) = GCR_ENCODER_GCR_OUT4;
-#else
-   	   *(gcr++) = gcr_table_hi_6[bin[i+0]];
-       *(gcr++) = gcr_table_lo_6[bin[i+0]] | gcr_table_hi_4[bin[i+1]];
-       *(gcr++) = gcr_table_lo_4[bin[i+1]] | gcr_table_hi_2[bin[i+2]];
-       *(gcr++) = gcr_table_lo_2[bin[i+2]] | gcr_table_hi_0[bin[i+3]];
-       *(gcr++) = gcr_table_lo_0[bin[i+3]];
-#endif
+    uint8_t *p = track_address[track];
+    if(p == dummy_track)
+        return true;
+    for(int i=1;i<track_length[track];i++) {
+        if(p[i] != p[0])
+            return false;
     }
-    return gcr;
+    return true;
+}
+
+// Tells whether a track has its own place in the G64 file it was loaded from.
+bool GcrImage :: track_in_file(int track)
+{
+    if(track_address[track] == dummy_track)
+        return false;
+    return get_track_offset(track) < loaded_size;
+}
+    
+GcrImage :: ~GcrImage(void)
+{
+//    if(mounted_on)
+//        mounted_on->remove_disk();
 }
 
 uint8_t *GcrImage :: convert_track_bin2gcr(int track, uint8_t *bin, uint8_t *gcr, uint8_t *errors, int errors_size)
@@ -222,7 +221,7 @@ uint8_t *GcrImage :: convert_track_bin2gcr(int track, uint8_t *bin, uint8_t *gcr
 			for(int i=0;i<5;i++)
 				*(gcr++) = 0x00;
 		}
-        gcr = convert_block_bin2gcr(header, gcr, 8);
+        gcr = GcrCodec :: encode_block(header, gcr, 8);
 
         // put 9 gap bytes
         for(int i=0;i<9;i++)
@@ -253,7 +252,7 @@ uint8_t *GcrImage :: convert_track_bin2gcr(int track, uint8_t *bin, uint8_t *gcr
 		}
 
         // insert (converted) sector
-        gcr = convert_block_bin2gcr(sector_buffer, gcr, 260);
+        gcr = GcrCodec :: encode_block(sector_buffer, gcr, 260);
 
         for(int i=0;i<sector_gap_lengths[region];i++)
             *(gcr++) = 0x55;
@@ -266,71 +265,11 @@ uint8_t *GcrImage :: convert_track_bin2gcr(int track, uint8_t *bin, uint8_t *gcr
     return gcr;
 }
 
-uint8_t *GcrImage :: find_sync(uint8_t *gcr_data, uint8_t *begin, uint8_t *end)
-{
-    bool wrap = false;
-    int sync_count = 0;
-
-    do {
-        if(*gcr_data == 0xFF) {
-            sync_count++;
-        } else {
-            if(sync_count > 2)
-                return gcr_data; // byte after sync
-            sync_count = 0;
-        }
-		if(gcr_data < end) {
-    		gcr_data++;
-        } else {
-            if(wrap)
-                return NULL;
-            wrap = true;
-            gcr_data = begin;
-        }
-    } while(1);
-    return NULL;
-}
-
-inline void conv_5bytes_gcr2bin(uint8_t **gcr, uint8_t *bin)
-{
-	uint8_t *b = *gcr;
-//	printf("[%p: %b %b %b %b %b]\n", b, b[0], b[1], b[2], b[3], b[4]);
-	GCR_DECODER_GCR_IN = *(b++);
-	GCR_DECODER_GCR_IN = *(b++);
-	GCR_DECODER_GCR_IN = *(b++);
-	GCR_DECODER_GCR_IN = *(b++);
-	GCR_DECODER_GCR_IN = *(b++);
-	*(bin++) = GCR_DECODER_BIN_OUT0;
-	*(bin++) = GCR_DECODER_BIN_OUT1;
-	*(bin++) = GCR_DECODER_BIN_OUT2;
-	*(bin++) = GCR_DECODER_BIN_OUT3;
-	*gcr = b;
-}
-
-uint8_t *GcrImage :: wrap(uint8_t **current, uint8_t *begin, uint8_t *end, int count, uint8_t *buffer)
-{
-    uint8_t *gcr = *current;
-
-    if(gcr > (end - count)) {
-		uint8_t *d = buffer;
-		uint8_t *s = gcr;
-        *current = (gcr + count) - (end - begin);
-		while((s < end)&&(count--))
-			*(d++) = *(s++);
-		s = begin;
-		while(count--)
-			*(d++) = *(s++);
-		return buffer; // set decode pointer to the scratch pad
-	}
-    *current = gcr + count;
-	return gcr;
-}
-    
 int GcrImage :: convert_disk_gcr2bin(BinImage *bin_image, UserInterface *user_interface)
 {
     int errors = 0;
     int result = 0;
-    for(int track=0;track<bin_image->num_tracks;track++) {
+    for(int track=0;track<bin_image->gcr_tracks();track++) {
         result = convert_track_gcr2bin(track, bin_image);
         if(result)
             errors ++;
@@ -342,106 +281,20 @@ int GcrImage :: convert_disk_gcr2bin(BinImage *bin_image, UserInterface *user_in
 
 int GcrImage :: convert_gcr_track_to_bin(uint8_t *gcr, int trackNumber, int trackLen, int maxSector, uint8_t *bin, uint8_t *status)
 {
-	static uint8_t header[8];
-	int t, s;
-
-    uint8_t *begin;
-	uint8_t *end;
-	uint8_t *current;
-	uint8_t *dest;
-    uint8_t *gcr_data;
-	uint8_t *new_gcr;
-	uint8_t *st = status;
-
-	bool  expect_data = false;
-	bool  wrapped = false;
-
-	current = gcr;
-	begin = gcr;
-	end = begin + trackLen;
-	gcr = begin;
-
-	int secs = 0;
-	uint8_t sector_buffer[352];
-
-	while(secs < maxSector) {
-
-		new_gcr = find_sync(current, begin, end);
-        if(new_gcr < current) {
-        	if (wrapped) {
-        		break;
-        	}
-            wrapped = true;
-        }
-        current = new_gcr;
-
-        gcr_data = wrap(&current, begin, end, 5, sector_buffer);
-		conv_5bytes_gcr2bin(&gcr_data, &header[0]);
-		if(header[0] == 8) {
-            gcr_data = wrap(&current, begin, end, 5, sector_buffer);
-			conv_5bytes_gcr2bin(&gcr_data, &header[4]);
-			t = (int)header[3];
-			s = (int)header[2];
-			dest = bin + (256 * s);
-
-			// We found a header, but we are expecting data
-			if (expect_data) {
-				if (st) {
-					*(st++) = 0xE4;
-				}
-			}
-
-			// new sector, store sector number
-			if (st) {
-				*(st++) = s;
-			}
-
-			if(t != trackNumber) {
-				if (st) {
-					*(st++) = 0xE1;
-				}
-			}
-			if(s >= maxSector) {
-				if (st) {
-					*(st++) = 0xE2;
-				}
-			}
-			expect_data = true;
-			continue;
-		}
-
-		if(header[0] == 7) {
-			if(!expect_data) {
+    int secs = GcrCodec :: decode_track(gcr, trackNumber, trackLen, maxSector, bin, status, NULL);
+    if(secs < maxSector) // maybe not written byte aligned
+        secs = GcrCodec :: decode_track_bits(gcr, trackNumber, trackLen, maxSector, bin, status, NULL);
+    return secs;
+}
 
-			} else {
-				expect_data = false;
-				secs++;
-				uint8_t *binarySector = dest;
-				memcpy(dest, &header[1], 3);
-				dest += 3;
-                gcr_data = wrap(&current, begin, end, 320, sector_buffer);
-				for(int i=0;i<63;i++) {
-					conv_5bytes_gcr2bin(&gcr_data, dest);
-					dest+=4;
-				}
-				conv_5bytes_gcr2bin(&gcr_data, &header[4]);
-				*(dest++) = header[4];
-
-				if (st) {
-					uint8_t chk = 0;
-					for (int i=0;i<256;i++) {
-						chk ^= *(binarySector++);
-					}
-					if (chk != header[5]) {
-						*(st++) = 0xE3;
-					} else {
-						*(st++) = 0x00;
-					}
-				}
-			}
-		}
-	}
-	return secs;
+int GcrImage :: get_sector_map(int track, t_gcr_sector_map *map)
+{
+    int secs = GcrCodec :: decode_track(track_address[track], (track >> 1) + 1, track_length[track],
+                                        GCR_MAX_SECTORS, NULL, NULL, map);
+    if(!secs)
+        secs = GcrCodec :: decode_track_bits(track_address[track], (track >> 1) + 1, track_length[track],
+                                             GCR_MAX_SECTORS, NULL, NULL, map);
+    return secs;
 }
 
 int GcrImage :: convert_track_gcr2bin(int track, BinImage *bin_image)
@@ -463,25 +316,76 @@ int GcrImage :: convert_track_gcr2bin(int track, BinImage *bin_image)
 }
 
 void GcrImage :: convert_disk_bin2gcr(BinImage *bin_image, UserInterface *user_interface)
+{
+    prepare_disk_bin2gcr(bin_image);
+
+    for(int i=0;i<bin_image->gcr_tracks();i++) {
+        convert_pending_track(i);
+        if(user_interface)
+            user_interface->update_progress(NULL, 1);
+    }
+}
+
+// Sets up the track layout for a binary image, without encoding anything yet.
+// Every track of a region has the same encoded length, so the addresses are
+// known up front and can be handed to the drive right away. The tracks are
+// filled with gap bytes, such that the drive finds no sync until the track
+// has been encoded with convert_pending_track().
+void GcrImage :: prepare_disk_bin2gcr(BinImage *bin_image)
 {
 	id1 = bin_image->bin_data[91554];
     id2 = bin_image->bin_data[91555];
 
     uint8_t *gcr = gcr_image; // internal storage
-    uint8_t *newgcr;
 
     invalidate();
 
-    for(int i=0;i<bin_image->num_tracks;i++) {
+    int tracks = bin_image->gcr_tracks();
+    for(int i=0;i<tracks;i++) {
 //        printf("Track %d starts at: %7x\n", i+1, gcr);
+        int length = track_lengths[track_to_region(i)];
+        memset(gcr, 0x55, length);
         track_address[2*i] = gcr;
-        newgcr = convert_track_bin2gcr(i, bin_image->track_start[i], gcr, bin_image->errors, bin_image->error_size);
-        track_length[2*i] = int(newgcr - gcr);
+        track_length[2*i] = length;
 		track_address[2*i + 1] = dummy_track;
-        track_length[2*i + 1] = int(newgcr - gcr);
-        gcr = newgcr;
-        if(user_interface)
-            user_interface->update_progress(NULL, 1);
+        track_length[2*i + 1] = length;
+        track_pending[i] = true;
+        gcr += length;
+    }
+    allocate_half_tracks(gcr, 0x55);
+    for(int i=tracks;i<C1541_MAXTRACKS/2;i++) {
+        track_pending[i] = false;
+    }
+    lazy_source = bin_image;
+    lazy_pending = tracks;
+}
+
+// Encodes one track (0 based) if it was not encoded yet. Returns true if work was done.
+bool GcrImage :: convert_pending_track(int track)
+{
+    if((track < 0) || (track >= C1541_MAXTRACKS/2) || !track_pending[track] || !lazy_source)
+        return false;
+
+    convert_track_bin2gcr(track, lazy_source->track_start[track], track_address[2*track],
+    		lazy_source->errors, lazy_source->error_size);
+    skip_pending_track(track);
+    return true;
+}
+
+// Marks a track as done without encoding it, e.g. when the drive already wrote it.
+void GcrImage :: skip_pending_track(int track)
+{
+    if((track < 0) || (track >= C1541_MAXTRACKS/2) || !track_pending[track])
+        return;
+    track_pending[track] = false;
+    if(--lazy_pending == 0)
+        lazy_source = NULL;
+}
+
+void GcrImage :: convert_all_pending(void)
+{
+    for(int i=0;(i<C1541_MAXTRACKS/2) && lazy_pending;i++) {
+        convert_pending_track(i);
     }
 }
 
@@ -493,6 +397,7 @@ bool GcrImage :: load(File *f)
     uint8_t *tr;
     uint16_t w;
 
+    invalidate();
     FRESULT res = f->read(gcr_data, C1541_MAX_GCR_LEN, &bytes_read);
 
     printf("Total bytes read: %d.\n", bytes_read);
@@ -527,32 +432,53 @@ bool GcrImage :: load(File *f)
             track_length[i] = (int)w;
     	}
     }
+    loaded_size = bytes_read;
+    allocate_half_tracks(gcr_data + ((bytes_read + 3) & ~3), 0x55);
     return true;
 }
 
-int GcrImage :: find_track_start(int track)
+// Returns the bit position at which the sync of sector 0 starts, or 0 when
+// sector 0 cannot be found. Tracks that were not written byte aligned are
+// searched bit by bit.
+int GcrImage :: find_track_start(uint8_t *begin, int length)
 {
-    uint8_t *begin = track_address[track];
-    uint8_t *end   = track_address[track] + track_length[track];
-    uint8_t *gcr = begin;
-    uint8_t *gcr_data;
-    int offset;
-    
-    for(int j=0;j<42;j++) { // try at maximum twice for each sector (two syncs per sector!)
-        gcr = find_sync(gcr, begin, end);
-        if(!gcr)
-            return 0;
-        gcr_data = wrap(&gcr, begin, end, 5, sector_buffer);
-    	conv_5bytes_gcr2bin(&gcr_data, &header[0]);
-    	if((header[0] == 8)&&(header[2] == 0)) {
-            // sector 0 found!
-            offset = (gcr - begin) - 10;
-            if(offset < 0)
-                offset += track_length[track];
-            return offset;
-        }
+    t_gcr_sector_map map;
+    GcrCodec :: decode_track(begin, 0, length, GCR_MAX_SECTORS, NULL, NULL, &map);
+    if(map.header[0] < 0)
+        GcrCodec :: decode_track_bits(begin, 0, length, GCR_MAX_SECTORS, NULL, NULL, &map);
+    if(map.header[0] < 0)
+        return 0;
+
+    // sector 0 found! Start the track at its sync; this puts the header on a byte boundary.
+    int start = (8 * map.header[0]) + map.header_bit[0] - 40;
+    if(start < 0)
+        start += 8 * length;
+    return start;
+}
+
+// Writes a track such that it starts at the given bit position.
+FRESULT GcrImage :: write_aligned(uint8_t *data, int length, int start, File *f, uint32_t *written)
+{
+    uint32_t bw2 = 0;
+    FRESULT res;
+
+    if(start & 7) {
+        uint8_t *rotated = new uint8_t[length];
+        GcrCodec :: extract_bits(data, length, start, rotated, length);
+        res = f->write(rotated, length, written);
+        delete[] rotated;
+        return res;
+    }
+    start >>= 3;
+    if(start > 0) {
+        res = f->write(data+start, length-start, written);
+        if((res != FR_OK) || (*written != (uint32_t)(length-start)))
+            return res;
+        res = f->write(data, start, &bw2);
+        *written += bw2;
+        return res;
     }
-    return 0;    
+    return f->write(data, length, written);
 }
     
 bool GcrImage :: save(File *f, bool align, UserInterface *user_interface)
@@ -568,9 +494,15 @@ bool GcrImage :: save(File *f, bool align, UserInterface *user_interface)
     uint32_t *pul = (uint32_t *)&header[12]; // because 12 is a multiple of 4, we can do this
 
     uint32_t track_start = 12 + C1541_MAXTRACKS * 8;
+
+    // half tracks are only stored when they were loaded or written to
+    bool skip_track[C1541_MAXTRACKS];
+    for(int i=0;i<C1541_MAXTRACKS;i++) {
+        skip_track[i] = (track_address[i] == dummy_track)||(!track_address[i])||((i & 1) && is_blank_track(i));
+    }
     
     for(int i=0;i<C1541_MAXTRACKS;i++) {
-        if((track_address[i] == dummy_track)||(!track_address[i]))
+        if(skip_track[i])
             *(pul++) = 0;
         else {
             *(pul++) = cpu_to_le_32(track_start);
@@ -585,7 +517,7 @@ bool GcrImage :: save(File *f, bool align, UserInterface *user_interface)
         else if(i<60) speed = 1;
         else speed = 0;
 
-        if((track_address[i] == dummy_track)||(!track_address[i]))
+        if(skip_track[i])
             *(pul++) = 0;
         else 
             *(pul++) = cpu_to_le_32(speed);
@@ -605,7 +537,7 @@ bool GcrImage :: save(File *f, bool align, UserInterface *user_interface)
     uint8_t size[2];
     int skipped = 0;
     for(int i=0;i<C1541_MAXTRACKS;i++) {
-        if((track_address[i] == dummy_track)||(!track_address[i])) {
+        if(skip_track[i]) {
             skipped++;
             continue;
         }
@@ -618,15 +550,8 @@ bool GcrImage :: save(File *f, bool align, UserInterface *user_interface)
         // find alignment
         int start = 0;
         if(align)
-            start = find_track_start(i);
-        if(start > 0) {
-            res = f->write(track_address[i]+start, track_length[i]-start, &bytes_written);
-            if(bytes_written != (track_length[i]-start))
-                break;
-            res = f->write(track_address[i], start, &bytes_written);
-        } else {
-        	res = f->write(track_address[i], track_length[i], &bytes_written);
-        }
+            start = find_track_start(track_address[i], track_length[i]);
+        res = write_aligned(track_address[i], track_length[i], start, f, &bytes_written);
         if(res != FR_OK)
             break;
         res = f->write(filler_bytes, C1541_MAXTRACKLEN - track_length[i], &bytes_written);
@@ -646,11 +571,17 @@ bool GcrImage :: save(File *f, bool align, UserInterface *user_interface)
     
 bool GcrImage :: write_track(int track, File *f, bool align)
 {
-	if(track_address[track] == dummy_track)
+	if(!track_in_file(track))
 		return false;
 
-	uint32_t offset = uint32_t(track_address[track]) - uint32_t(gcr_data);
-	uint32_t bytes_written, bw2;
+	return write_track(track_address[track], track_length[track], get_track_offset(track), f, align);
+}
+
+// Writes one track from any buffer (e.g. a snapshot of the live track)
+// to the position in the G64 file where it was originally loaded from.
+bool GcrImage :: write_track(uint8_t *data, int length, uint32_t offset, File *f, bool align)
+{
+	uint32_t bytes_written;
 
 	//int fres = fseek(f, offset, SEEK_SET);
 	FRESULT res = f->seek(offset);
@@ -659,25 +590,20 @@ bool GcrImage :: write_track(int track, File *f, bool align)
 
     int start = 0;
     if(align)
-        start = find_track_start(track);
-    if(start > 0) {
-    	res = f->write(track_address[track]+start, track_length[track]-start, &bytes_written);
-        if(res != FR_OK)
-    		return false;
-        res = f->write(track_address[track], start, &bw2);
-        bytes_written += bw2;
-    } else {
-    	res = f->write(track_address[track], track_length[track], &bytes_written);
-    }
+        start = find_track_start(data, length);
+    res = write_aligned(data, length, start, f, &bytes_written);
 	if(res != FR_OK)
 		return false;
-    f->sync();
 	printf("%d bytes written at offset %6x.\n", bytes_written, offset);
 	return true;
 }
 
 bool GcrImage :: test(void)
 {
+    // check the FPGA coder against the software tables
+    int coder_errors = GcrCodec :: verify_hardware();
+    printf("GCR coder check: %d mismatches.\n", coder_errors);
+
     // first create a temporary binary image
     // and fill it with test data
     BinImage *bin = new BinImage("Test");
@@ -744,19 +670,48 @@ bool GcrImage :: test(void)
 //--------------------------------------------------------------
 BinImage :: BinImage(const char *name)
 {
-	bin_data = new uint8_t[C1541_MAX_D64_LEN];
-	int sects;
-	uint8_t *track = bin_data;
-	for(int i=0;i<C1541_MAXTRACKS;i++) {
-		sects = sectors_per_track[track_to_region(i)];
-		track_start[i] = track;
-		track_sectors[i] = sects;
-		track += (256 * sects);
-	}
+	bin_data = NULL;
+	bin_size = 0;
+	blk = NULL;
+	prt = NULL;
+	fs = NULL;
+	track_buffer = new uint8_t[21 * 256];
+	geometry = NULL;
+	reserve(0);
+	set_geometry(&geometry_d64);
 	errors = NULL;
 	error_size = 0;
 	num_tracks = 35;
-	
+}
+
+// Gives bin_data the size for an image of 'size' bytes. Only a D71 needs
+// more than a D64, so the buffer only grows while a D71 is in it.
+bool BinImage :: reserve(uint32_t size)
+{
+	uint32_t needed = (size > C1541_MAX_BIN_LEN) ? C1571_MAX_BIN_LEN : C1541_MAX_BIN_LEN;
+	if(needed == bin_size)
+		return true;
+	uint8_t *data = new uint8_t[needed];
+	if(!data)
+		return false;
+
+	if(fs)
+		delete fs;
+	if(prt)
+		delete prt;
+	if(blk)
+		delete blk;
+	if(bin_data)
+		delete[] bin_data;
+	bin_data = data;
+	bin_size = needed;
+
+	// the tracks start elsewhere now
+	const t_disk_geometry *g = geometry;
+	geometry = NULL;
+	if(g)
+		set_geometry(g);
+
     // we'll create a ram-mapped block device and a default
     // partition to attach our file system to, so we can access the
     // bin image as if it were a file system as well
@@ -764,6 +719,7 @@ BinImage :: BinImage(const char *name)
     blk = new BlockDevice_Ram(bin_data, 256, 768);
     prt = new Partition(blk, 0, 768, 0);
     fs  = new FileSystemD64(prt);
+	return true;
 }
 
 BinImage :: ~BinImage()
@@ -772,7 +728,9 @@ BinImage :: ~BinImage()
     //root.children.remove(this);
     
 	if(bin_data)
-		delete bin_data;
+		delete[] bin_data;
+	if(track_buffer)
+		delete[] track_buffer;
     if(fs)
         delete fs;
     if(prt)
@@ -820,12 +778,37 @@ uint8_t * BinImage :: get_sector_pointer(int track, int sector)
 
 int BinImage :: copy(uint8_t *data, uint32_t size)
 {
-	if (size > C1541_MAX_D64_LEN)
-		size = C1541_MAX_D64_LEN;
+	if (!reserve(size))
+		return -4;
+	if (size > bin_size)
+		size = bin_size;
 	memcpy(bin_data, data, size);
 	return init(size);
 }
 
+void BinImage :: set_geometry(const t_disk_geometry *g)
+{
+	if(g == geometry)
+		return;
+	geometry = g;
+	uint8_t *track = bin_data;
+	for(int i=0;i<C1541_MAXTRACKS;i++) {
+		track_sectors[i] = (i < g->sides * g->tracks_per_side) ? g->sectors(i) : 0;
+		track_start[i] = track;
+		track += (256 * track_sectors[i]);
+	}
+}
+
+int BinImage :: gcr_tracks(void)
+{
+	int tracks = num_tracks;
+	if(tracks > geometry->tracks_per_side)
+		tracks = geometry->tracks_per_side;
+	if(tracks > C1541_MAXTRACKS/2)
+		tracks = C1541_MAXTRACKS/2;
+	return tracks;
+}
+
 int BinImage :: load(File *file)
 {
 	num_tracks = 0;
@@ -836,7 +819,9 @@ int BinImage :: load(File *file)
 	res = file->seek(0);
 	if(res != FR_OK)
 		return -1;
-	res = file->read(bin_data, C1541_MAX_D64_LEN, &transferred);
+	if(!reserve(file->get_size()))
+		return -4;
+	res = file->read(bin_data, bin_size, &transferred);
 	if(res != FR_OK)
 		return -2;
 	printf("Transferred: %d bytes\n", transferred);
@@ -848,25 +833,32 @@ int BinImage :: init(uint32_t size)
 	if(size < C1541_MAX_D64_35_NO_ERRORS) {
 		return -3;
 	}
-	size -= (C1541_MAX_D64_35_NO_ERRORS);
-	num_tracks = 35;
-	errors = &bin_data[C1541_MAX_D64_35_NO_ERRORS];
-	while(size >= 17*256) {
-		num_tracks ++;
-		size -= 17*256;
-		errors += 17*256;
+	set_geometry((size >= C1571_MAX_D71_NO_ERRORS) ? &geometry_d71 : &geometry_d64);
+
+	num_tracks = geometry->standard_tracks;
+	size -= geometry->data_size(num_tracks);
+	errors = &bin_data[geometry->data_size(num_tracks)];
+	if(geometry->sides == 1) { // D64 may have extended tracks
+		while((size >= 17*256) && (num_tracks < geometry->tracks_per_side)) {
+			num_tracks ++;
+			size -= 17*256;
+			errors += 17*256;
+		}
 	}
 	error_size = (int)size;
 	if(!size)
 		errors = NULL;
 
-	printf("Tracks: %d. Errors: %s\n", num_tracks, errors?"Yes":"No");
+	printf("%s Tracks: %d. Errors: %s\n", geometry->name, num_tracks, errors?"Yes":"No");
 	return 0;
 }
 
+// Saves the tracks that a 1541 can reach as a D64, with their error bytes.
+// Of a D71, that is the first side.
 int BinImage :: save(File *file, UserInterface *user_interface)
 {
 	uint32_t transferred = 0;
+	int tracks = gcr_tracks();
 	FRESULT res = file->seek(0);
 	if(res != FR_OK) {
 		printf("SEEK ERROR: %d\n", res);
@@ -898,20 +890,21 @@ int BinImage :: save(File *file, UserInterface *user_interface)
     }            
 
 	data = &bin_data[683*256];
-	int tracks = num_tracks - 35;
-	while(tracks > 0) {
-		tracks--;
-		res = file->write(data, 17*256, &transferred);
+	for(int t=35;t<tracks;t++) {
+		res = file->write(data, 256*track_sectors[t], &transferred);
         if(user_interface)
             user_interface->update_progress(NULL, 1);
     	if(res != FR_OK) {
             printf("WRITE ERROR: %d. Transferred = %d\n", res, transferred);
 			return -3;
         }
-		data += 17*256;
+		data += 256*track_sectors[t];
 	}
 	if(errors) {
-		res = file->write(errors, error_size, &transferred);
+		int error_bytes = int(geometry->data_size(tracks) / 256);
+		if(error_bytes > error_size)
+			error_bytes = error_size;
+		res = file->write(errors, error_bytes, &transferred);
     	if(res != FR_OK) {
             printf("WRITE ERROR: %d. Transferred = %d\n", res, transferred);
 			return -4;
@@ -922,10 +915,12 @@ int BinImage :: save(File *file, UserInterface *user_interface)
 
 int BinImage :: format(const char *name)
 {
+	reserve(0);
+	set_geometry(&geometry_d64);
 	uint8_t *track_18 = &bin_data[17*21*256];
 	uint8_t *bam_name = track_18 + 144;
 
-	memset(bin_data, 0, C1541_MAX_D64_LEN);
+	memset(bin_data, 0, bin_size);
 	memcpy(track_18, bam_header, 144);
 
     // part that comes after bam header
@@ -954,24 +949,49 @@ int BinImage :: format(const char *name)
     return 0;
 }
 
-int BinImage :: write_track(int track, GcrImage *gcr_image, File *file)
+// Decodes the track into a scratch buffer and only writes the sectors
+// that differ from the last known binary image. Runs of consecutive
+// changed sectors are written with a single call. The file is not
+// synced; the caller should do that once after writing all tracks.
+// Returns the number of sectors written, or a negative error code.
+int BinImage :: write_track(int track, uint8_t *gcr, int gcr_length, File *file)
 {
-	int res = gcr_image->convert_track_gcr2bin(track, this);
-	if(res) {
-        printf("Decode failed with error %d.\n", res);
-		return res;
+	int sectors = track_sectors[track];
+	int secs = GcrImage :: convert_gcr_track_to_bin(gcr, track+1, gcr_length, sectors, track_buffer, NULL);
+	if(secs != sectors) {
+        printf("Decode of track %d failed, %d sectors found.\n", track+1, secs);
+		return -3;
 	}
-	uint32_t offset = uint32_t(track_start[track] - bin_data);
-	res = file->seek(offset);
-	if(res != 0) {
-        printf("While trying to write track %d, seek offset $%6x failed with error %d.\n", track+1, offset, res);
-		return res;
+
+	uint8_t *current = track_start[track];
+	uint8_t *decoded = track_buffer;
+	int written = 0;
+	int s = 0;
+	while(s < sectors) {
+		if(memcmp(current + 256*s, decoded + 256*s, 256) == 0) {
+			s++;
+			continue;
+		}
+		int first = s;
+		while((s < sectors) && (memcmp(current + 256*s, decoded + 256*s, 256) != 0)) {
+			memcpy(current + 256*s, decoded + 256*s, 256);
+			s++;
+		}
+		uint32_t offset = uint32_t(current - bin_data) + 256*first;
+		FRESULT fres = file->seek(offset);
+		if(fres != FR_OK) {
+	        printf("While trying to write track %d, seek offset $%6x failed with error %d.\n", track+1, offset, fres);
+			return -1;
+		}
+		uint32_t transferred;
+		fres = file->write(current + 256*first, 256*(s - first), &transferred);
+		if(fres != FR_OK) {
+	        printf("WRITE ERROR: %d. Transferred = %d\n", fres, transferred);
+			return -2;
+		}
+		written += (s - first);
 	}
-	uint32_t transferred;
-	FRESULT fres = file->write(track_start[track], 256*track_sectors[track], &transferred);
-	if(fres != FR_OK)
-		return res;
-    return file->sync();
+	return written;
 }
 
 void BinImage :: get_sensible_name(char *buffer)
@@ -1005,6 +1025,186 @@ void BinImage :: get_sensible_name(char *buffer)
 
 BinImage static_bin_image("Static Binary Image"); // for general use
 
+//--------------------------------------------------------------
+// Cache of encoded disk images
+//--------------------------------------------------------------
+DiskImageCache :: DiskImageCache(const char *name)
+{
+    this->name = name;
+    max_entries = 0;
+    use_counter = 0;
+    memset(entries, 0, sizeof(entries));
+    mutex = xSemaphoreCreateMutex();
+    FileChanges :: subscribe(DiskImageCache :: file_changed, this);
+}
+
+DiskImageCache :: ~DiskImageCache()
+{
+    FileChanges :: unsubscribe(DiskImageCache :: file_changed, this);
+    for(int i=0;i<DISK_CACHE_MAX_ENTRIES;i++) {
+        release(&entries[i]);
+    }
+    vSemaphoreDelete(mutex);
+}
+
+// Drops the disks that were read from a file that has changed since. Their
+// buffers stay, to be reused.
+void DiskImageCache :: file_changed(void *context, FileSystem *fs, uint32_t inode)
+{
+    DiskImageCache *cache = (DiskImageCache *)context;
+    xSemaphoreTake(cache->mutex, portMAX_DELAY);
+    for(int i=0;i<DISK_CACHE_MAX_ENTRIES;i++) {
+        t_cache_entry *e = &cache->entries[i];
+        if(e->valid && (!fs || (e->fs == fs)) && (!inode || (e->inode == inode))) {
+            e->valid = false;
+        }
+    }
+    xSemaphoreGive(cache->mutex);
+}
+
+void DiskImageCache :: release(t_cache_entry *e)
+{
+    if(e->gcr)
+        delete e->gcr;
+    if(e->bin)
+        delete e->bin;
+    e->gcr = NULL;
+    e->bin = NULL;
+    e->valid = false;
+}
+
+void DiskImageCache :: set_size(int num)
+{
+    if(num > DISK_CACHE_MAX_ENTRIES)
+        num = DISK_CACHE_MAX_ENTRIES;
+    if(num < 0)
+        num = 0;
+
+    // The images are deleted after the mutex is given back: deleting a binary
+    // image deletes its file system, which is reported to file_changed.
+    GcrImage *gcr[DISK_CACHE_MAX_ENTRIES];
+    BinImage *bin[DISK_CACHE_MAX_ENTRIES];
+    int dropped = 0;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for(int i=num;i<DISK_CACHE_MAX_ENTRIES;i++) {
+        t_cache_entry *e = &entries[i];
+        gcr[dropped] = e->gcr;
+        bin[dropped] = e->bin;
+        dropped++;
+        e->gcr = NULL;
+        e->bin = NULL;
+        e->valid = false;
+    }
+    max_entries = num;
+    xSemaphoreGive(mutex);
+
+    for(int i=0;i<dropped;i++) {
+        if(gcr[i])
+            delete gcr[i];
+        if(bin[i])
+            delete bin[i];
+    }
+}
+
+// Only allocates a new pair of images when there is enough heap left.
+bool DiskImageCache :: allocate(GcrImage **gcr, BinImage **bin)
+{
+    void *probe = malloc(sizeof(GcrImage) + C1541_MAX_BIN_LEN + DISK_CACHE_RESERVE);
+    if(!probe)
+        return false;
+    free(probe);
+    *gcr = new GcrImage;
+    *bin = new BinImage(name);
+    return true;
+}
+
+void DiskImageCache :: exchange(t_cache_entry *e, GcrImage **gcr, BinImage **bin)
+{
+    GcrImage *g = e->gcr;
+    BinImage *b = e->bin;
+    e->gcr = *gcr;
+    e->bin = *bin;
+    *gcr = g;
+    *bin = b;
+}
+
+bool DiskImageCache :: store(FileInfo *file, int type, GcrImage **gcr, BinImage **bin)
+{
+    t_cache_entry *target = NULL;
+
+    if(!file->cluster)
+        return false;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    // 1) a slot that still has buffers, but no disk in it
+    for(int i=0;i<max_entries;i++) {
+        if(entries[i].gcr && !entries[i].valid) {
+            target = &entries[i];
+            break;
+        }
+    }
+    // 2) an empty slot, if there is enough memory to give the caller new buffers
+    if(!target) {
+        for(int i=0;i<max_entries;i++) {
+            if(!entries[i].gcr) {
+                GcrImage *g;
+                BinImage *b;
+                if(allocate(&g, &b)) {
+                    target = &entries[i];
+                    target->gcr = g;
+                    target->bin = b;
+                }
+                break;
+            }
+        }
+    }
+    // 3) the least recently used disk
+    if(!target) {
+        for(int i=0;i<max_entries;i++) {
+            if(entries[i].gcr && (!target || (entries[i].last_used < target->last_used))) {
+                target = &entries[i];
+            }
+        }
+    }
+    if(target) {
+        exchange(target, gcr, bin);
+        target->fs = file->fs;
+        target->inode = file->cluster;
+        target->size = file->size;
+        target->date = file->date;
+        target->time = file->time;
+        target->type = type;
+        target->last_used = ++use_counter;
+        target->valid = true;
+    }
+    xSemaphoreGive(mutex);
+    return (target != NULL);
+}
+
+bool DiskImageCache :: take(FileInfo *file, int type, GcrImage **gcr, BinImage **bin)
+{
+    bool found = false;
+
+    if(!file->cluster)
+        return false;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for(int i=0;i<max_entries;i++) {
+        t_cache_entry *e = &entries[i];
+        if(e->valid && (e->fs == file->fs) && (e->inode == file->cluster) && (e->size == file->size) &&
+                (e->date == file->date) && (e->time == file->time) && (e->type == type)) {
+            exchange(e, gcr, bin);
+            e->valid = false;
+            found = true;
+            break;
+        }
+    }
+    xSemaphoreGive(mutex);
+    return found;
+}
+
 int ImageCreator :: S_createD64(SubsysCommand *cmd)
 {
 	int doG64 = cmd->mode;
@@ -10,25 +10,7 @@
 #include "menu.h"
 #include "filemanager.h"
 #include "subsys.h"
-
-#define GCR_DECODER_GCR_IN   (*(volatile uint8_t *)(GCR_CODER_BASE + 0x00))
-#define GCR_DECODER_BIN_OUT0 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x00))
-#define GCR_DECODER_BIN_OUT1 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x01))
-#define GCR_DECODER_BIN_OUT2 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x02))
-#define GCR_DECODER_BIN_OUT3 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x03))
-#define GCR_DECODER_ERRORS   (*(volatile uint8_t *)(GCR_CODER_BASE + 0x04))
-
-#define GCR_ENCODER_BIN_IN   (*(volatile uint8_t *)(GCR_CODER_BASE + 0x08))
-#define GCR_ENCODER_GCR_OUT0 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x08))
-#define GCR_ENCODER_GCR_OUT1 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x09))
-#define GCR_ENCODER_GCR_OUT2 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x0A))
-#define GCR_ENCODER_GCR_OUT3 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x0B))
-#define GCR_ENCODER_GCR_OUT4 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x0C))
-
-#define GCR_ENCODER_BIN_IN_32  (*(volatile uint32_t *)(GCR_CODER_BASE + 0x08))
-#define GCR_DECODER_GCR_IN_32  (*(volatile uint32_t *)(GCR_CODER_BASE + 0x00))
-#define GCR_DECODER_BIN_OUT_32 (*(volatile uint32_t *)(GCR_CODER_BASE + 0x00))
-
+#include "gcr_codec.h"
 
 #define C1541_MAXTRACKS   84
 #define C1541_MAXTRACKLEN 0x1EF8
@@ -38,6 +20,33 @@
 #define C1541_MAX_D64_35_WITH_ERRORS (175531)
 #define C1541_MAX_D64_40_NO_ERRORS (196608)
 #define C1541_MAX_D64_40_WITH_ERRORS (197376)
+#define C1571_MAX_D71_NO_ERRORS (349696)
+#define C1571_MAX_D71_WITH_ERRORS (351062)
+#define C1541_MAX_BIN_LEN C1541_MAX_D64_LEN // binary image buffer, unless it holds a D71
+#define C1571_MAX_BIN_LEN C1571_MAX_D71_WITH_ERRORS
+
+// Describes the layout of a binary image format in terms of recording zones,
+// such that the same code can handle 1541 and 1571 images. A 1541 head can
+// only reach the first side; the GCR image holds that side.
+struct t_disk_geometry
+{
+    const char *name;
+    int  sides;
+    int  tracks_per_side;    // tracks that one head can reach
+    int  standard_tracks;    // tracks of an image without extensions
+    int  regions;
+    const int *region_end;   // first track (0 based) of the next region
+    const int *sectors_per_track;
+    const int *track_lengths;
+    const int *gap_lengths;
+
+    int  region(int track) const;
+    int  sectors(int track) const { return sectors_per_track[region(track)]; }
+    uint32_t data_size(int tracks) const; // bytes of sector data in the first 'tracks' tracks
+};
+
+extern const t_disk_geometry geometry_d64;
+extern const t_disk_geometry geometry_d71;
 
 class BinImage;
 
@@ -52,12 +61,19 @@ class GcrImage
     uint8_t sector_buffer[352]; // 260 for bin sector, 349 for gcr sector + header (352 to be a multiple of 4)
     uint8_t gcr_data[C1541_MAX_GCR_LEN];
 
+    // lazy conversion: binary source and tracks not yet encoded
+    BinImage *lazy_source;
+    int      lazy_pending;
+    bool     track_pending[C1541_MAXTRACKS/2];
+
+    // number of bytes of gcr_data that came from the loaded G64 file
+    uint32_t loaded_size;
+
     // private functions
-    static uint8_t *wrap(uint8_t **, uint8_t *, uint8_t *, int, uint8_t *buffer);
-    static uint8_t *find_sync(uint8_t *, uint8_t *, uint8_t *);
-    uint8_t *convert_block_bin2gcr(uint8_t *bin, uint8_t *gcr, int len);
     uint8_t *convert_track_bin2gcr(int track, uint8_t *bin, uint8_t *gcr, uint8_t *errors, int errors_size);
-    int   find_track_start(int);
+    static int find_track_start(uint8_t *begin, int length);
+    static FRESULT write_aligned(uint8_t *data, int length, int start, File *f, uint32_t *written);
+    void allocate_half_tracks(uint8_t *free, uint8_t fill);
 public:
     GcrImage();
     ~GcrImage();
@@ -72,9 +88,19 @@ public:
     bool load(File *f);
     bool save(File *f, bool, UserInterface *ui);
     bool write_track(int, File *f, bool);
+    static bool write_track(uint8_t *data, int length, uint32_t offset, File *f, bool align);
+    uint32_t get_track_offset(int track) { return uint32_t(track_address[track] - gcr_data); }
+    bool track_in_file(int track);
+    bool is_blank_track(int track);
     void convert_disk_bin2gcr(BinImage *bin_image, UserInterface *ui);
+    void prepare_disk_bin2gcr(BinImage *bin_image);
+    bool convert_pending_track(int track);
+    void skip_pending_track(int track);
+    void convert_all_pending(void);
+    int  pending_tracks(void) { return lazy_pending; }
     int  convert_disk_gcr2bin(BinImage *bin_image, UserInterface *ui);
     int  convert_track_gcr2bin(int track, BinImage *bin_image);
+    int  get_sector_map(int track, t_gcr_sector_map *map);
     void invalidate(void);
     bool test(void);
     
@@ -90,24 +116,30 @@ class BinImage
     int   track_sectors[C1541_MAXTRACKS];
     uint8_t *errors; // NULL means no error bytes
     int   error_size;
+    uint8_t *track_buffer; // scratch pad to decode one track into during write back
 
     BlockDevice_Ram *blk;
     Partition *prt;
     FileSystemD64 *fs;
 
     int init(uint32_t size);
+    bool reserve(uint32_t size);
+    void set_geometry(const t_disk_geometry *g);
 public:
     int   num_tracks;
     uint8_t *bin_data;
+    uint32_t bin_size; // bytes allocated for bin_data
+    const t_disk_geometry *geometry;
 
     BinImage(const char *);
     ~BinImage();
 
     int format(const char *diskname);
     int copy(uint8_t *, uint32_t size);
+    int  gcr_tracks(void); // tracks that go into a GCR image
     int load(File *);
     int save(File *, UserInterface *ui);
-    int write_track(int track, GcrImage *, File *);
+    int write_track(int track, uint8_t *gcr, int gcr_length, File *);
 
     // int get_absolute_sector(int track, int sector);
     uint8_t * get_sector_pointer(int track, int sector);
@@ -119,6 +151,51 @@ public:
 
 extern BinImage static_bin_image; // for general use
 
+#define DISK_CACHE_MAX_ENTRIES  8
+#define DISK_CACHE_RESERVE      (4 * 1024 * 1024) // heap to leave for the rest of the system
+
+// Keeps the encoded images of recently used disks, such that mounting
+// one of them again is just a matter of exchanging image pointers.
+// Images are identified by file system, inode, size and time stamp of the
+// image file. Entries are dropped as soon as their file is written, deleted
+// or its media disappears (see FileChanges), as they could be written back
+// over the newer contents otherwise.
+// Entries that were taken out keep their buffers, to be reused.
+class DiskImageCache
+{
+    struct t_cache_entry {
+        FileSystem *fs;
+        uint32_t  inode;
+        uint32_t  size;
+        uint16_t  date;
+        uint16_t  time;
+        int       type;
+        uint32_t  last_used;
+        bool      valid;
+        GcrImage *gcr;
+        BinImage *bin;
+    };
+    t_cache_entry entries[DISK_CACHE_MAX_ENTRIES];
+    int max_entries;
+    uint32_t use_counter;
+    const char *name;
+    SemaphoreHandle_t mutex; // the entries are dropped from other tasks
+
+    bool allocate(GcrImage **gcr, BinImage **bin);
+    void release(t_cache_entry *e);
+    static void exchange(t_cache_entry *e, GcrImage **gcr, BinImage **bin);
+    static void file_changed(void *context, FileSystem *fs, uint32_t inode);
+public:
+    DiskImageCache(const char *name);
+    ~DiskImageCache();
+
+    void set_size(int entries);
+    // Hands the images over to the cache; on success, *gcr and *bin are replaced by spare images.
+    bool store(FileInfo *file, int type, GcrImage **gcr, BinImage **bin);
+    // Exchanges the caller's (spare) images for the cached ones, if present.
+    bool take(FileInfo *file, int type, GcrImage **gcr, BinImage **bin);
+};
+
 class ImageCreator : public ObjectWithMenu
 {
 public:
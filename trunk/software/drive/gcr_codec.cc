@@ -0,0 +1,408 @@
+/*
+ * gcr_codec.cc
+ *
+ * Table driven GCR coder, with an optional pass-through to the FPGA coder.
+ */
+#include "gcr_codec.h"
+#include <stdio.h>
+
+// Single nibble GCR table
+static const uint8_t gcr_table[] = { 0x0A, 0x0B, 0x12, 0x13, 0x0E, 0x0F, 0x16, 0x17,
+                                     0x09, 0x19, 0x1A, 0x1B, 0x0D, 0x1D, 0x1E, 0x15 };
+
+bool     GcrCodec :: initialized = false;
+uint16_t GcrCodec :: encode_table[256];
+uint16_t GcrCodec :: decode_table[1024];
+
+void GcrCodec :: init(void)
+{
+    if (initialized)
+        return;
+
+    // quintet -> nibble; illegal quintets are flagged
+    uint8_t quintet[32];
+    for(int i=0;i<32;i++)
+        quintet[i] = 0xFF;
+    for(int i=0;i<16;i++)
+        quintet[gcr_table[i]] = uint8_t(i);
+
+    for(int i=0;i<256;i++) {
+        encode_table[i] = (uint16_t(gcr_table[i >> 4]) << 5) | gcr_table[i & 15];
+    }
+    for(int i=0;i<1024;i++) {
+        uint8_t hi = quintet[i >> 5];
+        uint8_t lo = quintet[i & 31];
+        uint16_t d = 0;
+        if (hi == 0xFF) {
+            hi = 0;
+            d = GCR_DECODE_INVALID;
+        }
+        if (lo == 0xFF) {
+            lo = 0;
+            d = GCR_DECODE_INVALID;
+        }
+        decode_table[i] = d | (uint16_t(hi) << 4) | lo;
+    }
+    initialized = true;
+}
+
+// aaaabbbb ccccdddd eeeeffff gggghhhh
+// AAAAABBB BBCCCCCD DDDDEEEE EFFFFFGG GGGHHHHH
+// Four 10-bit codes are merged into one 40-bit group: the top byte
+// comes from the first code, the remaining 32 bits form one word.
+
+uint8_t *GcrCodec :: encode_block_sw(const uint8_t *bin, uint8_t *gcr, int len)
+{
+    for(int i=0;i<len;i+=4) {
+        uint32_t c0 = encode_table[bin[0]];
+        uint32_t lo = (c0 << 30) |
+                      (uint32_t(encode_table[bin[1]]) << 20) |
+                      (uint32_t(encode_table[bin[2]]) << 10) |
+                       uint32_t(encode_table[bin[3]]);
+        gcr[0] = uint8_t(c0 >> 2);
+        gcr[1] = uint8_t(lo >> 24);
+        gcr[2] = uint8_t(lo >> 16);
+        gcr[3] = uint8_t(lo >> 8);
+        gcr[4] = uint8_t(lo);
+        bin += 4;
+        gcr += 5;
+    }
+    return gcr;
+}
+
+uint8_t *GcrCodec :: decode_block_sw(const uint8_t *gcr, uint8_t *bin, int len, int *errors)
+{
+    int err = 0;
+    for(int i=0;i<len;i+=4) {
+        if (decode_5bytes_sw(gcr, bin))
+            err++;
+        gcr += 5;
+        bin += 4;
+    }
+    if (errors)
+        *errors = err;
+    return bin;
+}
+
+uint8_t *GcrCodec :: encode_block(uint8_t *bin, uint8_t *gcr, int len)
+{
+#if HARDWARE_ENCODING > 0
+    uint32_t *dw = (uint32_t *)bin;
+    for(int i=0;i<len;i+=4) {
+        GCR_ENCODER_BIN_IN_32 = *(dw++);
+        *(gcr++) = GCR_ENCODER_GCR_OUT0;
+        *(gcr++) = GCR_ENCODER_GCR_OUT1;
+        *(gcr++) = GCR_ENCODER_GCR_OUT2;
+        *(gcr++) = GCR_ENCODER_GCR_OUT3;
+        *(gcr++) = GCR_ENCODER_GCR_OUT4;
+    }
+    return gcr;
+#else
+    return encode_block_sw(bin, gcr, len);
+#endif
+}
+
+int GcrCodec :: verify_hardware(void)
+{
+    int errors = 0;
+#if HARDWARE_ENCODING > 0
+    init();
+    uint32_t bin[64];
+    uint8_t gcr_hw[320], gcr_sw[320];
+    uint8_t back_hw[4], back_sw[4];
+
+    uint8_t *b = (uint8_t *)bin;
+    for(int i=0;i<256;i++)
+        b[i] = uint8_t(i);
+
+    encode_block((uint8_t *)bin, gcr_hw, 256);
+    encode_block_sw((uint8_t *)bin, gcr_sw, 256);
+
+    for(int i=0;i<320;i+=5) {
+        for(int j=0;j<5;j++) {
+            if (gcr_hw[i+j] != gcr_sw[i+j]) {
+                printf("GCR encode mismatch at %d: %02x <> %02x\n", i+j, gcr_hw[i+j], gcr_sw[i+j]);
+                errors++;
+            }
+        }
+        uint8_t *g = &gcr_sw[i];
+        decode_5bytes(&g, back_hw);
+        decode_5bytes_sw(&gcr_sw[i], back_sw);
+        for(int j=0;j<4;j++) {
+            if ((back_hw[j] != back_sw[j]) || (back_sw[j] != b[(4*i)/5 + j])) {
+                printf("GCR decode mismatch at %d: %02x <> %02x\n", (4*i)/5 + j, back_hw[j], back_sw[j]);
+                errors++;
+            }
+        }
+    }
+#endif
+    return errors;
+}
+
+// State of a track scan, shared by the byte and the bit aligned scanners
+struct t_track_scan
+{
+    int      trackNumber;
+    int      maxSector;
+    uint8_t *bin;
+    uint8_t *st;
+    t_gcr_sector_map *map;
+    int      secs;
+    int      s;
+    bool     expect_data;
+    uint8_t  header[8];
+    uint8_t  scratch[256];
+};
+
+static void start_scan(t_track_scan *scan, int trackNumber, int maxSector, uint8_t *bin,
+                       uint8_t *status, t_gcr_sector_map *map)
+{
+    scan->trackNumber = trackNumber;
+    scan->maxSector = maxSector;
+    scan->bin = bin;
+    scan->st = status;
+    scan->map = map;
+    scan->secs = 0;
+    scan->s = 0;
+    scan->expect_data = false;
+
+    if(map) {
+        map->sectors = 0;
+        for(int i=0;i<GCR_MAX_SECTORS;i++) {
+            map->header[i] = -1;
+            map->data[i] = -1;
+            map->header_bit[i] = 0;
+        }
+    }
+}
+
+// Handles the block that follows a sync; 'g' holds at least a data block
+// worth of bytes. 'position' and 'bit' tell where the block was
+// found on the track, 'seen' is set when the scan went past the end of the
+// track. Returns the number of bytes taken by the block, or 0 to stop.
+static int scan_block(t_track_scan *scan, uint8_t *g, int position, int bit, bool seen)
+{
+    uint8_t *header = scan->header;
+    uint8_t *st = scan->st;
+
+    GcrCodec :: decode_5bytes(&g, &header[0]);
+
+    if(header[0] == 8) {
+        if(seen)
+            return 0;
+        GcrCodec :: decode_5bytes(&g, &header[4]);
+        int t = (int)header[3];
+        int s = (int)header[2];
+        scan->s = s;
+
+        // We found a header, but we are expecting data
+        if(scan->expect_data && st)
+            *(st++) = 0xE4;
+        // new sector, store sector number
+        if(st)
+            *(st++) = s;
+        if((t != scan->trackNumber) && st)
+            *(st++) = 0xE1;
+        if(s >= scan->maxSector) {
+            if(st)
+                *(st++) = 0xE2;
+            scan->st = st;
+            scan->expect_data = false; // don't store data outside of the track buffer
+            return GCR_HEADER_BLOCK;
+        }
+        scan->st = st;
+        if(scan->map && (s < GCR_MAX_SECTORS)) {
+            scan->map->header[s] = int16_t(position);
+            scan->map->header_bit[s] = uint8_t(bit);
+        }
+        scan->expect_data = true;
+        return GCR_HEADER_BLOCK;
+    }
+
+    if((header[0] != 7) || !scan->expect_data)
+        return 5;
+
+    int s = scan->s;
+    scan->expect_data = false;
+    scan->secs++;
+
+    uint8_t *dest = (scan->bin) ? scan->bin + (256 * s) : scan->scratch;
+    uint8_t *binarySector = dest;
+    memcpy(dest, &header[1], 3);
+    dest += 3;
+    for(int i=0;i<63;i++) {
+        GcrCodec :: decode_5bytes(&g, dest);
+        dest += 4;
+    }
+    GcrCodec :: decode_5bytes(&g, &header[4]);
+    *(dest++) = header[4];
+
+    if(scan->map && (s < GCR_MAX_SECTORS)) {
+        scan->map->data[s] = int16_t(position);
+        scan->map->sectors++;
+    }
+    if(st) {
+        uint8_t chk = 0;
+        for(int i=0;i<256;i++) {
+            chk ^= *(binarySector++);
+        }
+        *(st++) = (chk != header[5]) ? 0xE3 : 0x00;
+        scan->st = st;
+    }
+    return GCR_DATA_BLOCK;
+}
+
+// Returns the position of the first byte after three or more 0xFF bytes,
+// counting on past the end of the track, or -1 when there is none before 'limit'.
+static int find_sync(const uint8_t *gcr, int trackLen, int pos, int limit)
+{
+    int sync_count = 0;
+
+    while(pos < limit) {
+        // the part up to the end of the track, or the part after it
+        int end = (pos < trackLen) ? trackLen : limit;
+        const uint8_t *begin = (pos < trackLen) ? gcr + pos : gcr + (pos - trackLen);
+        const uint8_t *stop = begin + (end - pos);
+        for(const uint8_t *b = begin; b < stop; b++) {
+            if(*b == 0xFF) {
+                sync_count++;
+            } else {
+                if(sync_count > 2)
+                    return pos + int(b - begin);
+                sync_count = 0;
+            }
+        }
+        pos = end;
+    }
+    return -1;
+}
+
+// The track is scanned once from its start, like the drive reads it, and a
+// little further, to finish a sector that crosses the end of the track.
+// Blocks are decoded where they are; only a block that crosses the end is
+// copied first, to join its two parts.
+int GcrCodec :: decode_track(uint8_t *gcr, int trackNumber, int trackLen, int maxSector,
+                             uint8_t *bin, uint8_t *status, t_gcr_sector_map *map)
+{
+    t_track_scan scan;
+    uint8_t block[GCR_DATA_BLOCK];
+
+    start_scan(&scan, trackNumber, maxSector, bin, status, map);
+    if(trackLen < GCR_DATA_BLOCK)
+        return 0;
+
+    int limit = trackLen + GCR_TRACK_MARGIN;
+    int first_sync = -1;
+    int pos = 0;
+
+    while(scan.secs < maxSector) {
+        int n = find_sync(gcr, trackLen, pos, limit);
+        if(n < 0)
+            break;
+        int p = (n < trackLen) ? n : n - trackLen;
+
+        // past the end, everything from the first sync on has been seen already,
+        // except for the data block of a header that was found just before the end
+        bool seen = (n >= trackLen) && (first_sync >= 0) && (p >= first_sync);
+        if((n < trackLen) && (first_sync < 0))
+            first_sync = p;
+        if(seen && !scan.expect_data)
+            break;
+
+        uint8_t *g = gcr + p;
+        if((p + GCR_DATA_BLOCK) > trackLen) {
+            extract_bits(gcr, trackLen, p * 8, block, GCR_DATA_BLOCK);
+            g = block;
+        }
+        int used = scan_block(&scan, g, p, 0, seen);
+        if(!used)
+            break;
+        pos = n + used;
+    }
+    return scan.secs;
+}
+
+static inline int gcr_bit(const uint8_t *gcr, int bit)
+{
+    return (gcr[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+void GcrCodec :: extract_bits(const uint8_t *gcr, int trackLen, int bit, uint8_t *dest, int count)
+{
+    int index = bit >> 3;
+    int shift = bit & 7;
+    while(index >= trackLen)
+        index -= trackLen;
+
+    if(!shift) {
+        while(count > 0) {
+            int chunk = trackLen - index;
+            if(chunk > count)
+                chunk = count;
+            memcpy(dest, gcr + index, chunk);
+            dest += chunk;
+            count -= chunk;
+            index = 0;
+        }
+        return;
+    }
+    for(int i=0;i<count;i++) {
+        int next = index + 1;
+        if(next == trackLen)
+            next = 0;
+        *(dest++) = uint8_t((gcr[index] << shift) | (gcr[next] >> (8 - shift)));
+        index = next;
+    }
+}
+
+// Follows the bit stream like the drive does: a sync is a run of ten or more
+// one bits, and the block after it starts at the first zero bit, regardless
+// of its position within a byte. Slower than decode_track; meant for tracks
+// on which decode_track does not find all sectors.
+int GcrCodec :: decode_track_bits(uint8_t *gcr, int trackNumber, int trackLen, int maxSector,
+                                  uint8_t *bin, uint8_t *status, t_gcr_sector_map *map)
+{
+    t_track_scan scan;
+    uint8_t block[GCR_DATA_BLOCK];
+
+    start_scan(&scan, trackNumber, maxSector, bin, status, map);
+    if(trackLen < GCR_DATA_BLOCK)
+        return 0;
+
+    // start right after a zero bit, such that no sync is cut in two
+    int bits = trackLen * 8;
+    int start = -1;
+    for(int i=0;i<bits;i++) {
+        if(!gcr_bit(gcr, i)) {
+            start = i + 1;
+            break;
+        }
+    }
+    if(start < 0)
+        return 0; // nothing but ones
+
+    int ones = 0;
+    int b = (start < bits) ? start : 0;
+    int limit = bits + (GCR_TRACK_MARGIN * 8);
+    for(int n=0;(n < limit) && (scan.secs < maxSector);n++) {
+        int bit = b;
+        if(++b == bits)
+            b = 0;
+        if(gcr_bit(gcr, bit)) {
+            ones++;
+            continue;
+        }
+        if(ones < 10) {
+            ones = 0;
+            continue;
+        }
+        ones = 0;
+        bool seen = (n >= bits);
+        if(seen && !scan.expect_data)
+            break;
+        extract_bits(gcr, trackLen, bit, block, GCR_DATA_BLOCK);
+        if(!scan_block(&scan, block, bit >> 3, bit & 7, seen))
+            break;
+    }
+    return scan.secs;
+}
@@ -0,0 +1,134 @@
+/*
+ * gcr_codec.h
+ *
+ * GCR 4-to-5 block coder. Either drives the FPGA coder at GCR_CODER_BASE,
+ * or uses wide lookup tables in software. The software coder is always
+ * available, such that it can serve as a reference for the hardware.
+ */
+
+#ifndef GCR_CODEC_H_
+#define GCR_CODEC_H_
+
+#include "integer.h"
+#include "iomap.h"
+#include <string.h>
+
+// Select the hardware coder (1) or the software tables (0) at compile time.
+// Host builds have no FPGA to talk to, so they always use the tables.
+#ifndef HARDWARE_ENCODING
+#ifdef RUNS_ON_PC
+#define HARDWARE_ENCODING 0
+#else
+#define HARDWARE_ENCODING 1
+#endif
+#endif
+
+#define GCR_DECODER_GCR_IN   (*(volatile uint8_t *)(GCR_CODER_BASE + 0x00))
+#define GCR_DECODER_BIN_OUT0 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x00))
+#define GCR_DECODER_BIN_OUT1 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x01))
+#define GCR_DECODER_BIN_OUT2 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x02))
+#define GCR_DECODER_BIN_OUT3 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x03))
+#define GCR_DECODER_ERRORS   (*(volatile uint8_t *)(GCR_CODER_BASE + 0x04))
+
+#define GCR_ENCODER_BIN_IN   (*(volatile uint8_t *)(GCR_CODER_BASE + 0x08))
+#define GCR_ENCODER_GCR_OUT0 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x08))
+#define GCR_ENCODER_GCR_OUT1 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x09))
+#define GCR_ENCODER_GCR_OUT2 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x0A))
+#define GCR_ENCODER_GCR_OUT3 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x0B))
+#define GCR_ENCODER_GCR_OUT4 (*(volatile uint8_t *)(GCR_CODER_BASE + 0x0C))
+
+#define GCR_ENCODER_BIN_IN_32  (*(volatile uint32_t *)(GCR_CODER_BASE + 0x08))
+#define GCR_DECODER_GCR_IN_32  (*(volatile uint32_t *)(GCR_CODER_BASE + 0x00))
+#define GCR_DECODER_BIN_OUT_32 (*(volatile uint32_t *)(GCR_CODER_BASE + 0x00))
+
+#define GCR_DECODE_INVALID   0x100 // flag in decode table for illegal quintets
+
+#define GCR_MAX_SECTORS      32    // sector numbers tracked in a sector map
+#define GCR_TRACK_MARGIN     400   // bytes scanned past the end of a track, to finish a sector that crosses it
+#define GCR_HEADER_BLOCK     10    // encoded size of a sector header
+#define GCR_DATA_BLOCK       325   // encoded size of a data block ('7', 256 bytes, checksum, 2 pad)
+
+// Where the blocks of each sector were found on a track; positions are
+// offsets of the first byte after the sync, or -1 when not found.
+// Headers that do not start on a byte boundary also get their bit offset.
+struct t_gcr_sector_map
+{
+    int     sectors;                  // number of data blocks found
+    int16_t header[GCR_MAX_SECTORS];
+    int16_t data[GCR_MAX_SECTORS];
+    uint8_t header_bit[GCR_MAX_SECTORS];
+};
+
+class GcrCodec
+{
+    static bool initialized;
+public:
+    // byte -> 10 bit code, and 10 bit code -> byte (| GCR_DECODE_INVALID)
+    static uint16_t encode_table[256];
+    static uint16_t decode_table[1024];
+
+    static void init(void);
+
+    // Table driven coder; 'len' is in binary bytes and must be a multiple of 4.
+    static uint8_t *encode_block_sw(const uint8_t *bin, uint8_t *gcr, int len);
+    static uint8_t *decode_block_sw(const uint8_t *gcr, uint8_t *bin, int len, int *errors);
+
+    // Converts 5 GCR bytes into 4 binary bytes. Returns non-zero when
+    // one or more of the eight quintets was not a valid GCR code.
+    static inline int decode_5bytes_sw(const uint8_t *gcr, uint8_t *bin)
+    {
+        uint32_t lo = (uint32_t(gcr[1]) << 24) | (uint32_t(gcr[2]) << 16) |
+                      (uint32_t(gcr[3]) <<  8) |  uint32_t(gcr[4]);
+        uint16_t d0 = decode_table[(uint32_t(gcr[0]) << 2) | (lo >> 30)];
+        uint16_t d1 = decode_table[(lo >> 20) & 0x3FF];
+        uint16_t d2 = decode_table[(lo >> 10) & 0x3FF];
+        uint16_t d3 = decode_table[lo & 0x3FF];
+        bin[0] = uint8_t(d0);
+        bin[1] = uint8_t(d1);
+        bin[2] = uint8_t(d2);
+        bin[3] = uint8_t(d3);
+        return (d0 | d1 | d2 | d3) & GCR_DECODE_INVALID;
+    }
+
+    // Coder as selected by HARDWARE_ENCODING
+    static uint8_t *encode_block(uint8_t *bin, uint8_t *gcr, int len);
+
+    static inline void decode_5bytes(uint8_t **gcr, uint8_t *bin)
+    {
+        uint8_t *b = *gcr;
+#if HARDWARE_ENCODING > 0
+        GCR_DECODER_GCR_IN = *(b++);
+        GCR_DECODER_GCR_IN = *(b++);
+        GCR_DECODER_GCR_IN = *(b++);
+        GCR_DECODER_GCR_IN = *(b++);
+        GCR_DECODER_GCR_IN = *(b++);
+        *(bin++) = GCR_DECODER_BIN_OUT0;
+        *(bin++) = GCR_DECODER_BIN_OUT1;
+        *(bin++) = GCR_DECODER_BIN_OUT2;
+        *(bin++) = GCR_DECODER_BIN_OUT3;
+#else
+        decode_5bytes_sw(b, bin);
+        b += 5;
+#endif
+        *gcr = b;
+    }
+
+    // Compares the FPGA coder against the tables; returns the number of mismatches.
+    static int verify_hardware(void);
+
+    // Decodes the sectors of a circular GCR track into 'bin' (256 bytes per
+    // sector, by sector number; may be NULL). Optionally reports per-sector
+    // status codes and where each sector was found. Returns the number of
+    // data blocks decoded.
+    static int decode_track(uint8_t *gcr, int trackNumber, int trackLen, int maxSector,
+                            uint8_t *bin, uint8_t *status, t_gcr_sector_map *map);
+
+    // Same as decode_track, but finds syncs at any bit position.
+    static int decode_track_bits(uint8_t *gcr, int trackNumber, int trackLen, int maxSector,
+                                 uint8_t *bin, uint8_t *status, t_gcr_sector_map *map);
+
+    // Copies 'count' bytes from a circular track, starting at any bit position.
+    static void extract_bits(const uint8_t *gcr, int trackLen, int bit, uint8_t *dest, int count);
+};
+
+#endif /* GCR_CODEC_H_ */
@@ -17,7 +17,7 @@
 
 class CachedTreeNode;
 
-int path_object_compare(IndexedList<CachedTreeNode *> *, int, int);
+int path_object_compare(CachedTreeNode *, CachedTreeNode *);
 
 class CachedTreeNode
 {
@@ -7,6 +7,7 @@ FileDevice :: FileDevice(BlockDevice *b, const char *n, const char *dn) : Cached
     initialized = false;
     display_name = dn;
     blk = b;
+    cache = NULL;
     disk = NULL; //new Disk(b, 512);
     info.fs = NULL;
     info.cluster = 0; // indicate root dir
@@ -31,8 +32,10 @@ void FileDevice :: attach_disk(int block_size)
     if(disk) {
         printf("ERROR: DISK ALREADY EXISTS ON FILE DEVICE %s!\n", get_name());
         delete disk;
+        delete cache;
     }
-    disk = new Disk(blk, block_size);
+    cache = new BlockDevice_Cached(blk, block_size);
+    disk = new Disk(cache, block_size);
     initialized = false;
 }
 
@@ -41,8 +44,10 @@ void FileDevice :: detach_disk(void)
     if(disk) {
         cleanup_children();
         delete disk;
+        delete cache;
     }
     disk = NULL;
+    cache = NULL;
     initialized = false;
 }
     
@@ -2,6 +2,7 @@
 #define FILE_DEVICE_H
 
 #include "blockdev.h"
+#include "blockdev_cached.h"
 #include "disk.h"
 #include "partition.h"
 #include "path.h"
@@ -10,6 +11,7 @@
 class FileDevice : public CachedTreeNode
 {
     BlockDevice *blk;
+    BlockDevice_Cached *cache; // between the partitions and blk
     Disk *disk;
     const char *display_name;
     bool initialized;
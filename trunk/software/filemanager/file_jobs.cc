@@ -0,0 +1,250 @@
+#include <string.h>
+#include "file_jobs.h"
+
+static void join_path(mstring &result, const char *path, const char *name)
+{
+	result = path;
+	int len = result.length();
+	if ((len == 0) || (result.c_str()[len-1] != '/'))
+		result += "/";
+	result += name;
+}
+
+FileJob :: FileJob(t_file_job_type t, const char *source, const char *dest) : source_path(source), dest_path(dest), names(16, NULL)
+{
+	type = t;
+	id = 0;
+	cancel = false;
+	state = e_job_waiting;
+	items_done = 0;
+	files = 0;
+	bytes = 0;
+	result = FR_OK;
+}
+
+FileJob :: ~FileJob()
+{
+	for(int i=0;i<names.get_elements();i++) {
+		delete names[i];
+	}
+}
+
+void FileJob :: get_status(char *buffer)
+{
+	const char *what = (type == e_job_move) ? "Move" : "Copy";
+
+	switch(state) {
+	case e_job_waiting:
+		sprintf(buffer, "%s of %d items (waiting)", what, names.get_elements());
+		break;
+	case e_job_running:
+		sprintf(buffer, "%s %d/%d: %d files, %d MB", what, items_done, names.get_elements(), files, bytes >> 20);
+		break;
+	default:
+		if (result == FR_OK) {
+			sprintf(buffer, "%s done: %d files, %d MB", what, files, bytes >> 20);
+		} else {
+			sprintf(buffer, "%s: %s", what, FileSystem :: get_error_string(result));
+		}
+	}
+}
+
+// The browsers that show the directories of the job read them again
+void FileJob :: finish(void)
+{
+	FileManager *fm = FileManager :: getFileManager();
+
+	state = e_job_finished;
+	fm->sendEventToObservers(eRefreshDirectory, dest_path.c_str(), "");
+	if (type == e_job_move) {
+		fm->sendEventToObservers(eRefreshDirectory, source_path.c_str(), "");
+	}
+}
+
+// Whether path is dir, or lies below it. Both are normalized first, such
+// that separators and trailing slashes do not matter; FAT ignores case.
+static bool is_inside(const char *dir, const char *path)
+{
+	FileManager *fm = FileManager :: getFileManager();
+	Path *d = fm->get_new_path("file job dir");
+	Path *p = fm->get_new_path("file job path");
+	d->cd(dir);
+	p->cd(path);
+	// both end with a slash, so a match ends at a separator
+	bool inside = (strncasecmp(p->get_path(), d->get_path(), strlen(d->get_path())) == 0);
+	fm->release_path(d);
+	fm->release_path(p);
+	return inside;
+}
+
+FileJobs :: FileJobs() : SubSystem(SUBSYSID_FILE_JOBS), jobs(FILE_JOBS_QUEUE, NULL)
+{
+	next_id = 1;
+	jobsLock = xSemaphoreCreateMutex();
+	pending = xQueueCreate(FILE_JOBS_QUEUE, sizeof(FileJob *));
+	// fcopy recurses into directories
+	xTaskCreate( FileJobs :: run, "File Jobs", 2 * configMINIMAL_STACK_SIZE, this, tskIDLE_PRIORITY + 1, &taskHandle );
+}
+
+FileJobs :: ~FileJobs()
+{
+	vTaskDelete(taskHandle);
+	vQueueDelete(pending);
+	vSemaphoreDelete(jobsLock);
+	for(int i=0;i<jobs.get_elements();i++) {
+		delete jobs[i];
+	}
+}
+
+bool FileJobs :: submit(FileJob *job)
+{
+	xSemaphoreTake(jobsLock, portMAX_DELAY);
+	job->id = next_id++;
+	bool queued = xQueueSend(pending, &job, 0);
+	if (queued) {
+		jobs.append(job);
+	}
+	xSemaphoreGive(jobsLock);
+
+	if (!queued) {
+		printf("Too many file jobs. Job not started.\n");
+		delete job;
+		return false;
+	}
+	return true;
+}
+
+// static member
+void FileJobs :: run(void *a)
+{
+	FileJobs *fj = (FileJobs *)a;
+	FileJob *job;
+	while(1) {
+		if (xQueueReceive(fj->pending, &job, portMAX_DELAY)) {
+			fj->execute(job);
+			xSemaphoreTake(fj->jobsLock, portMAX_DELAY);
+			fj->jobs.remove(job);
+			xSemaphoreGive(fj->jobsLock);
+			delete job;
+		}
+	}
+}
+
+void FileJobs :: execute(FileJob *job)
+{
+	FileManager *fm = FileManager :: getFileManager();
+	mstring source;
+
+	job->state = e_job_running;
+	for(int i=0;i<job->names.get_elements();i++) {
+		if (job->cancel) {
+			job->result = FR_ABORTED;
+			break;
+		}
+		const char *name = job->names[i]->c_str();
+		FRESULT res;
+
+		// a directory cannot go into itself
+		join_path(source, job->source_path.c_str(), name);
+		if (is_inside(source.c_str(), job->dest_path.c_str())) {
+			res = FR_INVALID_PARAMETER;
+		} else if (job->type == e_job_move) {
+			res = move(job, name);
+		} else {
+			res = fm->fcopy(job->source_path.c_str(), name, job->dest_path.c_str(), job);
+		}
+		if (res != FR_OK) {
+			printf("File job %d: %s failed (%s)\n", job->id, name, FileSystem :: get_error_string(res));
+			if (job->result == FR_OK)
+				job->result = res;
+		}
+		job->items_done++;
+	}
+	job->finish();
+}
+
+// Renames within a file system. Across file systems, copies and deletes the
+// original once everything has been copied.
+FRESULT FileJobs :: move(FileJob *job, const char *name)
+{
+	FileManager *fm = FileManager :: getFileManager();
+	mstring from, to;
+	join_path(from, job->source_path.c_str(), name);
+	join_path(to, job->dest_path.c_str(), name);
+
+	FRESULT res = fm->rename(from.c_str(), to.c_str());
+	if (res != FR_INVALID_DRIVE) // moved, or failed for a reason that a copy would not solve
+		return res;
+
+	res = fm->fcopy(job->source_path.c_str(), name, job->dest_path.c_str(), job);
+	if (res != FR_OK)
+		return res;
+
+	Path *path = fm->get_new_path("move source");
+	path->cd(job->source_path.c_str());
+	res = delete_tree(path, name);
+	fm->release_path(path);
+	return res;
+}
+
+FRESULT FileJobs :: delete_tree(Path *path, const char *name)
+{
+	FileManager *fm = FileManager :: getFileManager();
+	FileInfo *info = new FileInfo(INFO_SIZE); // not on the stack, as we recurse
+
+	FRESULT res = fm->fstat(path, name, *info);
+	if ((res == FR_OK) && (info->attrib & AM_DIR)) {
+		IndexedList<FileInfo *> *dirlist = new IndexedList<FileInfo *>(16, NULL);
+		path->cd(name);
+		res = fm->get_directory(path, *dirlist);
+		for(int i=0;i<dirlist->get_elements();i++) {
+			FileInfo *el = (*dirlist)[i];
+			if (res == FR_OK)
+				res = delete_tree(path, el->lfname);
+			delete el;
+		}
+		delete dirlist;
+		path->cd("..");
+	}
+	if (res == FR_OK)
+		res = fm->delete_file(path, name);
+	delete info;
+	return res;
+}
+
+int FileJobs :: fetch_task_items(Path *path, IndexedList<Action*> &item_list)
+{
+	char name[72];
+	int count = 0;
+
+	xSemaphoreTake(jobsLock, portMAX_DELAY);
+	for(int i=0;i<jobs.get_elements();i++) {
+		FileJob *job = jobs[i];
+		if (job->cancel || (job->state == e_job_finished))
+			continue;
+		strcpy(name, "Cancel ");
+		job->get_status(name + strlen(name));
+		item_list.append(new Action(name, SUBSYSID_FILE_JOBS, MENU_FILE_JOB_CANCEL, job->id));
+		count++;
+	}
+	xSemaphoreGive(jobsLock);
+	return count;
+}
+
+int FileJobs :: executeCommand(SubsysCommand *cmd)
+{
+	switch(cmd->functionID) {
+	case MENU_FILE_JOB_CANCEL:
+		xSemaphoreTake(jobsLock, portMAX_DELAY);
+		for(int i=0;i<jobs.get_elements();i++) {
+			if (jobs[i]->id == cmd->mode) {
+				jobs[i]->cancel = true;
+			}
+		}
+		xSemaphoreGive(jobsLock);
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
@@ -0,0 +1,98 @@
+#ifndef FILE_JOBS_H
+#define FILE_JOBS_H
+
+#include "filemanager.h"
+#include "subsys.h"
+#include "menu.h"
+
+#define MENU_FILE_JOB_CANCEL    0x4A01
+
+#define FILE_JOBS_QUEUE            8 // jobs that can wait for their turn
+
+typedef enum {
+	e_job_copy,
+	e_job_move,
+} t_file_job_type;
+
+typedef enum {
+	e_job_waiting,
+	e_job_running,
+	e_job_finished,
+} t_file_job_state;
+
+/*
+ * A copy or move of a number of files and directories from one directory to
+ * another. The job follows its own progress through fcopy, for the task
+ * menu. When it is done, it tells the observers of the file manager which
+ * directories have changed.
+ */
+class FileJob : public CopyMonitor
+{
+public:
+	int      id;
+	t_file_job_type type;
+	mstring  source_path;
+	mstring  dest_path;
+	IndexedList<mstring *> names;
+	volatile bool cancel;
+
+	// progress
+	t_file_job_state state;
+	int      items_done; // of the names
+	uint32_t files;      // copied so far, those in directories included
+	uint32_t bytes;
+	FRESULT  result;     // the first failure
+
+	FileJob(t_file_job_type t, const char *source, const char *dest);
+	~FileJob();
+
+	void add(const char *name) {
+		names.append(new mstring(name));
+	}
+	void get_status(char *buffer); // at most 60 characters
+	void finish(void);
+
+	// CopyMonitor
+	bool cancelled(void) { return cancel; }
+	void copying(const char *filename, uint32_t size) { files++; }
+	void copied(uint32_t n) { bytes += n; }
+};
+
+/*
+ * Runs file jobs one after another in a task of its own, such that the user
+ * interface stays responsive while large collections are copied. Active jobs
+ * show up in the task menu, where they can be cancelled.
+ */
+class FileJobs : public SubSystem, ObjectWithMenu
+{
+	IndexedList<FileJob *> jobs; // waiting and running
+	SemaphoreHandle_t jobsLock;
+	QueueHandle_t pending;
+	TaskHandle_t taskHandle;
+	int next_id;
+
+	FileJobs();
+
+	static void run(void *a);
+	void execute(FileJob *job);
+	FRESULT move(FileJob *job, const char *name);
+	FRESULT delete_tree(Path *path, const char *name);
+	int executeCommand(SubsysCommand *cmd);
+public:
+	~FileJobs();
+
+	static FileJobs *getFileJobs(void) {
+		static FileJobs file_jobs;
+		return &file_jobs;
+	}
+
+	bool submit(FileJob *job); // takes the job; false when too many jobs are waiting
+
+	// SubSystem
+	const char *identify(void) { return "File Jobs"; }
+
+	// ObjectWithMenu
+	int fetch_task_items(Path *path, IndexedList<Action*> &item_list);
+};
+
+#endif
@@ -40,6 +40,7 @@ void FileManager :: invalidate(CachedTreeNode *o, int includeSelf)
 	par = o->parent;
 
 	printf("Invalidate event.. Param = %d. Checking %d files.\n", includeSelf, open_file_list.get_elements());
+	DentryCache :: invalidate(NULL);
 	pathStringC = o->get_full_path(pathString);
 	len = strlen(pathStringC);
 
@@ -197,7 +198,17 @@ FRESULT FileManager :: get_directory(Path *p, IndexedList<FileInfo *> &target)
 	Directory *dir;
 	mstring pathFromFSRoot;
 	FileSystem *fs = pathInfo.getLastInfo()->fs;
-	res = fs->dir_open(pathInfo.getPathFromLastFS(pathFromFSRoot), &dir, pathInfo.getLastInfo());
+	const char *fsPath = pathInfo.getPathFromLastFS(pathFromFSRoot);
+	FileInfo dirInfo(*pathInfo.getLastInfo());
+
+	// a listing that needs sorting is worth keeping
+	if (fs->needs_sorting() && DentryCache :: get_listing(fs, fsPath, &dirInfo, INFO_SIZE, target)) {
+		unlock();
+		return FR_OK;
+	}
+	uint32_t generation = DentryCache :: get_generation();
+
+	res = fs->dir_open(fsPath, &dir, pathInfo.getLastInfo());
 	FileInfo info(INFO_SIZE);
 	if (res == FR_OK) {
 		while(1) {
@@ -213,6 +224,11 @@ FRESULT FileManager :: get_directory(Path *p, IndexedList<FileInfo *> &target)
 	unlock();
 	if (fs->needs_sorting()) {
 		target.sort(FileInfo :: compare);
+		if (res == FR_NO_FILE) { // read up to the end
+			lock();
+			DentryCache :: store_listing(fs, fsPath, &dirInfo, generation, target);
+			unlock();
+		}
 	}
 	return FR_OK;
 }
@@ -252,12 +268,14 @@ FRESULT FileManager :: print_directory(const char *path)
 
 FRESULT FileManager :: fopen(Path *path, const char *filename, uint8_t flags, File **file)
 {
+	uint32_t allocations = MEM_ALLOCATIONS;
 	PathInfo pathInfo(rootfs);
 	pathInfo.init(path, filename);
 
 	lock();
 	// now do the actual thing
 	FRESULT res = fopen_impl(pathInfo, flags, file);
+	count_open(allocations);
 
 	unlock();
 	return res;
@@ -265,12 +283,14 @@ FRESULT FileManager :: fopen(Path *path, const char *filename, uint8_t flags, Fi
 
 FRESULT FileManager :: fopen(const char *path, const char *filename, uint8_t flags, File **file)
 {
+	uint32_t allocations = MEM_ALLOCATIONS;
 	PathInfo pathInfo(rootfs);
 	pathInfo.init(path, filename);
 
 	lock();
 	// now do the actual thing
 	FRESULT res = fopen_impl(pathInfo, flags, file);
+	count_open(allocations);
 
 	unlock();
 	return res;
@@ -278,12 +298,14 @@ FRESULT FileManager :: fopen(const char *path, const char *filename, uint8_t fla
 
 FRESULT FileManager :: fopen(const char *pathname, uint8_t flags, File **file)
 {
+	uint32_t allocations = MEM_ALLOCATIONS;
 	PathInfo pathInfo(rootfs);
 	pathInfo.init(pathname);
 
 	lock();
 	// now do the actual thing
 	FRESULT res = fopen_impl(pathInfo, flags, file);
+	count_open(allocations);
 
 	unlock();
 	return res;
@@ -308,6 +330,7 @@ FRESULT FileManager :: find_pathentry(PathInfo &pathInfo, bool open_mount)
 	mstring pathFromFSRoot;
 	mstring dirFromFSRoot;
 
+	lock(); // serializes the use of the dentry cache
 	FRESULT fres = FR_OK;
 	while(!ready) {
 		ready = true;
@@ -356,6 +379,7 @@ FRESULT FileManager :: find_pathentry(PathInfo &pathInfo, bool open_mount)
 			break;
 		}
 	}
+	unlock();
 
 	return fres;
 }
@@ -388,6 +412,11 @@ FRESULT FileManager :: fopen_impl(PathInfo &pathInfo, uint8_t flags, File **file
 
 	mstring workpath;
 
+	if (flags & (FA_WRITE | FA_CREATE_NEW | FA_CREATE_ALWAYS)) {
+		lock();
+		DentryCache :: invalidate(fs);
+		unlock();
+	}
 	if (create) {
 		fres = fs->dir_open(pathInfo.getDirectoryFromLastFS(workpath), &dir, pathInfo.getLastInfo());
 		if (fres == FR_OK) {
@@ -490,6 +519,23 @@ MountPoint *FileManager :: add_mount_point(File *file, FileSystemInFile *emb)
 	return mp;
 }
 
+// A file system that is mounted on top of a file that has changed can no
+// longer trust the directory entries it has cached.
+void FileManager :: file_changed(void *context, FileSystem *fs, uint32_t inode)
+{
+	FileManager *fm = (FileManager *)context;
+	fm->lock();
+	for(int i=0;i<fm->mount_points.get_elements();i++) {
+		MountPoint *mp = fm->mount_points[i];
+		if (fs && inode && !mp->match(fs, inode))
+			continue;
+		FileSystem *embedded = mp->get_embedded()->getFileSystem();
+		if (embedded)
+			DentryCache :: invalidate(embedded);
+	}
+	fm->unlock();
+}
+
 MountPoint *FileManager :: find_mount_point(FileInfo *info, FileInfo *parent, const char *dirpath, const char *filepath)
 {
 	// printf("FileManager :: find_mount_point: '%s' (parent: %s)\n", info->lfname, parent->lfname);
@@ -542,8 +588,14 @@ FRESULT FileManager :: delete_file(const char *pathname)
 		return fres;
 	}
 	FileSystem *fs = pathInfo.getLastInfo()->fs;
+	uint32_t inode = pathInfo.getLastInfo()->cluster;
 	mstring work;
 	fres = fs->file_delete(pathInfo.getPathFromLastFS(work));
+	lock();
+	DentryCache :: invalidate(fs);
+	unlock();
+	if (inode)
+		FileChanges :: report(fs, inode);
 	if (fres == FR_OK) {
 		pathInfo.workPath.getHead(work);
 		sendEventToObservers(eNodeRemoved, pathInfo.workPath.getSub(0, pathInfo.index-1, work), pathInfo.getFileName());
@@ -561,8 +613,14 @@ FRESULT FileManager :: delete_file(Path *path, const char *name)
 		return fres;
 	}
 	FileSystem *fs = pathInfo.getLastInfo()->fs;
+	uint32_t inode = pathInfo.getLastInfo()->cluster;
 	mstring work;
 	fres = fs->file_delete(pathInfo.getPathFromLastFS(work));
+	lock();
+	DentryCache :: invalidate(fs);
+	unlock();
+	if (inode)
+		FileChanges :: report(fs, inode);
 	if (fres == FR_OK) {
 		pathInfo.workPath.getHead(work);
 		sendEventToObservers(eNodeRemoved, pathInfo.workPath.getSub(0, pathInfo.index-1, work), pathInfo.getFileName());
@@ -609,6 +667,9 @@ FRESULT FileManager :: rename_impl(PathInfo &from, PathInfo &to)
 		fres = from.getLastInfo()->fs->file_rename(
 					from.getPathFromLastFS(work1),
 					to.getPathFromLastFS(work2));
+		lock();
+		DentryCache :: invalidate(from.getLastInfo()->fs);
+		unlock();
 		if (fres == FR_OK) {
 			const char *from_path = from.getFullPath(work1, -1);
 			const char *to_path = to.getFullPath(work2, -1);
@@ -640,6 +701,9 @@ FRESULT FileManager :: create_dir(const char *pathname)
 		mstring work;
 		pathInfo.getPathFromLastFS(work);
 		fres = fs->dir_create(work.c_str());
+		lock();
+		DentryCache :: invalidate(fs);
+		unlock();
 		if (fres == FR_OK) {
 			sendEventToObservers(eNodeAdded, pathInfo.getFullPath(work, -1), pathInfo.getFileName());
 		}
@@ -664,6 +728,9 @@ FRESULT FileManager :: create_dir(Path *path, const char *name)
 		mstring work;
 		pathInfo.getPathFromLastFS(work);
 		fres = fs->dir_create(work.c_str());
+		lock();
+		DentryCache :: invalidate(fs);
+		unlock();
 		if (fres == FR_OK) {
 			sendEventToObservers(eNodeAdded, path->get_path(), name);
 		}
@@ -672,7 +739,7 @@ FRESULT FileManager :: create_dir(Path *path, const char *name)
 	return fres;
 }
 
-FRESULT FileManager :: fcopy(const char *path, const char *filename, const char *dest)
+FRESULT FileManager :: fcopy(const char *path, const char *filename, const char *dest, CopyMonitor *monitor)
 {
 	printf("Copying %s to %s\n", filename, dest);
 	FileInfo *info = new FileInfo(INFO_SIZE); // I do not use the stack here for the whole structure, because
@@ -695,17 +762,25 @@ FRESULT FileManager :: fcopy(const char *path, const char *filename, const char
 				if (get_dir_result == FR_OK) {
 					dp->cd(filename);
 					for (int i=0;i<dirlist->get_elements();i++) {
+						if (monitor && monitor->cancelled()) {
+							ret = FR_ABORTED;
+							break;
+						}
 						FileInfo *el = (*dirlist)[i];
-						ret = fcopy(sp->get_path(), el->lfname, dp->get_path());
+						FRESULT el_result = fcopy(sp->get_path(), el->lfname, dp->get_path(), monitor);
+						if (el_result != FR_OK) // remember the first failure, but copy the rest
+							ret = (ret == FR_OK) ? el_result : ret;
 					}
 				} else {
 					ret = get_dir_result;
 				}
+				for (int i=0;i<dirlist->get_elements();i++) {
+					delete (*dirlist)[i];
+				}
 				delete dirlist;
 			} else {
 				ret = dir_create_result;
 			}
-			release_path(dp);
 		} else if ((info->attrib & AM_VOL) == 0) { // it is a file!
 			File *fi = 0;
 			ret = fopen(sp, filename, FA_READ, &fi);
@@ -713,25 +788,14 @@ FRESULT FileManager :: fcopy(const char *path, const char *filename, const char
 				File *fo = 0;
 				ret = fopen(dp, filename, FA_CREATE_NEW | FA_WRITE, &fo);
 				if (fo) {
-					uint8_t *buffer = new uint8_t[32768];
-					uint32_t transferred, written;
-					do {
-						FRESULT frd_result = fi->read(buffer, 32768, &transferred);
-						if (frd_result == FR_OK) {
-							FRESULT fwr_result = fo->write(buffer, transferred, &written);
-							if (fwr_result != FR_OK) {
-								ret = fwr_result;
-								break;
-							}
-						} else {
-							ret = frd_result;
-							break;
-						}
-					} while(transferred > 0);
-
-					delete[] buffer;
+					if (monitor)
+						monitor->copying(filename, fi->get_size());
+					ret = copy_contents(fi, fo, monitor);
 					fclose(fo);
 					fclose(fi);
+					if (ret != FR_OK) { // don't leave a file behind that looks complete
+						delete_file(dp, filename);
+					}
 				} else { // no output file
 					printf("Cannot open output file %s\n", filename);
 					fclose(fi);
@@ -743,11 +807,173 @@ FRESULT FileManager :: fcopy(const char *path, const char *filename, const char
 	} else {
 		printf("Could not stat %s (%s)\n", filename, FileSystem :: get_error_string(ret));
 	}
+	release_path(dp);
 	release_path(sp);
 	delete info;
 	return ret;
 }
 
+static uint32_t copy_time_ms(void)
+{
+#ifdef OS
+	return xTaskGetTickCount() * portTICK_PERIOD_MS;
+#else
+	return 0;
+#endif
+}
+
+FRESULT FileManager :: copy_contents(File *fi, File *fo, CopyMonitor *monitor)
+{
+	FRESULT res = FR_OK;
+	uint32_t size = fi->get_size();
+	uint32_t start = copy_time_ms();
+	bool streamed = false;
+
+	if (size > COPY_BUFFER_SIZE) {
+		// seeking beyond the end allocates all clusters of the file at once,
+		// instead of one at a time between the writes. File systems that
+		// cannot extend a file this way leave it empty; they get plain writes.
+		res = fo->seek(size);
+		uint32_t allocated = fo->get_size();
+		if ((res == FR_OK) && allocated && (allocated < size))
+			return FR_DISK_FULL; // the file only grew as far as there was room
+		res = fo->seek(0);
+		if (res != FR_OK)
+			return res;
+	}
+
+	// Reading and writing can only overlap when they go to different devices.
+	// Files inside files (no device) and small files are copied in one go.
+	BlockDevice *src = fi->get_file_system()->get_device();
+	BlockDevice *dst = fo->get_file_system()->get_device();
+	if ((size > COPY_BUFFER_SIZE) && src && dst && (src != dst) && take_copy_engine()) {
+		res = copy_streamed(fi, fo, monitor);
+		streamed = true;
+#ifdef OS
+		xSemaphoreGive(copyEngine);
+#endif
+	} else {
+		uint8_t *buffer = new uint8_t[COPY_BUFFER_SIZE];
+		uint32_t transferred, written;
+		do {
+			res = fi->read(buffer, COPY_BUFFER_SIZE, &transferred);
+			if (res != FR_OK)
+				break;
+			res = fo->write(buffer, transferred, &written);
+			if ((res == FR_OK) && (written != transferred))
+				res = FR_DISK_FULL;
+			if (monitor && (res == FR_OK)) {
+				monitor->copied(written);
+				if (monitor->cancelled())
+					res = FR_ABORTED;
+			}
+		} while((res == FR_OK) && (transferred > 0));
+		delete[] buffer;
+	}
+
+	uint32_t ms = copy_time_ms() - start;
+	copyStats.files++;
+	if (streamed)
+		copyStats.streamed++;
+	if (res == FR_OK) {
+		copyStats.bytes += size;
+		copyStats.ms += ms;
+		if (ms)
+			printf("Copied %d bytes in %d ms (%d KB/s)\n", size, ms, size / ms);
+	}
+	return res;
+}
+
+// Takes the copy task for one file, and creates it the first time. Returns
+// false when another copy is using it, or when there is no OS to run it.
+bool FileManager :: take_copy_engine(void)
+{
+#ifdef OS
+	if (xSemaphoreTake(copyEngine, 0) != pdTRUE)
+		return false;
+	if (!copyTask) {
+		copyBuffers = new t_copy_buffer[COPY_BUFFERS];
+		copyRequests = xQueueCreate(1, sizeof(File *));
+		copyFree = xQueueCreate(COPY_BUFFERS, sizeof(t_copy_buffer *));
+		copyFilled = xQueueCreate(COPY_BUFFERS, sizeof(t_copy_buffer *));
+		for(int i=0;i<COPY_BUFFERS;i++) {
+			t_copy_buffer *buf = &copyBuffers[i];
+			buf->data = new uint8_t[COPY_BUFFER_SIZE];
+			xQueueSend(copyFree, &buf, 0);
+		}
+		xTaskCreate( FileManager :: copy_read_task, "File Copy Reader", configMINIMAL_STACK_SIZE, this, tskIDLE_PRIORITY + 1, &copyTask );
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+// The copy task reads the file into free buffers, until the end of the file,
+// an error, or an abort; the last buffer it passes on has length 0.
+// static member
+void FileManager :: copy_read_task(void *a)
+{
+#ifdef OS
+	FileManager *fm = (FileManager *)a;
+	File *file;
+	t_copy_buffer *buf;
+	while(1) {
+		if (!xQueueReceive(fm->copyRequests, &file, portMAX_DELAY))
+			continue;
+		uint32_t length;
+		do {
+			xQueueReceive(fm->copyFree, &buf, portMAX_DELAY);
+			buf->length = 0;
+			buf->result = FR_OK;
+			if (!fm->copyAbort) {
+				buf->result = file->read(buf->data, COPY_BUFFER_SIZE, &buf->length);
+				if (buf->result != FR_OK)
+					buf->length = 0;
+			}
+			length = buf->length;
+			xQueueSend(fm->copyFilled, &buf, portMAX_DELAY);
+		} while(length > 0);
+	}
+#endif
+}
+
+// Writes the buffers that the copy task has filled, and hands them back.
+// After a failure it keeps taking buffers until the task has stopped.
+FRESULT FileManager :: copy_streamed(File *fi, File *fo, CopyMonitor *monitor)
+{
+	FRESULT res = FR_OK;
+#ifdef OS
+	t_copy_buffer *buf;
+	uint32_t length;
+	uint32_t written;
+
+	copyAbort = false;
+	xQueueSend(copyRequests, &fi, portMAX_DELAY);
+	do {
+		xQueueReceive(copyFilled, &buf, portMAX_DELAY);
+		length = buf->length;
+		if (res == FR_OK) {
+			res = buf->result;
+			if ((res == FR_OK) && length) {
+				res = fo->write(buf->data, length, &written);
+				if ((res == FR_OK) && (written != length))
+					res = FR_DISK_FULL;
+			}
+			if (monitor && (res == FR_OK)) {
+				monitor->copied(length);
+				if (monitor->cancelled())
+					res = FR_ABORTED;
+			}
+			if (res != FR_OK)
+				copyAbort = true;
+		}
+		xQueueSend(copyFree, &buf, portMAX_DELAY);
+	} while(length > 0);
+#endif
+	return res;
+}
+
 /* some handy functions */
 void set_extension(char *buffer, const char *ext, int buf_size)
 {
@@ -7,15 +7,53 @@
 #include "cached_tree_node.h"
 #include "observer.h"
 #include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
 #include "semphr.h"
 #include "embedded_fs.h"
 
+#ifndef RUNS_ON_PC
+#include "memory.h"
+#define MEM_ALLOCATIONS mem_allocations
+#else
+#define MEM_ALLOCATIONS 0
+#endif
+
 void set_extension(char *buffer, const char *ext, int buf_size);
 void get_extension(const char *name, char *ext);
 void fix_filename(char *buffer);
 
 #define INFO_SIZE 128
 
+// fcopy reads into one buffer while the previous one is written
+#define COPY_BUFFER_SIZE 32768
+#define COPY_BUFFERS     2
+
+struct t_copy_buffer
+{
+	uint8_t *data;
+	uint32_t length;  // 0 = end of file, or the copy was aborted
+	FRESULT  result;  // of the read
+};
+
+// Lets the caller of fcopy follow the copy, and stop it
+class CopyMonitor
+{
+public:
+	virtual ~CopyMonitor() { }
+	virtual bool cancelled(void) { return false; }
+	virtual void copying(const char *filename, uint32_t size) { } // a file is about to be copied
+	virtual void copied(uint32_t bytes) { } // part of the current file has been written
+};
+
+struct t_copy_stats
+{
+	uint32_t files;
+	uint32_t streamed;  // files copied while reading ahead in the copy task
+	uint32_t bytes;
+	uint32_t ms;
+};
+
 class MountPoint
 {
 	File *file;
@@ -69,20 +107,58 @@ class FileManager
 	CachedTreeNode *root;
 	FileSystem *rootfs;
 
+	// statistics
+	uint32_t open_count;
+	uint32_t open_allocations; // heap allocations made by all fopen calls together
+
+	// copying: a task reads the source file ahead, while fcopy writes
+	SemaphoreHandle_t copyEngine; // held by the fcopy that uses the copy task
+	TaskHandle_t copyTask;
+	QueueHandle_t copyRequests;   // files for the copy task to read
+	QueueHandle_t copyFree;
+	QueueHandle_t copyFilled;
+	t_copy_buffer *copyBuffers;
+	volatile bool copyAbort;      // the destination failed; stop reading
+	t_copy_stats copyStats;
+
     FileManager() : mount_points(8, NULL), open_file_list(16, NULL), used_paths(8, NULL), observers(4, NULL) {
+        open_count = 0;
+        open_allocations = 0;
         root = new CachedTreeNode(NULL, "RootNode");
         root->get_file_info()->attrib = AM_DIR;
         rootfs = new FileSystem_Root(root);
 #ifdef OS
         serializer = xSemaphoreCreateRecursiveMutex();
+        copyEngine = xSemaphoreCreateMutex();
 #else
         serializer = 0;
+        copyEngine = 0;
 #endif
+        copyTask = 0;
+        copyRequests = 0;
+        copyFree = 0;
+        copyFilled = 0;
+        copyBuffers = 0;
+        copyAbort = false;
+        memset(&copyStats, 0, sizeof(copyStats));
+        FileChanges :: subscribe(FileManager :: file_changed, this);
     }
 
     ~FileManager() {
+        FileChanges :: unsubscribe(FileManager :: file_changed, this);
 #ifdef OS
     	vSemaphoreDelete(serializer);
+    	vSemaphoreDelete(copyEngine);
+    	if (copyTask) {
+    		vTaskDelete(copyTask);
+    		vQueueDelete(copyRequests);
+    		vQueueDelete(copyFree);
+    		vQueueDelete(copyFilled);
+    		for(int i=0;i<COPY_BUFFERS;i++) {
+    			delete[] copyBuffers[i].data;
+    		}
+    		delete[] copyBuffers;
+    	}
 #endif
     	for(int i=0;i<open_file_list.get_elements();i++) {
         	delete open_file_list[i];
@@ -100,6 +176,16 @@ class FileManager
 	FRESULT find_pathentry(PathInfo &pathInfo, bool enter_mount);
 	FRESULT fopen_impl(PathInfo &pathInfo, uint8_t flags, File **);
 	FRESULT rename_impl(PathInfo &from, PathInfo &to);
+	static void file_changed(void *context, FileSystem *fs, uint32_t inode);
+	void count_open(uint32_t allocations_before) {
+		open_count++;
+		open_allocations += MEM_ALLOCATIONS - allocations_before;
+	}
+
+	static void copy_read_task(void *a);
+	bool take_copy_engine(void);
+	FRESULT copy_contents(File *fi, File *fo, CopyMonitor *monitor);
+	FRESULT copy_streamed(File *fi, File *fo, CopyMonitor *monitor);
 
 //	friend class FileDirEntry;
 
@@ -144,6 +230,13 @@ public:
     		MountPoint *f = mount_points[i];
     		printf("%p:\n", mount_points[i]->get_embedded()); // , mount_points[i]->get_path()
     	}
+    	printf("\nFiles opened: %d, heap allocations per open: %d.%02d\n", open_count,
+    			open_count ? open_allocations / open_count : 0,
+    			open_count ? ((open_allocations * 100) / open_count) % 100 : 0);
+    	printf("Files copied: %d (%d streamed), %d bytes in %d ms\n", copyStats.files, copyStats.streamed,
+    			copyStats.bytes, copyStats.ms);
+    	printf("\n");
+    	DentryCache :: dump();
 		unlock();
 	}
 
@@ -180,7 +273,7 @@ public:
     FRESULT fopen(const char *pathname, uint8_t flags, File **);
 
     void 	fclose(File *f);
-    FRESULT fcopy(const char *path, const char *filename, const char *dest);
+    FRESULT fcopy(const char *path, const char *filename, const char *dest, CopyMonitor *monitor = NULL);
 
     FRESULT rename(Path *path, const char *old_name, const char *new_name);
     FRESULT rename(const char *old_name, const char *new_name);
@@ -201,10 +294,18 @@ public:
     	observers.remove(q);
     }
     void sendEventToObservers(eFileManagerEventType e, const char *p, const char *n="") {
+    	if ((e == eNodeMediaRemoved) || (e == eNodeUpdated)) {
+    		lock();
+    		DentryCache :: invalidate(NULL); // the media behind a node has changed
+    		unlock();
+    		FileChanges :: report(NULL, 0);
+    	}
     	printf("Sending FM event to %d observers: %d %s %s\n", observers.get_elements(), e, p, n);
     	for(int i=0;i<observers.get_elements();i++) {
     		FileManagerEvent *ev = new FileManagerEvent(e, p, n);
-    		observers[i]->putEvent(ev, i);
+    		if (!observers[i]->putEvent(ev, i)) {
+    			delete ev;
+    		}
     	}
     }
 };
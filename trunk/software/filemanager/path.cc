@@ -10,145 +10,158 @@
 #include "file_info.h"
 #include <string.h>
 
-Path :: Path() : full_path("/"), elements(10, NULL)
+Path :: Path()
 {
     owner = "Unknown";
-    depth = 0;
+    full_path = full_path_local;
+    names = names_local;
+    element = element_local;
+    capacity = PATH_INLINE_LENGTH;
+    max_depth = PATH_INLINE_DEPTH;
+    cleanupElements();
 }
 
 Path :: ~Path()
 {
-	cleanupElements();
+	if (full_path != full_path_local) {
+		delete[] full_path;
+		delete[] names;
+	}
+	if (element != element_local)
+		delete[] element;
+}
+
+// Makes room for names of 'length' characters in total (terminators
+// included) and 'dep' elements.
+void Path :: reserve(int length, int dep)
+{
+	if (length + 2 > capacity) { // full_path has a leading '/' and its terminator
+		int new_capacity = 2 * capacity;
+		while (length + 2 > new_capacity)
+			new_capacity *= 2;
+		char *new_full = new char[new_capacity];
+		char *new_names = new char[new_capacity];
+		memcpy(new_full, full_path, capacity);
+		memcpy(new_names, names, capacity);
+		if (full_path != full_path_local) {
+			delete[] full_path;
+			delete[] names;
+		}
+		full_path = new_full;
+		names = new_names;
+		capacity = new_capacity;
+	}
+	if (dep > max_depth) {
+		int new_depth = 2 * max_depth;
+		while (dep > new_depth)
+			new_depth *= 2;
+		int *new_element = new int[new_depth];
+		memcpy(new_element, element, max_depth * sizeof(int));
+		if (element != element_local)
+			delete[] element;
+		element = new_element;
+		max_depth = new_depth;
+	}
 }
 
 void Path :: update(const char *p)
 {
-	if (full_path == p)
+	if (strcmp(full_path, p) == 0)
 		return;
 
-	full_path = p;
+	cleanupElements();
+	cd(p);
 }
 
+// Replaces element i, for instance by the name as it is spelled on the media.
 void Path :: update(int i, const char *p)
 {
-	if (!elements[i]) {
-		elements.set(i, new mstring(p));
+	if ((i < 0) || (i >= depth))
 		return;
-	}
 
-	if (*(elements[i]) == p)
+	char *old = names + element[i];
+	if (strcmp(old, p) == 0)
 		return;
 
-	*(elements[i]) = p;
+	int old_size = strlen(old) + 1;
+	int new_size = strlen(p) + 1;
+	int diff = new_size - old_size;
+	reserve(names_length + diff, depth);
+	old = names + element[i];
+	memmove(old + new_size, old + old_size, names_length - element[i] - old_size);
+	memcpy(old, p, new_size);
+	for(int j=i+1;j<depth;j++)
+		element[j] += diff;
+	names_length += diff;
+	regenerateFullPath();
 }
 
 void Path :: cleanupElements() {
-	for(int i=0;i<depth;i++) {
-		if (elements[i]) {
-			delete elements[i];
-			elements.set(i, 0);
-		}
-	}
 	depth = 0;
+	names_length = 0;
+	full_path[0] = '/';
+	full_path[1] = '\0';
 }
 
-int Path :: cd_single(char *cd)
+int Path :: cd_single(const char *cd, int len)
 {
-    int p_len = full_path.length();
-    char *p = (char *)full_path.c_str();
-
 	// printf("CD Single: %s\n", cd);
-    if(strcmp(cd, "..") == 0) {
-		for(int i=p_len-2;i>=0;i--) {
-			if((p[i] == '/')||(p[i] == '\\')||(i==0)) {
-				p[i+1] = '\0';
-				depth--;
-				delete elements[depth];
-				elements.set(depth, 0);
-				break;
-			}
+    if((len == 2) && (cd[0] == '.') && (cd[1] == '.')) {
+		if(depth > 0) {
+			depth--;
+			names_length = element[depth];
+			full_path[names_length + 1] = '\0'; // the names and separators are as long as the names and terminators
 		}
         return 1;
     }
-    if(strcmp(cd, ".") == 0) {
+    if((len == 1) && (cd[0] == '.')) {
         return 1;
     }
 
-    update(depth, cd);
+    reserve(names_length + len + 1, depth + 1);
+    element[depth] = names_length;
+    memcpy(names + names_length, cd, len);
+    names[names_length + len] = '\0';
+    memcpy(full_path + names_length + 1, cd, len);
+    full_path[names_length + len + 1] = '/';
+    full_path[names_length + len + 2] = '\0';
+    names_length += len + 1;
     depth++;
-    full_path += cd;
-	full_path += "/";
 	return 1;
 }
 
-int Path :: cd(const char *pa_in)
+int Path :: cd(const char *pa)
 {
-	int pa_len = strlen(pa_in);
-
-    //int fp_len = full_path.length();
-    //const char *fp = full_path.c_str();
-    char *last_part;
+	int pa_len = strlen(pa);
 
-	char *pa_alloc = new char[pa_len+1];
-	char *pa = pa_alloc;
-	
-	strcpy(pa, pa_in);
-    
-    // printf("CD '%s' (starting from %s)\n", pa, full_path.c_str());
+    // printf("CD '%s' (starting from %s)\n", pa, full_path);
 	
     // check for start from root
     if( (pa_len) &&
 	    ((*pa == '/')||(*pa == '\\')) ) {
         --pa_len;
         pa++;
-        full_path = "/";
         cleanupElements();
     }
 
-    // nothing to be done anymore
-    if(!pa_len) {
-		delete[] pa_alloc;
-        return 1;
-	}
-
-    // snoop last '/' (or '\')
-    if ((pa[pa_len-1] == '/')||(pa[pa_len-1] == '\\')) {
-        pa_len--;
-        pa[pa_len] = 0;
-    }
-
-    // nothing to be done anymore
-    if(!pa_len) {
-		delete[] pa_alloc;
-        return 1;
-	}
-
-    // split path string into separate parts
-    last_part = pa;
-    for(int i=0;i<pa_len;i++) {
-        if((pa[i] == '/')||(pa[i] == '\\')) {
-            pa[i] = 0;
-            if(!cd_single(last_part)) {
-                printf("A) Can't CD to %s\n", pa);
-                delete[] pa_alloc;
-				return 0;
-            }
+    // split path string into separate parts; empty parts are skipped
+    const char *last_part = pa;
+    for(int i=0;i<=pa_len;i++) {
+        if((i == pa_len) || (pa[i] == '/') || (pa[i] == '\\')) {
+        	int len = &pa[i] - last_part;
+        	if (len && !cd_single(last_part, len)) {
+        		printf("Can't CD to %s\n", pa);
+        		return 0;
+        	}
             last_part = &pa[i+1];
         }
     }
-
-    if(!cd_single(last_part)) {
-        printf("B) Can't CD to %s\n", last_part);
-        delete[] pa_alloc;
-		return 0;
-    }
-	delete[] pa_alloc;
     return 1;
 }
 
 const char *Path :: get_path(void)
 {
-	return full_path.c_str();
+	return full_path;
 }
 
 int Path :: getDepth()
@@ -161,7 +174,7 @@ const char *Path :: getElement(int a)
 	if ((a >= depth) || (a < 0)) {
 		return "illegal!";
 	}
-	return (elements[a])->c_str();
+	return names + element[a];
 }
 
 /*
@@ -188,35 +201,34 @@ const char * Path :: getTail(int index, mstring &work)
 
 const char * Path :: getSub(int start, int stop, mstring &work)
 {
-	work = "";
-	for(int i = start; i < stop; i++) {
-		work += "/";
-		work += (elements[i])->c_str();
-	}
-	if (work.length() == 0)
+	if (start < 0)
+		start = 0;
+	if (stop > depth)
+		stop = depth;
+	if (start >= stop) {
 		work = "/";
+		return work.c_str();
+	}
+	// the wanted elements are consecutive in full_path, between separators
+	int begin = element[start];
+	int end = (stop < depth) ? element[stop] : names_length;
+	char save = full_path[end];
+	full_path[end] = '\0';
+	work = full_path + begin;
+	full_path[end] = save;
 	return work.c_str();
 }
 
 const char * Path :: getHead(mstring &work)
 {
-	work = "";
-	for(int i = 0; i < depth - 1; i++) {
-		work += "/";
-		work += (elements[i])->c_str();
-	}
-	if (work.length() == 0)
-		work = "/";
-	return work.c_str();
+	return getSub(0, depth - 1, work);
 }
 
 void Path :: regenerateFullPath()
 {
-	full_path = "/";
-	for(int i=0;i<depth;i++) {
-		full_path += (elements[i])->c_str();
-		full_path += "/";
-	}
+	for(int i=0;i<names_length;i++)
+		full_path[i+1] = names[i] ? names[i] : '/';
+	full_path[names_length + 1] = '\0';
 }
 
 
@@ -239,12 +251,8 @@ void Path :: get_display_string(const char *filename, char *buffer, int width)
 //   COMPARE PATH OBJECTS 
 // =======================
 
-int path_object_compare(IndexedList<CachedTreeNode *> *list, int a, int b)
+int path_object_compare(CachedTreeNode *obj_a, CachedTreeNode *obj_b)
 {
-//	printf("Compare %d and %d: ", a, b);
-	CachedTreeNode *obj_a = (*list)[a];
-	CachedTreeNode *obj_b = (*list)[b];
-	
 	if(!obj_b)
 		return 1;
 	if(!obj_a)
@@ -10,15 +10,33 @@
 
 class FileManager;
 
+#define PATH_INLINE_LENGTH 128 // characters of a path kept in the Path object itself
+#define PATH_INLINE_DEPTH   16 // elements of a path kept in the Path object itself
+
 class Path
 {
 private:
     friend class FileManager;
     friend class PathInfo;
-    mstring full_path;
-    ManagedArray<mstring *>elements;
-    int depth;
-    int cd_single(char *p);
+
+    // The elements are kept as a string table: one buffer with the names,
+    // each terminated by a zero, and an array with the offset of each name.
+    // full_path is the same path with separators. Both buffers and the
+    // array are part of the object, until the path outgrows them; only
+    // then do they move to the heap.
+    char *full_path;
+    char *names;
+    int  *element;
+    int   capacity;     // of full_path and names
+    int   max_depth;    // of element
+    int   names_length;
+    int   depth;
+    char  full_path_local[PATH_INLINE_LENGTH];
+    char  names_local[PATH_INLINE_LENGTH];
+    int   element_local[PATH_INLINE_DEPTH];
+
+    void reserve(int length, int depth);
+    int cd_single(const char *p, int len);
     void cleanupElements();
     void update(const char *p);
     void update(int i, const char *p);
@@ -42,7 +60,7 @@ public:
     FRESULT get_directory(IndexedList<FileInfo *> &target);
     bool isValid();
     void dump() {
-    	printf("** PATH OBJECT ** Owner = %s ** FullPathString = %s\n", owner, full_path.c_str());
+    	printf("** PATH OBJECT ** Owner = %s ** FullPathString = %s\n", owner, full_path);
     	for(int i=0;i<depth;i++) {
     		printf(" %2d: %s\n", i, getElement(i));
     	}
@@ -38,3 +38,8 @@ DRESULT BlockDevice::ioctl(uint8_t command, void *data)
 {
     return RES_NOTRDY;
 }
+
+DRESULT BlockDevice::sync(void)
+{
+    return RES_OK;
+}
@@ -25,7 +25,7 @@ class BlockDevice
 public:
     BlockDevice();
     virtual ~BlockDevice();
-    t_device_state get_state(void)   { return dev_state; }
+    virtual t_device_state get_state(void) { return dev_state; }
     void set_state(t_device_state s) { dev_state = s; }
 
     virtual DSTATUS init(void);
@@ -35,6 +35,7 @@ public:
     virtual DRESULT write(const uint8_t *, uint32_t, int);
 #endif
     virtual DRESULT ioctl(uint8_t, void *);
+    virtual DRESULT sync(void); // writes back what is cached
     
 };
 
@@ -0,0 +1,316 @@
+
+#include <stdio.h>
+#include <string.h>
+#include "blockdev_cached.h"
+
+BlockDevice_Cached::BlockDevice_Cached(BlockDevice *blk, int sec_size, int sets, int ways, int read_ahead)
+{
+    dev = blk; // reference only
+    sector_size = sec_size;
+    this->sets = sets;
+    this->ways = ways;
+    this->read_ahead = read_ahead;
+
+    lines = new Line[sets * ways];
+    data = new uint8_t[sets * ways * sec_size];
+    read_buffer = new uint8_t[(BLOCK_CACHE_BYPASS + read_ahead) * sec_size];
+    write_buffer = new uint8_t[BLOCK_CACHE_MAX_RUN * sec_size];
+#ifdef OS
+    mutex = xSemaphoreCreateMutex();
+#endif
+
+    hits = 0;
+    misses = 0;
+    device_reads = 0;
+    device_writes = 0;
+    invalidate_impl();
+}
+
+BlockDevice_Cached::~BlockDevice_Cached()
+{
+    sync();
+    delete[] lines;
+    delete[] data;
+    delete[] read_buffer;
+    delete[] write_buffer;
+#ifdef OS
+    vSemaphoreDelete(mutex);
+#endif
+}
+
+void BlockDevice_Cached::invalidate(void)
+{
+    lock();
+    invalidate_impl();
+    unlock();
+}
+
+void BlockDevice_Cached::invalidate_impl(void)
+{
+    for(int i=0;i<sets*ways;i++) {
+        lines[i].valid = false;
+        lines[i].dirty = false;
+        lines[i].stamp = 0;
+    }
+    clock = 0;
+    next_sequential = 0xFFFFFFFF;
+    sector_count = 0;
+    count_known = false;
+}
+
+void BlockDevice_Cached::print_info(void)
+{
+    printf("Block cache: %d sets of %d sectors. Hits: %d, misses: %d, device reads: %d, device writes: %d\n",
+            sets, ways, hits, misses, device_reads, device_writes);
+}
+
+DSTATUS BlockDevice_Cached::init(void)
+{
+    lock();
+    invalidate_impl();
+    DSTATUS res = dev->init();
+    unlock();
+    return res;
+}
+
+DSTATUS BlockDevice_Cached::status(void)
+{
+    return dev->status();
+}
+
+BlockDevice_Cached::Line *BlockDevice_Cached::lookup(uint32_t sector)
+{
+    Line *set = &lines[(sector % sets) * ways];
+    for(int w=0;w<ways;w++) {
+        if (set[w].valid && (set[w].sector == sector))
+            return &set[w];
+    }
+    return NULL;
+}
+
+// Returns a line for the given sector, to be filled by the caller. Returns
+// NULL when the line that had to make room could not be written back.
+BlockDevice_Cached::Line *BlockDevice_Cached::allocate(uint32_t sector, DRESULT &res)
+{
+    Line *set = &lines[(sector % sets) * ways];
+    Line *victim = set;
+    for(int w=0;w<ways;w++) {
+        if (!set[w].valid) {
+            victim = &set[w];
+            break;
+        }
+        if (set[w].stamp < victim->stamp)
+            victim = &set[w];
+    }
+    if (victim->valid && victim->dirty) {
+        res = write_back(victim);
+        if (res != RES_OK)
+            return NULL;
+    }
+    victim->sector = sector;
+    victim->valid = true;
+    victim->dirty = false;
+    victim->stamp = ++clock;
+    return victim;
+}
+
+// Writes the line, together with the dirty sectors before and after it,
+// with one request.
+DRESULT BlockDevice_Cached::write_back(Line *l)
+{
+    uint32_t first = l->sector;
+    int count = 1;
+    while((first > 0) && (count < BLOCK_CACHE_MAX_RUN)) {
+        Line *prev = lookup(first - 1);
+        if (!prev || !prev->dirty)
+            break;
+        first--;
+        count++;
+    }
+    while(count < BLOCK_CACHE_MAX_RUN) {
+        Line *next = lookup(first + count);
+        if (!next || !next->dirty)
+            break;
+        count++;
+    }
+
+    DRESULT res;
+    if (count == 1) {
+        res = dev->write(line_data(l), first, 1);
+    } else {
+        for(int i=0;i<count;i++)
+            memcpy(write_buffer + i * sector_size, line_data(lookup(first + i)), sector_size);
+        res = dev->write(write_buffer, first, count);
+    }
+    device_writes++;
+    if (res == RES_OK) {
+        for(int i=0;i<count;i++)
+            lookup(first + i)->dirty = false;
+    }
+    return res;
+}
+
+// Returns how many of 'count' sectors from 'sector' on exist on the device.
+int BlockDevice_Cached::limit_read_ahead(uint32_t sector, int count)
+{
+    if (!count_known) {
+        if (dev->ioctl(GET_SECTOR_COUNT, &sector_count) != RES_OK)
+            sector_count = 0;
+        count_known = true;
+    }
+    if (sector >= sector_count)
+        return 0;
+    if (sector_count - sector < (uint32_t)count)
+        return (int)(sector_count - sector);
+    return count;
+}
+
+DRESULT BlockDevice_Cached::read(uint8_t *buffer, uint32_t sector, int count)
+{
+    lock();
+    DRESULT res = read_impl(buffer, sector, count);
+    unlock();
+    return res;
+}
+
+DRESULT BlockDevice_Cached::read_impl(uint8_t *buffer, uint32_t sector, int count)
+{
+    DRESULT res;
+    bool sequential = (sector == next_sequential);
+    next_sequential = sector + count;
+
+    if (count > BLOCK_CACHE_BYPASS) {
+        res = dev->read(buffer, sector, count);
+        device_reads++;
+        if (res != RES_OK)
+            return res;
+        // sectors that have not been written back are newer than the device
+        for(int i=0;i<count;i++) {
+            Line *l = lookup(sector + i);
+            if (l && l->dirty)
+                memcpy(buffer + i * sector_size, line_data(l), sector_size);
+        }
+        return RES_OK;
+    }
+
+    int i = 0;
+    while(i < count) {
+        Line *l = lookup(sector + i);
+        if (l) {
+            memcpy(buffer + i * sector_size, line_data(l), sector_size);
+            l->stamp = ++clock;
+            hits++;
+            i++;
+            continue;
+        }
+        // read all consecutive misses at once, and read ahead after the last one
+        int n = 1;
+        while((i + n < count) && !lookup(sector + i + n))
+            n++;
+        int extra = 0;
+        if (sequential && (i + n == count)) {
+            extra = limit_read_ahead(sector + count, read_ahead);
+            // stop at a sector that we have already; it may not have been written
+            // back yet, or it may be written back while the others are stored
+            for(int e=0;e<extra;e++) {
+                if (lookup(sector + count + e)) {
+                    extra = e;
+                    break;
+                }
+            }
+        }
+
+        res = dev->read(read_buffer, sector + i, n + extra);
+        device_reads++;
+        if (res != RES_OK)
+            return res;
+        misses += n;
+        memcpy(buffer + i * sector_size, read_buffer, n * sector_size);
+
+        for(int j=0;j<n+extra;j++) {
+            l = allocate(sector + i + j, res);
+            if (!l)
+                continue; // no room; the data was delivered anyway
+            memcpy(line_data(l), read_buffer + j * sector_size, sector_size);
+        }
+        i += n;
+    }
+    return RES_OK;
+}
+
+DRESULT BlockDevice_Cached::write(const uint8_t *buffer, uint32_t sector, int count)
+{
+    lock();
+    DRESULT res = write_impl(buffer, sector, count);
+    unlock();
+    return res;
+}
+
+DRESULT BlockDevice_Cached::write_impl(const uint8_t *buffer, uint32_t sector, int count)
+{
+    DRESULT res;
+
+    if (count > BLOCK_CACHE_BYPASS) {
+        res = dev->write(buffer, sector, count);
+        device_writes++;
+        for(int i=0;i<count;i++) {
+            Line *l = lookup(sector + i);
+            if (l) {
+                l->valid = false;
+                l->dirty = false;
+            }
+        }
+        return res;
+    }
+
+    for(int i=0;i<count;i++) {
+        Line *l = lookup(sector + i);
+        if (!l) {
+            l = allocate(sector + i, res);
+            if (!l) { // no room; write this one through
+                res = dev->write(buffer + i * sector_size, sector + i, 1);
+                device_writes++;
+                if (res != RES_OK)
+                    return res;
+                continue;
+            }
+        }
+        memcpy(line_data(l), buffer + i * sector_size, sector_size);
+        l->dirty = true;
+        l->stamp = ++clock;
+    }
+    return RES_OK;
+}
+
+DRESULT BlockDevice_Cached::sync(void)
+{
+    lock();
+    DRESULT res = sync_impl();
+    unlock();
+    return res;
+}
+
+DRESULT BlockDevice_Cached::sync_impl(void)
+{
+    DRESULT res = RES_OK;
+    for(int i=0;i<sets*ways;i++) {
+        if (lines[i].valid && lines[i].dirty) {
+            DRESULT r = write_back(&lines[i]);
+            if (r != RES_OK)
+                res = r;
+        }
+    }
+    return res;
+}
+
+DRESULT BlockDevice_Cached::ioctl(uint8_t command, void *data)
+{
+    DRESULT res;
+    lock();
+    if (command == CTRL_SYNC)
+        res = sync_impl();
+    else
+        res = dev->ioctl(command, data);
+    unlock();
+    return res;
+}
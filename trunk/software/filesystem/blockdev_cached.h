@@ -0,0 +1,100 @@
+/*-----------------------------------------------------------------------
+/  Block cache: a block device that keeps recently used sectors of
+/  another block device in memory.
+/-----------------------------------------------------------------------*/
+#ifndef BLOCKDEV_CACHED_H
+#define BLOCKDEV_CACHED_H
+
+#include "blockdev.h"
+#ifdef OS
+#include "FreeRTOS.h"
+#include "semphr.h"
+#endif
+
+#define BLOCK_CACHE_SETS        32  // sector number modulo sets selects the set
+#define BLOCK_CACHE_WAYS         4  // lines per set, replaced least recently used first
+#define BLOCK_CACHE_READ_AHEAD   8  // sectors read beyond a sequential read
+#define BLOCK_CACHE_BYPASS      32  // larger transfers go straight to the device
+#define BLOCK_CACHE_MAX_RUN     32  // maximum number of sectors in one write back
+
+/*
+ * Reads are served from the cache where possible. Consecutive misses are
+ * read from the device with one request, and when a read continues where
+ * the previous one ended, the request is extended to read ahead.
+ * Writes only go to the cache. Dirty sectors are written back when they
+ * are replaced, or at sync, together with the dirty sectors adjacent to
+ * them, as one request.
+ * One cache serves all partitions of a device, and file systems lock per
+ * volume only, so every entry point takes the mutex of the cache.
+ */
+class BlockDevice_Cached : public BlockDevice
+{
+    struct Line {
+        uint32_t sector;
+        uint32_t stamp;  // last use
+        bool     valid;
+        bool     dirty;
+    };
+
+    BlockDevice *dev;
+    int       sector_size;
+    int       sets;
+    int       ways;
+    int       read_ahead;
+    Line     *lines;        // 'ways' lines per set
+    uint8_t  *data;         // one sector per line
+    uint8_t  *read_buffer;  // BLOCK_CACHE_BYPASS + read_ahead sectors
+    uint8_t  *write_buffer; // BLOCK_CACHE_MAX_RUN sectors
+    uint32_t  clock;
+    uint32_t  next_sequential; // the sector after the previous read
+    uint32_t  sector_count;    // of the device, 0 = not known
+    bool      count_known;
+#ifdef OS
+    SemaphoreHandle_t mutex;
+#endif
+
+    // statistics
+    uint32_t  hits;
+    uint32_t  misses;
+    uint32_t  device_reads;
+    uint32_t  device_writes;
+
+    uint8_t *line_data(Line *l) { return data + (l - lines) * sector_size; }
+    Line    *lookup(uint32_t sector);
+    Line    *allocate(uint32_t sector, DRESULT &res);
+    DRESULT  write_back(Line *l);
+    int      limit_read_ahead(uint32_t sector, int count);
+    DRESULT  read_impl(uint8_t *, uint32_t, int);
+    DRESULT  write_impl(const uint8_t *, uint32_t, int);
+    DRESULT  sync_impl(void);
+    void     invalidate_impl(void);
+
+    void lock() {
+#ifdef OS
+        xSemaphoreTake(mutex, portMAX_DELAY);
+#endif
+    }
+    void unlock() {
+#ifdef OS
+        xSemaphoreGive(mutex);
+#endif
+    }
+public:
+    BlockDevice_Cached(BlockDevice *blk, int sec_size, int sets = BLOCK_CACHE_SETS,
+                       int ways = BLOCK_CACHE_WAYS, int read_ahead = BLOCK_CACHE_READ_AHEAD);
+    virtual ~BlockDevice_Cached();
+
+    t_device_state get_state(void) { return dev->get_state(); }
+
+    virtual DSTATUS init(void);
+    virtual DSTATUS status(void);
+    virtual DRESULT read(uint8_t *, uint32_t, int);
+    virtual DRESULT write(const uint8_t *, uint32_t, int);
+    virtual DRESULT ioctl(uint8_t, void *);
+    virtual DRESULT sync(void);
+
+    void    invalidate(void); // forgets all sectors, also the ones not written back
+    void    print_info(void);
+};
+
+#endif
@@ -14,6 +14,7 @@ FactoryRegistrator<FileInfo *, FileSystemInFile *>
 FileSystemInFile_FAT :: FileSystemInFile_FAT() {
 	fs = 0;
 	blk = 0;
+	cache = 0;
 	prt = 0;
 	fs = 0;
 }
@@ -23,6 +24,8 @@ FileSystemInFile_FAT :: ~FileSystemInFile_FAT() {
 		delete fs;
 	if (prt)
 		delete prt;
+	if (cache)
+		delete cache;
 	if (blk)
 		delete blk;
 }
@@ -38,15 +41,20 @@ void FileSystemInFile_FAT :: init(File *f)
         uint32_t sec_count;
         blk->ioctl(GET_SECTOR_COUNT, &sec_count);
         printf("Sector count: %d.\n", sec_count);
-        prt = new Partition(blk, 0, sec_count, 0);
+        cache = new BlockDevice_Cached(blk, 512);
+        prt = new Partition(cache, 0, sec_count, 0);
         fs = new FileSystemFAT(prt);
     }
     if(fs) {
         if(!fs->init()) {
             delete fs;
 			delete prt;
+			delete cache;
 			delete blk;
             fs = NULL;
+            prt = NULL;
+            cache = NULL;
+            blk = NULL;
         }
     }
 }
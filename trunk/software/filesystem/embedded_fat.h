@@ -11,11 +11,13 @@
 #include "embedded_fs.h"
 #include "filesystem_fat.h"
 #include "blockdev_file.h"
+#include "blockdev_cached.h"
 #include "partition.h"
 
 class FileSystemInFile_FAT: public FileSystemInFile {
 	FileSystemFAT *fs;
 	BlockDevice_File *blk;
+	BlockDevice_Cached *cache;
     Partition *prt;
 public:
 	FileSystemInFile_FAT();
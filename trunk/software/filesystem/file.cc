@@ -9,7 +9,15 @@
 void    File :: close(void)
 {
 	if(!filesystem) return;
-    filesystem->file_close(this);
+	FileSystem *fs = filesystem; // file_close may destruct this object
+	bool was_modified = modified;
+	uint32_t inode = (was_modified) ? get_inode() : 0;
+    fs->file_close(this);
+    if(was_modified) {
+        DentryCache :: invalidate(fs);
+        if(inode)
+            FileChanges :: report(fs, inode);
+    }
 }
 
 FRESULT File :: sync(void)
@@ -30,7 +38,15 @@ FRESULT File :: read(void *buffer, uint32_t len, uint32_t *transferred)
 FRESULT File :: write(const void *buffer, uint32_t len, uint32_t *transferred)
 {
 	if(!filesystem) return FR_INVALID_OBJECT;
-    return filesystem->file_write(this, buffer, len, transferred);
+	bool first = !modified;
+	modified = true;
+    FRESULT res = filesystem->file_write(this, buffer, len, transferred);
+    if(first) { // others should no longer trust what they derived from this file
+        uint32_t inode = get_inode();
+        if(inode)
+            FileChanges :: report(filesystem, inode);
+    }
+    return res;
 }
 
 FRESULT File :: seek(uint32_t pos)
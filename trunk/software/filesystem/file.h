@@ -21,6 +21,7 @@ class File
 {
 	FileSystem *filesystem;
 	mstring pathString;
+	bool modified; // written to; the directory entry changes at close
 
 	// the following function shall only be called by the file manager
 	friend class FileManager;
@@ -31,6 +32,7 @@ public:
     File(FileSystem *fs, void *h) {
     	filesystem = fs;
     	handle = h;
+    	modified = false;
     }
 
     virtual ~File() {
@@ -142,12 +142,8 @@ public:
 		printf("Extension  : %s\n", extension);
 	}
 
-	static int compare(IndexedList<FileInfo *> *list, int a, int b)
+	static int compare(FileInfo *obj_a, FileInfo *obj_b)
 	{
-	//	printf("Compare %d and %d: ", a, b);
-		FileInfo *obj_a = (*list)[a];
-		FileInfo *obj_b = (*list)[b];
-
 		if(!obj_b)
 			return 1;
 		if(!obj_a)
@@ -157,5 +153,21 @@ public:
 	}
 };
 
+// A FileInfo that holds its name itself, for use on the stack or as a member.
+class LocalFileInfo : public FileInfo
+{
+	char name[128];
+	LocalFileInfo(LocalFileInfo &i); // not to be copied
+public:
+	LocalFileInfo() : FileInfo(0) {
+		lfname = name;
+		lfsize = sizeof(name);
+		name[0] = 0;
+	}
+	~LocalFileInfo() {
+		lfname = NULL; // not on the heap
+	}
+};
+
 
 #endif /* FILESYSTEM_FILE_INFO_H_ */
@@ -1,6 +1,7 @@
 
 #include "file_system.h"
 #include "pattern.h"
+#include <ctype.h>
 	
 bool FileInfo :: is_writable(void)
 {
@@ -23,6 +24,8 @@ FileSystem :: FileSystem(Partition *p)
     
 FileSystem :: ~FileSystem()
 {
+    DentryCache :: invalidate(this);
+    FileChanges :: report(this, 0);
 }
 
 const char *FileSystem :: get_error_string(FRESULT res)
@@ -66,6 +69,8 @@ const char *FileSystem :: get_error_string(FRESULT res)
 			return "DISK IS FULL";
 		case FR_DIR_NOT_EMPTY:
 			return "DIRECTORY NOT EMPTY";
+		case FR_ABORTED:
+			return "CANCELLED";
 		default:
 			return "UNKNOWN ERROR";
 	}
@@ -84,55 +89,320 @@ PathStatus_t FileSystem :: walk_path(PathInfo& pathInfo)
 
 	pathInfo.enterFileSystem(this);
 
-	FileInfo info(128);
+	LocalFileInfo info;
 	Directory *dir;
 	FileInfo *ninf;
 	mstring workdir;
 
 	while(pathInfo.hasMore()) {
-		fres = dir_open(pathInfo.getPathFromLastFS(workdir), &dir, pathInfo.getLastInfo());
-		if (fres == FR_OK) {
-			while(1) {
-				fres = dir_read(dir, &info);
-				if (fres == FR_OK) {
+		const char *element = pathInfo.workPath.getElement(pathInfo.index);
+
+		// Directories are identified by their start cluster. Only the root of a
+		// file system may have cluster 0; elsewhere it means that the file
+		// system does not tell its directories apart, so nothing is cached.
+		uint32_t parent = pathInfo.getLastInfo()->cluster;
+		bool cacheable = DentryCache :: accepts(element) &&
+				(parent || (pathInfo.index == pathInfo.indexFromStartOfFileSystem));
+
+		if (!(cacheable && DentryCache :: lookup(this, parent, element, &info))) {
+			bool found = false;
+			fres = dir_open(pathInfo.getPathFromLastFS(workdir), &dir, pathInfo.getLastInfo());
+			if (fres == FR_OK) {
+				while(dir_read(dir, &info) == FR_OK) {
 					// printf("%9d: %-32s (%d)\n", info.size, info.lfname, info.cluster);
 					if (info.attrib & AM_VOL)
 						continue;
-					if (pattern_match(pathInfo.workPath.getElement(pathInfo.index), info.lfname)) {
-						dir_close(dir);
-						pathInfo.replace(info.lfname);
-						pathInfo.index++;
-						ninf = pathInfo.getNewInfoPointer();
-						ninf->copyfrom(&info);
-						if (info.attrib & AM_DIR) {
-							break;
-						} else {
-							if (pathInfo.hasMore())
-								return e_TerminatedOnFile;
-							else {
-								return e_EntryFound;
-							}
-						}
+					if (pattern_match(element, info.lfname)) {
+						found = true;
+						break;
 					}
-				} else { // not found
-					pathInfo.index ++; // we will still return something, even if it doesn't exist (for file create)
-					if (pathInfo.hasMore())
-						return e_DirNotFound;
-					else
-						return e_EntryNotFound;
 				}
+				dir_close(dir);
+			}
+			if (!found) {
+				pathInfo.index ++; // we will still return something, even if it doesn't exist (for file create)
+				if (pathInfo.hasMore())
+					return e_DirNotFound;
+				else
+					return e_EntryNotFound;
+			}
+			if (cacheable)
+				DentryCache :: store(this, parent, element, &info);
+		}
+		pathInfo.replace(info.lfname);
+		pathInfo.index++;
+		ninf = pathInfo.getNewInfoPointer();
+		ninf->copyfrom(&info);
+		if (!(info.attrib & AM_DIR)) {
+			if (pathInfo.hasMore())
+				return e_TerminatedOnFile;
+			else {
+				return e_EntryFound;
 			}
 		}
 	}
 	return e_EntryFound;
 }
 
+DentryCache :: Entry DentryCache :: entries[DENTRY_CACHE_SIZE];
+DentryCache :: Snapshot DentryCache :: snapshots[DIR_SNAPSHOT_COUNT];
+uint32_t DentryCache :: clock = 0;
+uint32_t DentryCache :: generation = 0;
+uint32_t DentryCache :: hits = 0;
+uint32_t DentryCache :: misses = 0;
+uint32_t DentryCache :: snapshot_hits = 0;
+int      DentryCache :: snapshot_bytes = 0;
+
+uint32_t DentryCache :: hash_name(const char *name)
+{
+    uint32_t h = 5381;
+    while(*name)
+        h = (h * 33) ^ uint8_t(toupper(*(name++)));
+    return h;
+}
+
+bool DentryCache :: accepts(const char *name)
+{
+    return (strchr(name, '*') == NULL) && (strchr(name, '?') == NULL);
+}
+
+void DentryCache :: free_entry(Entry *e)
+{
+    delete[] e->name;
+    delete e->info;
+    e->fs = NULL;
+    e->name = NULL;
+    e->info = NULL;
+}
+
+bool DentryCache :: lookup(FileSystem *fs, uint32_t parent, const char *name, FileInfo *result)
+{
+    uint32_t hash = hash_name(name);
+    for(int i=0;i<DENTRY_CACHE_SIZE;i++) {
+        Entry *e = &entries[i];
+        if ((e->fs == fs) && (e->parent == parent) && (e->hash == hash) && (strcasecmp(e->name, name) == 0)) {
+            e->stamp = ++clock;
+            result->copyfrom(e->info);
+            hits++;
+            return true;
+        }
+    }
+    misses++;
+    return false;
+}
+
+void DentryCache :: store(FileSystem *fs, uint32_t parent, const char *name, FileInfo *info)
+{
+    // take a free entry, or else the least recently used one
+    Entry *victim = &entries[0];
+    for(int i=0;i<DENTRY_CACHE_SIZE;i++) {
+        Entry *e = &entries[i];
+        if (!e->fs) {
+            victim = e;
+            break;
+        }
+        if (e->stamp < victim->stamp)
+            victim = e;
+    }
+    if (victim->fs)
+        free_entry(victim);
+
+    victim->name = new char[strlen(name) + 1];
+    strcpy(victim->name, name);
+    victim->info = new FileInfo(*info);
+    victim->parent = parent;
+    victim->hash = hash_name(name);
+    victim->stamp = ++clock;
+    victim->fs = fs;
+}
+
+void DentryCache :: free_snapshot(Snapshot *s)
+{
+    snapshot_bytes -= s->bytes;
+    delete[] s->path;
+    delete[] (uint8_t *)s->entries;
+    s->fs = NULL;
+    s->path = NULL;
+    s->entries = NULL;
+    s->bytes = 0;
+}
+
+bool DentryCache :: get_listing(FileSystem *fs, const char *path, FileInfo *dir, int namesize, IndexedList<FileInfo *> &target)
+{
+    uint32_t hash = hash_name(path);
+    for(int i=0;i<DIR_SNAPSHOT_COUNT;i++) {
+        Snapshot *s = &snapshots[i];
+        if ((s->fs != fs) || (s->hash != hash) || (strcasecmp(s->path, path) != 0))
+            continue;
+        if ((s->cluster != dir->cluster) || (s->date != dir->date) || (s->time != dir->time)) {
+            free_snapshot(s); // the directory is not the one we listed
+            return false;
+        }
+        s->stamp = ++clock;
+        const char *names = (const char *)&s->entries[s->count];
+        for(int j=0;j<s->count;j++) {
+            SnapshotEntry *se = &s->entries[j];
+            FileInfo *inf = new FileInfo(namesize);
+            inf->fs = fs;
+            inf->cluster = se->cluster;
+            inf->size = se->size;
+            inf->date = se->date;
+            inf->time = se->time;
+            inf->attrib = se->attrib;
+            strncpy(inf->lfname, names + se->name, namesize);
+            inf->lfname[namesize-1] = 0;
+            memcpy(inf->extension, se->extension, 4);
+            target.append(inf);
+        }
+        snapshot_hits++;
+        return true;
+    }
+    return false;
+}
+
+void DentryCache :: store_listing(FileSystem *fs, const char *path, FileInfo *dir, uint32_t gen, IndexedList<FileInfo *> &list)
+{
+    if (gen != generation)
+        return; // the listing may already be stale
+    int count = list.get_elements();
+    if (count < DIR_SNAPSHOT_MIN)
+        return;
+    int bytes = count * sizeof(SnapshotEntry);
+    for(int i=0;i<count;i++) {
+        FileInfo *inf = list[i];
+        if ((inf->fs != fs) || inf->object || inf->special_display)
+            return; // holds more than we can store
+        bytes += strlen(inf->lfname) + 1;
+    }
+    if (bytes > DIR_SNAPSHOT_BUDGET)
+        return;
+
+    // replace the snapshot of this directory, or a free one, or the least recently used ones
+    uint32_t hash = hash_name(path);
+    Snapshot *victim = &snapshots[0];
+    for(int i=0;i<DIR_SNAPSHOT_COUNT;i++) {
+        Snapshot *s = &snapshots[i];
+        if (s->fs && (s->fs == fs) && (s->hash == hash) && (strcasecmp(s->path, path) == 0)) {
+            victim = s;
+            break;
+        }
+        if (victim->fs && (!s->fs || (s->stamp < victim->stamp)))
+            victim = s;
+    }
+    if (victim->fs)
+        free_snapshot(victim);
+    while(snapshot_bytes + bytes > DIR_SNAPSHOT_BUDGET) {
+        Snapshot *oldest = NULL;
+        for(int i=0;i<DIR_SNAPSHOT_COUNT;i++) {
+            if (snapshots[i].fs && (!oldest || (snapshots[i].stamp < oldest->stamp)))
+                oldest = &snapshots[i];
+        }
+        free_snapshot(oldest);
+    }
+
+    victim->entries = (SnapshotEntry *)new uint8_t[bytes];
+    char *names = (char *)&victim->entries[count];
+    uint32_t offset = 0;
+    for(int i=0;i<count;i++) {
+        FileInfo *inf = list[i];
+        SnapshotEntry *se = &victim->entries[i];
+        se->cluster = inf->cluster;
+        se->size = inf->size;
+        se->date = inf->date;
+        se->time = inf->time;
+        se->attrib = inf->attrib;
+        memcpy(se->extension, inf->extension, 4);
+        se->name = offset;
+        strcpy(names + offset, inf->lfname);
+        offset += strlen(inf->lfname) + 1;
+    }
+    victim->path = new char[strlen(path) + 1];
+    strcpy(victim->path, path);
+    victim->hash = hash;
+    victim->cluster = dir->cluster;
+    victim->date = dir->date;
+    victim->time = dir->time;
+    victim->count = count;
+    victim->bytes = bytes;
+    victim->stamp = ++clock;
+    victim->fs = fs;
+    snapshot_bytes += bytes;
+}
+
+void DentryCache :: invalidate(FileSystem *fs)
+{
+    generation++;
+    for(int i=0;i<DENTRY_CACHE_SIZE;i++) {
+        Entry *e = &entries[i];
+        if (e->fs && (!fs || (e->fs == fs)))
+            free_entry(e);
+    }
+    for(int i=0;i<DIR_SNAPSHOT_COUNT;i++) {
+        Snapshot *s = &snapshots[i];
+        if (s->fs && (!fs || (s->fs == fs)))
+            free_snapshot(s);
+    }
+}
+
+file_change_hook_t FileChanges :: hooks[FILE_CHANGE_HOOKS];
+void *FileChanges :: contexts[FILE_CHANGE_HOOKS];
+
+bool FileChanges :: subscribe(file_change_hook_t hook, void *context)
+{
+    for(int i=0;i<FILE_CHANGE_HOOKS;i++) {
+        if (!hooks[i]) {
+            contexts[i] = context;
+            hooks[i] = hook;
+            return true;
+        }
+    }
+    return false;
+}
+
+void FileChanges :: unsubscribe(file_change_hook_t hook, void *context)
+{
+    for(int i=0;i<FILE_CHANGE_HOOKS;i++) {
+        if ((hooks[i] == hook) && (contexts[i] == context))
+            hooks[i] = NULL;
+    }
+}
+
+void FileChanges :: report(FileSystem *fs, uint32_t inode)
+{
+    for(int i=0;i<FILE_CHANGE_HOOKS;i++) {
+        if (hooks[i])
+            hooks[i](contexts[i], fs, inode);
+    }
+}
+
+void DentryCache :: dump(void)
+{
+    int used = 0;
+    for(int i=0;i<DENTRY_CACHE_SIZE;i++) {
+        if (entries[i].fs)
+            used++;
+    }
+    printf("Dentry cache: %d/%d entries, %u hits, %u misses\n", used, DENTRY_CACHE_SIZE, hits, misses);
+    for(int i=0;i<DIR_SNAPSHOT_COUNT;i++) {
+        if (snapshots[i].fs)
+            printf("Directory snapshot: '%s', %d entries, %d bytes\n", snapshots[i].path, snapshots[i].count, snapshots[i].bytes);
+    }
+    printf("Directory snapshots: %d bytes, %u hits\n", snapshot_bytes, snapshot_hits);
+}
+
 bool FileSystem :: init(void)
 {
     printf("Maybe you should not try to initialize a base class file system?\n");
 	return false;
 }
     
+BlockDevice *FileSystem :: get_device(void)
+{
+	if (!prt)
+		return NULL;
+	return prt->get_device();
+}
+
 FRESULT FileSystem :: dir_open(const char *path, Directory **, FileInfo *inf)
 {
     return FR_NO_FILESYSTEM;
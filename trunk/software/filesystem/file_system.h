@@ -65,6 +65,103 @@ public:
     virtual uint32_t get_file_size(File *f) { return 0; }
     virtual uint32_t get_inode(File *f) { return 0; }
     virtual bool     needs_sorting() { return false; }
+
+    BlockDevice *get_device(void); // NULL when not on a partition, e.g. for files in files
+};
+
+// Remembers the entries that walk_path found recently, such that opening
+// a file deep in a large directory does not read every directory along the
+// way again. Entries are keyed by file system, start cluster of the parent
+// directory and the name as it was requested (case insensitive). Wildcard
+// lookups are not cached. Any change in a file system invalidates its
+// entries; the file manager does this, and serializes the access.
+//
+// The cache also keeps snapshots of complete, sorted directory listings,
+// such that entering a large directory again does not read and sort it
+// again. A snapshot is one block: an array of the entries, followed by
+// their names. It is keyed by file system and path, and only used while
+// the start cluster and time stamp of the directory itself still match.
+#define DENTRY_CACHE_SIZE      64
+#define DIR_SNAPSHOT_COUNT     4
+#define DIR_SNAPSHOT_MIN       64        // smaller directories are cheap to read
+#define DIR_SNAPSHOT_BUDGET    (512*1024) // bytes for all snapshots together
+
+class DentryCache
+{
+    struct Entry {
+        FileSystem *fs;     // NULL = free
+        uint32_t    parent;
+        uint32_t    hash;
+        uint32_t    stamp;  // last use, for replacement
+        char       *name;
+        FileInfo   *info;
+    };
+    struct SnapshotEntry {
+        uint32_t    cluster;
+        uint32_t    size;
+        uint32_t    name;   // offset in the name area
+        uint16_t    date;
+        uint16_t    time;
+        uint8_t     attrib;
+        char        extension[4];
+    };
+    struct Snapshot {
+        FileSystem *fs;     // NULL = free
+        uint32_t    hash;   // of the path
+        uint32_t    stamp;
+        uint32_t    cluster; // of the directory, as it was listed
+        uint16_t    date;
+        uint16_t    time;
+        char       *path;
+        int         count;
+        int         bytes;
+        SnapshotEntry *entries; // followed by the names
+    };
+    static Entry    entries[DENTRY_CACHE_SIZE];
+    static Snapshot snapshots[DIR_SNAPSHOT_COUNT];
+    static uint32_t clock;
+    static uint32_t generation; // increments with every invalidation
+    static uint32_t hits;
+    static uint32_t misses;
+    static uint32_t snapshot_hits;
+    static int      snapshot_bytes;
+
+    static uint32_t hash_name(const char *name);
+    static void     free_entry(Entry *e);
+    static void     free_snapshot(Snapshot *s);
+public:
+    static bool accepts(const char *name);
+    static bool lookup(FileSystem *fs, uint32_t parent, const char *name, FileInfo *result);
+    static void store(FileSystem *fs, uint32_t parent, const char *name, FileInfo *info);
+
+    static uint32_t get_generation(void) { return generation; }
+    static bool get_listing(FileSystem *fs, const char *path, FileInfo *dir, int namesize, IndexedList<FileInfo *> &target);
+    // stores nothing when something was invalidated since get_generation returned 'gen'
+    static void store_listing(FileSystem *fs, const char *path, FileInfo *dir, uint32_t gen, IndexedList<FileInfo *> &list);
+
+    static void invalidate(FileSystem *fs); // NULL = everything
+    static void dump(void);
+};
+
+// Tells the modules that keep data derived from files, such as the images
+// that the drives cache, that a file has changed. A change is reported with
+// the file system and the start cluster (inode) of the file; inode 0 means
+// any file of that file system, and a NULL file system means all of them.
+// Hooks are registered when the system starts; they run in the task that
+// made the change, so they must do their own locking, and not call back
+// into the file system.
+#define FILE_CHANGE_HOOKS 4
+
+typedef void (*file_change_hook_t)(void *context, FileSystem *fs, uint32_t inode);
+
+class FileChanges
+{
+    static file_change_hook_t hooks[FILE_CHANGE_HOOKS];
+    static void *contexts[FILE_CHANGE_HOOKS];
+public:
+    static bool subscribe(file_change_hook_t hook, void *context);
+    static void unsubscribe(file_change_hook_t hook, void *context);
+    static void report(FileSystem *fs, uint32_t inode);
 };
 
 #include "factory.h"
@@ -78,8 +175,8 @@ extern Factory<Partition *, FileSystem *> file_system_factory;
 #include "file.h"
 
 class PathInfo {
-	FileInfo fileInfo1;
-	FileInfo fileInfo2;
+	LocalFileInfo fileInfo1;
+	LocalFileInfo fileInfo2;
 public:
 	int index;
 	Path workPath;
@@ -87,7 +184,7 @@ public:
 	FileInfo *last;
 	FileInfo *previous;
 
-	PathInfo(FileSystem *fs) : fileInfo1(128), fileInfo2(128) {
+	PathInfo(FileSystem *fs) {
 		index = 0;
 		indexFromStartOfFileSystem = 0;
 		last = 0;
@@ -391,27 +391,19 @@ void FileSystemD64 :: collect_file_info(File *f, FileInfo *inf)
 DirInD64 :: DirInD64(FileSystemD64 *f)
 {
     fs = f;
-    visited = 0;
     idx = -1;
 }
 
 FRESULT DirInD64 :: open(FileInfo *info)
 {
     idx = -1;
-
-    visited = new uint8_t[fs->num_sectors];
-    for (int i=0; i<fs->num_sectors; i++) {
-        visited[i] = 0;
-    }
-
+    visited.init(fs->num_sectors);
     return FR_OK;
 }
 
 FRESULT DirInD64 :: close(void)
 {
-	if (visited)
-		delete [] visited;
-
+    visited.clear();
     return FR_OK;
 }
 
@@ -466,10 +458,9 @@ FRESULT DirInD64 :: read(FileInfo *f)
                 if (abs_sect < 0) { // bad chain link
                     return FR_NO_FILE;
                 }
-                if (visited[abs_sect]) { // cycle detected
+                if (!visited.mark(abs_sect)) { // cycle detected
                     return FR_NO_FILE;
                 }
-                visited[abs_sect] = 1;
 
         		if(fs->move_window(abs_sect) != FR_OK) {
                     return FR_DISK_ERR;
@@ -523,7 +514,10 @@ FileInD64 :: FileInD64(FileSystemD64 *f)
     num_blocks = 0;
     dir_sect = -1;
     dir_entry_offset = 0;
-    visited = 0;
+    chain = 0;
+    chain_length = 0;
+    chain_size = 0;
+    current_block = 0;
     fs = f;
 }
 
@@ -543,10 +537,13 @@ FRESULT FileInD64 :: open(FileInfo *info, uint8_t flags)
 //	dir_sect = info->dir_sector;
 //	dir_entry_offset = info->dir_offset;
 
-    visited = new uint8_t[fs->num_sectors];
-    for (int i=0; i<fs->num_sectors; i++) {
-        visited[i] = 0;
-    }
+    visited.init(fs->num_sectors);
+    chain_size = num_blocks + 1;
+    if (chain_size > fs->num_sectors)
+        chain_size = fs->num_sectors;
+    chain = new uint16_t[chain_size];
+    chain_length = 0;
+    current_block = 0;
 
     visit(); // mark initial sector
 
@@ -557,21 +554,37 @@ FRESULT FileInD64 :: close(void)
 {
 	fs->sync();
 	//flag = 0;
-    delete [] visited;
+    visited.clear();
 
     return FR_OK;
 }
 
+// Checks the current sector, which holds block 'current_block' of the file.
+// The first time a block is reached, its sector is checked for cycles and
+// added to the chain, such that seeks can go there directly later on.
 FRESULT FileInD64 :: visit(void)
 {
     int abs_sect = fs->get_abs_sector(current_track, current_sector);
     if (abs_sect < 0) { // bad chain link
         return FR_INT_ERR;
     }
-    if (visited[abs_sect]) { // cycle detected
+    if (current_block < chain_length) { // followed before
+        return FR_OK;
+    }
+    if (!visited.mark(abs_sect)) { // cycle detected
         return FR_INT_ERR;
     }
-    visited[abs_sect] = 1;
+    if (chain_length == chain_size) {
+        int new_size = 2 * chain_size + 16;
+        uint16_t *new_chain = new uint16_t[new_size];
+        for (int i=0; i<chain_length; i++) {
+            new_chain[i] = chain[i];
+        }
+        delete[] chain;
+        chain = new_chain;
+        chain_size = new_size;
+    }
+    chain[chain_length++] = (uint16_t)abs_sect;
     return FR_OK;
 }
 
@@ -628,6 +641,7 @@ FRESULT FileInD64 :: read(void *buffer, uint32_t len, uint32_t *transferred)
             current_track = fs->sect_buffer[0];
             current_sector = fs->sect_buffer[1];
             offset_in_sector = 2;
+            current_block++;
             res = visit();  // mark and check for cyclic link
             if(res != FR_OK) {
                 return res;
@@ -658,6 +672,9 @@ FRESULT  FileInD64 :: write(const void *buffer, uint32_t len, uint32_t *transfer
             return FR_DISK_FULL;
         num_blocks = 1;
         offset_in_sector = 2;
+        chain_length = 0;
+        current_block = 0;
+        visit();
         fs->sect_buffer[0] = 0; // unlink
         fs->sect_buffer[1] = 1; // 0 bytes in this sector
     } else {
@@ -680,9 +697,15 @@ FRESULT  FileInD64 :: write(const void *buffer, uint32_t len, uint32_t *transfer
                 fs->sync(); // make sure we can use the buffer to play around
                 fs->sect_buffer[0] = 0; // unlink
                 offset_in_sector = 2;
+                current_block++;
+                visit();
             } else {
                 current_track = fs->sect_buffer[0];
                 current_sector = fs->sect_buffer[1];
+                current_block++;
+                res = visit();
+                if(res != FR_OK)
+                    return res;
                 res = fs->move_window(fs->get_abs_sector(current_track, current_sector));
                 if(res != FR_OK)
                     return res;
@@ -719,25 +742,32 @@ FRESULT  FileInD64 :: write(const void *buffer, uint32_t len, uint32_t *transfer
     return FR_OK;
 }
 
+// Blocks that were reached before are found in the chain; only the part
+// of the file beyond the furthest block so far needs to be followed.
 FRESULT FileInD64 :: seek(uint32_t pos)
 {
 	fs->sync();
-	fs->get_track_sector(start_cluster, current_track, current_sector);
 
-	while (pos >= 254) {
-		FRESULT res = visit();
-		if (res != FR_OK)
-			return res;
+	int block = (int)(pos / 254);
+	if (!chain_length)
+		return FR_INT_ERR;
+
+	current_block = (block < chain_length) ? block : chain_length - 1;
+	fs->get_track_sector(chain[current_block], current_track, current_sector);
 
-		res = fs->move_window(fs->get_abs_sector(current_track, current_sector));
+	while (current_block < block) {
+		FRESULT res = fs->move_window(chain[current_block]);
         if(res != FR_OK)
             return res;
 
         current_track = fs->sect_buffer[0];
         current_sector = fs->sect_buffer[1];
-        pos -= 254;
+        current_block++;
+		res = visit();
+		if (res != FR_OK)
+			return res;
 	}
-	offset_in_sector = pos + 2;
+	offset_in_sector = (pos - 254 * block) + 2;
 	return FR_OK;
 }
 
@@ -13,10 +13,40 @@
 
 class FileSystemD64;
 
+// One bit per sector, to detect cycles in sector chains
+class SectorBitmap
+{
+    uint32_t *bits;
+public:
+    SectorBitmap() : bits(0) { }
+    ~SectorBitmap() { clear(); }
+
+    void init(int sectors) {
+        clear();
+        int words = (sectors + 31) >> 5;
+        bits = new uint32_t[words];
+        for(int i=0;i<words;i++)
+            bits[i] = 0;
+    }
+    void clear(void) {
+        if(bits)
+            delete[] bits;
+        bits = 0;
+    }
+    // returns false when the sector was marked already
+    bool mark(int sector) {
+        uint32_t mask = 1 << (sector & 31);
+        if(bits[sector >> 5] & mask)
+            return false;
+        bits[sector >> 5] |= mask;
+        return true;
+    }
+};
+
 class DirInD64
 {
     int idx;
-    uint8_t *visited;  // this should probably be a bit vector
+    SectorBitmap visited;
 
     FileSystemD64 *fs;
 public:
@@ -39,14 +69,20 @@ class FileInD64
     int num_blocks;
     int dir_sect;
     int dir_entry_offset;
-    uint8_t *visited;  // this should probably be a bit vector
+    SectorBitmap visited;
+
+    // absolute sector of each block of the file, as far as it was followed
+    uint16_t *chain;
+    int chain_length;
+    int chain_size;
+    int current_block;
 
     FileSystemD64 *fs;
 
     FRESULT visit(void);
 public:
     FileInD64(FileSystemD64 *);
-    ~FileInD64() { }
+    ~FileInD64() { if(chain) delete[] chain; }
 
     FRESULT open(FileInfo *info, uint8_t flags);
     FRESULT close(void);
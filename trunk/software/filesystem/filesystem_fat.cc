@@ -10,6 +10,8 @@
 #include <stdio.h>
 #include <string.h>
 
+uint32_t FileSystemFAT :: clmt_in_use = 0;
+
 FileSystemFAT :: FileSystemFAT(Partition *p) : FileSystem(p)
 {
 	memset(&fatfs, 0, sizeof(FATFS));
@@ -42,6 +44,43 @@ void FileSystemFAT :: copy_info(FILINFO *fi, FileInfo *inf)
 #endif
 }
 
+// Creates the cluster link map table of the file, when it fits in the
+// budget. The table is first tried with a small size; when the file has
+// more fragments, FatFs reports the size it needs.
+void FileSystemFAT :: create_link_map(FatFile *ff)
+{
+	uint32_t size = FAT_CLMT_INITIAL;
+	ff->clmt_tried = true;
+
+	while(clmt_in_use + size <= FAT_CLMT_BUDGET) {
+		DWORD *tbl = new DWORD[size];
+		tbl[0] = size;
+		ff->cltbl = tbl;
+		FRESULT res = f_lseek(ff, CREATE_LINKMAP);
+		if (res == FR_OK) {
+			ff->clmt_size = size;
+			clmt_in_use += size;
+			return;
+		}
+		ff->cltbl = 0;
+		size = tbl[0]; // required size
+		delete[] tbl;
+		if ((res != FR_NO_MEMORY) || (size > FAT_CLMT_MAX_FILE))
+			return;
+	}
+}
+
+// Back to following the FAT. The current cluster is kept by FatFs in both modes.
+void FileSystemFAT :: remove_link_map(FatFile *ff)
+{
+	if (!ff->cltbl)
+		return;
+	delete[] ff->cltbl;
+	ff->cltbl = 0;
+	clmt_in_use -= ff->clmt_size;
+	ff->clmt_size = 0;
+}
+
 bool    FileSystemFAT :: init(void)
 {
 	fs_init_volume(&fatfs, 0);
@@ -145,10 +184,14 @@ FRESULT FileSystemFAT :: file_open(const char *path, Directory *dir, const char
 {
 //	printf("FAT Open file: %s (%s)\n", path, filename);
 
-	FIL *fil = new FIL;
+	dir_close(dir); // FatFs finds the file from the path by itself
+
+	FatFile *fil = new FatFile;
 	FRESULT res = fs_open(&fatfs, path, flags, fil);
 
 	if (res == FR_OK) {
+		fil->clmt_size = 0;
+		fil->clmt_tried = false;
 		*file = new File(this, fil);
 		return res;
 	}
@@ -181,8 +224,11 @@ FRESULT FileSystemFAT :: file_delete(const TCHAR *path)
 
 void    FileSystemFAT :: file_close(File *f)
 {
-	FIL *fil = (FIL *)f->handle;
+	FatFile *fil = (FatFile *)f->handle;
 	f_close(fil);
+	remove_link_map(fil);
+	delete fil;
+	delete f;
 }
 
 FRESULT FileSystemFAT :: file_read(File *f, void *buffer, uint32_t len, uint32_t *transferred)
@@ -193,13 +239,27 @@ FRESULT FileSystemFAT :: file_read(File *f, void *buffer, uint32_t len, uint32_t
 
 FRESULT FileSystemFAT :: file_write(File *f, const void *buffer, uint32_t len, uint32_t *transferred)
 {
-	FIL *fil = (FIL *)f->handle;
+	FatFile *fil = (FatFile *)f->handle;
+	// with a link map table, FatFs cannot allocate clusters; a growing file needs the FAT again
+	if ((fil->fptr + len > fil->fsize) && fil->cltbl) {
+		remove_link_map(fil);
+		fil->clmt_tried = false;
+	}
 	return f_write(fil, buffer, len, transferred);
 }
 
 FRESULT FileSystemFAT :: file_seek(File *f, uint32_t pos)
 {
-	FIL *fil = (FIL *)f->handle;
+	FatFile *fil = (FatFile *)f->handle;
+	if (fil->cltbl) {
+		if ((pos > fil->fsize) && (fil->flag & FA_WRITE)) { // extends the file
+			remove_link_map(fil);
+			fil->clmt_tried = false;
+		}
+	} else if (!fil->clmt_tried && (pos < fil->fptr) && (pos >= (DWORD)fatfs.csize * _MAX_SS)) {
+		// backwards, beyond the first cluster: without a table, FatFs would follow the chain from the start
+		create_link_map(fil);
+	}
 	return f_lseek(fil, pos);
 }
 
@@ -11,10 +11,27 @@
 #include "file_system.h"
 #include "ff2.h"
 
+#define FAT_CLMT_INITIAL    32     // size of the first link map table tried for a file, 15 fragments
+#define FAT_CLMT_MAX_FILE   1024   // largest link map table of one file, 511 fragments
+#define FAT_CLMT_BUDGET     16384  // all link map tables together (64 KB)
+
+// The handle of an open FAT file. A file that is seeked backwards gets a
+// cluster link map table, such that FatFs does not have to follow the
+// cluster chain from the start of the file for every seek.
+struct FatFile : public FIL
+{
+	uint32_t clmt_size;  // number of DWORDs in cltbl
+	bool     clmt_tried; // no new table is made for this file
+};
+
 class FileSystemFAT : public FileSystem
 {
 	FATFS fatfs;
+	static uint32_t clmt_in_use; // DWORDs in the link map tables of all open files
+
 	void copy_info(FILINFO *fi, FileInfo *inf);
+	void create_link_map(FatFile *ff);
+	void remove_link_map(FatFile *ff);
 public:
     FileSystemFAT(Partition *p);
     virtual ~FileSystemFAT();
@@ -68,7 +68,9 @@ DRESULT Partition::write(const uint8_t *buffer, uint32_t sector, uint8_t count)
 DRESULT Partition::ioctl(uint8_t command, void *data)
 {
 	if(command == CTRL_SYNC) {
-		return RES_OK; // we don't implement any caches yet
+		if(!dev)
+			return RES_OK;
+		return dev->sync(); // a block cache may hold sectors that were not written yet
 	}
 	if(command == GET_SECTOR_COUNT) {
         *((uint32_t *)data) = length;
@@ -29,6 +29,7 @@ public:
     
     void print_info(void);
     uint8_t get_type(void) { return type; }
+    BlockDevice *get_device(void) { return dev; }
     FileSystem *attach_filesystem(void);
     
     // Fall through:
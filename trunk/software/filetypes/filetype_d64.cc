@@ -83,5 +83,7 @@ FileType *FileTypeD64 :: test_type(BrowsableDirEntry *obj)
 	FileInfo *inf = obj->getInfo();
     if(strcmp(inf->extension, "D64")==0)
         return new FileTypeD64(obj);
+    if(strcmp(inf->extension, "D71")==0) // the first side, as a 1541 would see it
+        return new FileTypeD64(obj);
     return NULL;
 }
@@ -23,11 +23,16 @@ public:
 	virtual ~ObserverQueue() {
 		vQueueDelete(queue);
 	}
-	void putEvent(void *el, int q) {
+	// false when the event was not queued; it then still belongs to the caller
+	bool putEvent(void *el, int q) {
 #ifdef OS
 		if (!xQueueSend(queue, &el, 5)) {
 			printf("Failed to post message to queue #%d (polled %d times).\n", q, polls);
+			return false;
 		}
+		return true;
+#else
+		return false;
 #endif
 	}
 	void *waitForEvent(uint32_t ticks) {
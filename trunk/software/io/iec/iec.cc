@@ -46,6 +46,7 @@ extern uint32_t _ulticopy_65_size;
 #define CFG_IEC_PRINTER_CBM_CHAR   0x35
 #define CFG_IEC_PRINTER_EPSON_CHAR 0x36
 #define CFG_IEC_PRINTER_IBM_CHAR   0x37
+#define CFG_IEC_PRINTER_PNG        0x38
 
 static const char *en_dis[] = { "Disabled", "Enabled" };
 static const char *pr_typ[] = { "RAW", "PNG" };
@@ -55,6 +56,7 @@ static const char *pr_cch[] = { "USA/UK", "Denmark", "France/Italy", "Germany",
 static const char *pr_ech[] = { "Basic", "USA", "France", "Germany", "UK", "Denmark I",
                                 "Sweden", "Italy", "Spain", "Japan", "Norway", "Denmark II" };
 static const char *pr_ich[] = { "International 1", "International 2", "Israel", "Greece", "Portugal", "Spain" };
+static const char *pr_png[] = { "Fast", "Balanced", "Small" };
 
 static struct t_cfg_definition iec_config[] = {
     { CFG_IEC_ENABLE,    CFG_TYPE_ENUM,   "IEC Drive and printer",     "%s", en_dis,     0,  1, 0 },
@@ -68,6 +70,7 @@ static struct t_cfg_definition iec_config[] = {
     { CFG_IEC_PRINTER_CBM_CHAR, CFG_TYPE_ENUM,   "Printer Commodore charset", "%s", pr_cch, 0,  6, 0 },
     { CFG_IEC_PRINTER_EPSON_CHAR,CFG_TYPE_ENUM,  "Printer Epson charset","%s", pr_ech, 0,  11, 0 },
     { CFG_IEC_PRINTER_IBM_CHAR, CFG_TYPE_ENUM,   "Printer IBM table 2",  "%s", pr_ich, 0,  5, 0 },
+    { CFG_IEC_PRINTER_PNG,      CFG_TYPE_ENUM,   "Printer PNG compression", "%s", pr_png, 0,  2, 1 },
     { 0xFF, CFG_TYPE_END,    "", "", NULL, 0, 0, 0 }
 };
 
@@ -298,6 +301,7 @@ void IecInterface :: effectuate_settings(void)
     channel_printer->set_cbm_charset(cfg->get_value(CFG_IEC_PRINTER_CBM_CHAR));
     channel_printer->set_epson_charset(cfg->get_value(CFG_IEC_PRINTER_EPSON_CHAR));
     channel_printer->set_ibm_charset(cfg->get_value(CFG_IEC_PRINTER_IBM_CHAR));
+    channel_printer->set_png_compression(cfg->get_value(CFG_IEC_PRINTER_PNG));
 
     iec_enable = uint8_t(cfg->get_value(CFG_IEC_ENABLE));
     HW_IEC_RESET_ENABLE = iec_enable;
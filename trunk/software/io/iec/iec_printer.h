@@ -191,6 +191,12 @@ public:
         return IEC_OK;
     }
 
+    virtual int set_png_compression(int c)
+    {
+        mps->setPngCompression(c);
+        return IEC_OK;
+    }
+
     virtual int set_output_type(int t)
     {
         bool new_raw = raw;
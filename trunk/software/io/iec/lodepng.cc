@@ -1648,6 +1648,67 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   return error;
 }
 
+/*
+Run length variant of encodeLZ77 (not in upstream LodePNG). It only looks for
+repeats of the byte before (distance 1), and of the data one row back (distance
+row), so no hash is needed. A whole row that repeats the row before, such as
+an empty row after an empty row, is found with a single memcmp.
+*/
+static void encodeRLE(uivector* out, const unsigned char* in, size_t inpos, size_t insize, size_t row)
+{
+  size_t pos = inpos;
+
+  while(pos < insize)
+  {
+    size_t max = insize - pos;
+    size_t length = 0, distance = 1, run;
+    if(max > MAX_SUPPORTED_DEFLATE_LENGTH) max = MAX_SUPPORTED_DEFLATE_LENGTH;
+
+    /*shortcut for a repeated row*/
+    if(row >= 3 && pos >= row && pos + row <= insize && in[pos] == in[pos - row] && !memcmp(in + pos - row, in + pos, row))
+    {
+      for(length = row; length > MAX_SUPPORTED_DEFLATE_LENGTH; length -= MAX_SUPPORTED_DEFLATE_LENGTH)
+      {
+        addLengthDistance(out, MAX_SUPPORTED_DEFLATE_LENGTH, row);
+      }
+      if(length < 3) /*too short for a match of its own, the last match takes it*/
+      {
+        uivector_resize(out, out->size - 4);
+        addLengthDistance(out, MAX_SUPPORTED_DEFLATE_LENGTH - 3 + length, row);
+        addLengthDistance(out, 3, row);
+      }
+      else addLengthDistance(out, length, row);
+      pos += row;
+      continue;
+    }
+
+    if(pos >= 1)
+    {
+      while(length < max && in[pos + length] == in[pos - 1]) ++length;
+    }
+    if(pos >= row && length < max)
+    {
+      for(run = 0; run < max && in[pos + run] == in[pos - row + run]; ++run) {}
+      if(run > length)
+      {
+        length = run;
+        distance = row;
+      }
+    }
+
+    if(length >= 3)
+    {
+      addLengthDistance(out, length, distance);
+      pos += length;
+    }
+    else
+    {
+      uivector_push_back(out, in[pos]);
+      ++pos;
+    }
+  }
+}
+
 /* /////////////////////////////////////////////////////////////////////////// */
 
 static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
@@ -1780,7 +1841,11 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   allow breaking out of it to the cleanup phase on error conditions.*/
   while(!error)
   {
-    if(settings->use_lz77)
+    if(settings->use_lz77 && settings->rle_row)
+    {
+      encodeRLE(&lz77_encoded, data, datapos, dataend, settings->rle_row);
+    }
+    else if(settings->use_lz77)
     {
       error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
                          settings->minmatch, settings->nicematch, settings->lazymatching);
@@ -1992,8 +2057,9 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   {
     uivector lz77_encoded;
     uivector_init(&lz77_encoded);
-    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
+    if(settings->rle_row) encodeRLE(&lz77_encoded, data, datapos, dataend, settings->rle_row);
+    else error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+                            settings->minmatch, settings->nicematch, settings->lazymatching);
     if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
     uivector_cleanup(&lz77_encoded);
   }
@@ -2240,6 +2306,126 @@ static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsign
   }
 }
 
+unsigned lodepng_zlib_stream_init(LodePNGZlibStream* stream, const LodePNGCompressSettings* settings)
+{
+  ucvector outv;
+  /*same header as lodepng_zlib_compress: CM 8, CINFO 7, no dictionary, lowest level*/
+  unsigned CMFFLG = 256 * 120;
+  CMFFLG += 31 - CMFFLG % 31;
+
+  stream->settings = settings;
+  stream->adler = 1L;
+  stream->finished = 0;
+  stream->window = 0;
+  stream->windowsize = stream->windowallocsize = 0;
+  stream->total = 0;
+
+  ucvector_init_buffer(&outv, 0, 0);
+  outv.size = 0;
+  ucvector_push_back(&outv, (unsigned char)(CMFFLG >> 8));
+  ucvector_push_back(&outv, (unsigned char)(CMFFLG & 255));
+  stream->out = outv.data;
+  stream->outsize = outv.size;
+  stream->outallocsize = outv.allocsize;
+  stream->bp = 16;
+
+  stream->hash = 0;
+  if(!stream->out) return 83; /*alloc fail*/
+  if(!settings->use_lz77 || settings->rle_row) return 0; /*no hash needed*/
+
+  stream->hash = lodepng_malloc(sizeof(Hash));
+  if(!stream->hash) return 83; /*alloc fail*/
+  return hash_init((Hash*)stream->hash, settings->windowsize);
+}
+
+unsigned lodepng_zlib_stream_add(LodePNGZlibStream* stream, const unsigned char* in, size_t insize,
+                                 unsigned final)
+{
+  const LodePNGCompressSettings* settings = stream->settings;
+  size_t windowsize = settings->windowsize;
+  size_t keep, start, end, blocksize;
+  unsigned error = 0;
+  ucvector outv;
+
+  if(settings->btype != 1 && settings->btype != 2) return 61;
+  if(stream->finished) return 0;
+
+  /*Keep the last window of the data before the new part, such that each byte
+  has the same position in the circular hash buffers as when it was added.
+  Without hash, keep what run length encoding refers back to.*/
+  if(stream->hash) keep = windowsize + (stream->total & (windowsize - 1));
+  else keep = settings->use_lz77 ? settings->rle_row : 0;
+  if(keep > stream->total) keep = stream->total;
+  if(keep + insize > stream->windowallocsize)
+  {
+    unsigned char* window = (unsigned char*)lodepng_realloc(stream->window, keep + insize);
+    if(!window) return 83; /*alloc fail*/
+    stream->window = window;
+    stream->windowallocsize = keep + insize;
+  }
+  memmove(stream->window, stream->window + stream->windowsize - keep, keep);
+  memcpy(stream->window + keep, in, insize);
+  stream->windowsize = keep + insize;
+  stream->total += insize;
+  stream->adler = update_adler32(stream->adler, in, (unsigned)insize);
+
+  outv.data = stream->out;
+  outv.size = stream->outsize;
+  outv.allocsize = stream->outallocsize;
+
+  /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
+  blocksize = settings->btype == 1 ? insize : 262144;
+  start = keep;
+  do
+  {
+    end = start + blocksize;
+    if(end > keep + insize) end = keep + insize;
+    if(settings->btype == 1)
+      error = deflateFixed(&outv, &stream->bp, (Hash*)stream->hash, stream->window, start, end, settings,
+                           final && end == keep + insize);
+    else
+      error = deflateDynamic(&outv, &stream->bp, (Hash*)stream->hash, stream->window, start, end, settings,
+                             final && end == keep + insize);
+    start = end;
+  }
+  while(!error && start != keep + insize);
+
+  if(!error && final)
+  {
+    lodepng_add32bitInt(&outv, stream->adler);
+    stream->bp = outv.size * 8;
+    stream->finished = 1;
+  }
+
+  stream->out = outv.data;
+  stream->outsize = outv.size;
+  stream->outallocsize = outv.allocsize;
+  return error;
+}
+
+size_t lodepng_zlib_stream_ready(const LodePNGZlibStream* stream)
+{
+  return stream->bp / 8;
+}
+
+void lodepng_zlib_stream_consume(LodePNGZlibStream* stream, size_t count)
+{
+  memmove(stream->out, stream->out + count, stream->outsize - count);
+  stream->outsize -= count;
+  stream->bp -= count * 8;
+}
+
+void lodepng_zlib_stream_cleanup(LodePNGZlibStream* stream)
+{
+  if(stream->hash) hash_cleanup((Hash*)stream->hash);
+  lodepng_free(stream->hash);
+  lodepng_free(stream->out);
+  lodepng_free(stream->window);
+  stream->hash = 0;
+  stream->out = 0;
+  stream->window = 0;
+}
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #else /*no LODEPNG_COMPILE_ZLIB*/
@@ -2279,13 +2465,14 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->rle_row = 0;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
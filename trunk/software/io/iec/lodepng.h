@@ -296,6 +296,9 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*not in upstream LodePNG: if not 0, LZ77 only looks for runs of a byte and for repeats of the data
+  rle_row bytes back (the previous scanline, at most 32768). Much faster, good on mostly empty images. Default: 0*/
+  unsigned rle_row;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -781,6 +784,39 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize,
                                const unsigned char* in, size_t insize,
                                const LodePNGCompressSettings* settings);
 
+/*
+Compresses data with Zlib a part at a time, for data that is produced in parts
+and output that is written as it comes (not in upstream LodePNG). The parts
+that came before stay in use for references back, up to the window size of the
+settings. Only btype 1 and 2 are supported.
+*/
+typedef struct LodePNGZlibStream
+{
+  const LodePNGCompressSettings* settings;
+  unsigned char* out; /*compressed bytes not consumed yet, see lodepng_zlib_stream_ready*/
+  size_t outsize;
+  size_t outallocsize;
+  size_t bp; /*bit pointer in out*/
+  unsigned adler; /*of all the data so far*/
+  unsigned finished;
+  void* hash;
+  unsigned char* window; /*end of the data so far, followed by the part being compressed*/
+  size_t windowsize; /*bytes of data so far in window*/
+  size_t windowallocsize;
+  size_t total; /*bytes of data so far*/
+} LodePNGZlibStream;
+
+/*Starts a zlib stream, with the settings given, which must stay valid until cleanup.*/
+unsigned lodepng_zlib_stream_init(LodePNGZlibStream* stream, const LodePNGCompressSettings* settings);
+/*Compresses the next part of the data. The last part must be added with final set.*/
+unsigned lodepng_zlib_stream_add(LodePNGZlibStream* stream, const unsigned char* in, size_t insize,
+                                 unsigned final);
+/*Returns how many bytes at stream->out are complete, and can be written.*/
+size_t lodepng_zlib_stream_ready(const LodePNGZlibStream* stream);
+/*Removes count complete bytes from stream->out, after they have been written.*/
+void lodepng_zlib_stream_consume(LodePNGZlibStream* stream, size_t count);
+void lodepng_zlib_stream_cleanup(LodePNGZlibStream* stream);
+
 /*
 Find length-limited Huffman code for given frequencies. This function is in the
 public interface only for tests, it's used internally by lodepng_deflate.
@@ -26,6 +26,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #ifdef NOT_ULTIMATE
@@ -63,6 +64,35 @@ uint8_t MpsPrinter::spacing_y[6][17] =
     { 11,13,14,15,17,18,19,21,23,24,25,27,28,29,31,32,33 },    // Subscript NLQ Low
 };
 
+/* =======  Ink around a dot: x, y, grey level (list ends with level 0) */
+int8_t MpsPrinter::dot_pattern[3][18][3] =
+{
+    /* Density 0 : 1 single black point (diameter 1 pixel) mostly for debug */
+    {
+        {  0, 0, 3 }, {  0, 0, 0 }
+    },
+
+    /* Density 1 : 1 black point with gray around (looks like diameter 2) */
+    {
+        {  0, 0, 3 },
+        { -1,-1, 1 }, {  1, 1, 1 }, { -1, 1, 1 }, {  1,-1, 1 },
+        {  0,-1, 2 }, {  0, 1, 2 }, { -1, 0, 2 }, {  1, 0, 2 },
+        {  0, 0, 0 }
+    },
+
+    /* Density 2 : 4 black points with gray around (looks like diameter 3) */
+    {
+        {  0, 0, 3 }, {  0, 1, 3 }, {  1, 0, 3 }, {  1, 1, 3 },
+        { -1,-1, 1 }, {  2,-1, 1 }, { -1, 2, 1 }, {  2, 2, 1 },
+        {  0,-1, 2 }, {  1,-1, 2 }, {  0, 1, 2 }, { -1, 0, 2 }, { -1, 1, 2 },
+        {  2, 0, 2 }, {  2, 1, 2 }, {  0, 2, 2 }, {  1, 2, 2 },
+        {  0, 0, 0 }
+    },
+};
+
+/* =======  All white */
+uint8_t MpsPrinter::blank_tile[MPS_PRINTER_TILE_SIZE*MPS_PRINTER_TILE_BYTES];
+
 /************************************************************************
 *               MpsPrinter::MpsPrinter(filename)          Constructor   *
 *               ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~                        *
@@ -95,12 +125,10 @@ MpsPrinter::MpsPrinter(char * filename)
     /* Initialise PNG convertor attributes */
     lodepng_state_init(&lodepng_state);
 
-    /* PNG compression settings */
-    lodepng_state.encoder.zlibsettings.btype        = 2;
-    lodepng_state.encoder.zlibsettings.use_lz77     = true;
-    lodepng_state.encoder.zlibsettings.windowsize   = 1024;
+    /* PNG compression settings, see setPngCompression() for the others */
     lodepng_state.encoder.zlibsettings.minmatch     = 3;
     lodepng_state.encoder.zlibsettings.nicematch    = 128;
+    setPngCompression(MPS_PRINTER_PNG_BALANCED);
 
     /* Initialise color palette for memory bitmap and file output */
     lodepng_palette_clear(&lodepng_state.info_png.color);
@@ -137,6 +165,18 @@ MpsPrinter::MpsPrinter(char * filename)
     /* I rule, you don't */
     lodepng_state.encoder.auto_convert      = 0;
 
+    /* Ink of the dots for each dot size and style */
+    BuildStamps();
+
+    /* Glyph cache is empty */
+    bzero(glyphs, sizeof(glyphs));
+    glyph = NULL;
+    glyph_clock = 0;
+
+    /* Page has no ink yet */
+    for (int i=0; i<MPS_PRINTER_TILES; i++) tiles[i] = blank_tile;
+    inked_count = 0;
+
         /*-
          *
          *  Page num start from 1 but if a file
@@ -185,6 +225,7 @@ MpsPrinter::~MpsPrinter()
 #ifndef NOT_ULTIMATE
     fm->release_path(path);
 #endif
+    for (int i=0; i<inked_count; i++) free(tiles[inked_tiles[i]]);
     lodepng_state_cleanup(&lodepng_state);
     DBGMSG("deletion");
 }
@@ -269,6 +310,44 @@ MpsPrinter::setDotSize(uint8_t ds)
     DBGMSGV("dotsize changed to %d", ds);
 }
 
+/************************************************************************
+*                       MpsPrinter::setPngCompression(pc)       Public  *
+*                       ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~               *
+* Function : Change how hard PNG files are compressed                   *
+*-----------------------------------------------------------------------*
+* Inputs:                                                               *
+*                                                                       *
+*    pc : (uint8_t) New compression                                     *
+*               0 - fast, only runs and repeats of the row above        *
+*               1 - balanced, LZ77 without lazy matching                *
+*               2 - small, LZ77 with lazy matching                      *
+*                                                                       *
+*-----------------------------------------------------------------------*
+* Outputs:                                                              *
+*                                                                       *
+*    none                                                               *
+*                                                                       *
+************************************************************************/
+
+void
+MpsPrinter::setPngCompression(uint8_t pc)
+{
+    LodePNGCompressSettings *zlib = &lodepng_state.encoder.zlibsettings;
+
+    if (pc > MPS_PRINTER_PNG_SMALL) pc = MPS_PRINTER_PNG_SMALL;
+    png_compression = pc;
+
+    zlib->btype        = 2;
+    zlib->use_lz77     = true;
+    zlib->windowsize   = 1024;
+    zlib->lazymatching = (pc == MPS_PRINTER_PNG_SMALL);
+
+    /* -------  Run length encoding, an empty row after an empty row costs a memcmp */
+    zlib->rle_row = (pc == MPS_PRINTER_PNG_FAST) ? MPS_PRINTER_ROW_SIZE + 1 : 0;
+
+    DBGMSGV("PNG compression changed to %d", pc);
+}
+
 /************************************************************************
 *                       MpsPrinter::setInterpreter(in)          Public  *
 *                       ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~                  *
@@ -306,7 +385,8 @@ MpsPrinter::setInterpreter(mps_printer_interpreter_t in)
 /************************************************************************
 *                       MpsPrinter::Clear()               Private       *
 *                       ~~~~~~~~~~~~~~~~~~~                             *
-* Function : Clear page and set printer head on top left position       *
+* Function : Clear page and set printer head on top left position. Only *
+*            tiles with ink are freed, the others are already blank     *
 *-----------------------------------------------------------------------*
 * Inputs:                                                               *
 *                                                                       *
@@ -322,7 +402,13 @@ MpsPrinter::setInterpreter(mps_printer_interpreter_t in)
 void
 MpsPrinter::Clear(void)
 {
-    bzero (bitmap,MPS_PRINTER_BITMAP_SIZE);
+    for (int i=0; i<inked_count; i++)
+    {
+        free(tiles[inked_tiles[i]]);
+        tiles[inked_tiles[i]] = blank_tile;
+    }
+    inked_count = 0;
+
     head_x = margin_left;
     head_y = margin_top;
     clean  = true;
@@ -570,7 +656,10 @@ MpsPrinter::FormFeed(void)
 /************************************************************************
 *                       MpsPrinter::Print(filename)       Private       *
 *                       ~~~~~~~~~~~~~~~~~~~~~~~~~~~                     *
-* Function : Save current page to PNG finename provided                 *
+* Function : Save current page to PNG finename provided. The page is    *
+*            compressed MPS_PRINTER_PNG_BAND_ROWS rows at a time, and   *
+*            each band is written as an IDAT chunk right away, such     *
+*            that the whole PNG file is never held in memory            *
 *-----------------------------------------------------------------------*
 * Inputs:                                                               *
 *                                                                       *
@@ -586,44 +675,176 @@ MpsPrinter::FormFeed(void)
 void
 MpsPrinter::Print(const char * filename)
 {
-    uint8_t *buffer;
-    size_t outsize;
-
-    DBGMSG("start PNG encoder");
+    static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    LodePNGInfo *info = &lodepng_state.info_png;
+    LodePNGZlibStream zlib;
+    uint8_t header[13];
+    uint8_t palette[3 * 256];
+    uint8_t phys[9];
+    uint8_t *band;
+    unsigned error;
+    bool ok;
+
+    /* =======  Open PNG file */
 #ifndef NOT_ULTIMATE
+    png_file = NULL;
+    fm->fopen((const char *) filename, FA_WRITE|FA_CREATE_NEW, &png_file);
+    if (!png_file)
+    {
+        DBGMSG("Saving PNG failed\n");
+        return;
+    }
     ActivityLedOn();
+#else
+    png_file = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (png_file < 0)
+    {
+        printf("Saving file failed\n");
+        return;
+    }
 #endif
-    buffer=NULL;
-    unsigned error = lodepng_encode(&buffer, &outsize, bitmap, MPS_PRINTER_PAGE_WIDTH, MPS_PRINTER_PAGE_HEIGHT, &lodepng_state);
-    DBGMSG("ended PNG encoder, now saving");
-#ifndef NOT_ULTIMATE
-    ActivityLedOff();
 
-    File *f;
-    FRESULT fres = fm->fopen((const char *) filename, FA_WRITE|FA_CREATE_NEW, &f);
-    if (f) {
-        uint32_t bytes;
-        f->write(buffer, outsize, &bytes);
-        fm->fclose(f);
-        DBGMSG("PNG saved");
+    /* =======  Header chunks, from the same state lodepng_encode() used */
+    for (int i=0; i<4; i++)
+    {
+        header[i]   = MPS_PRINTER_PAGE_WIDTH >> (24 - 8*i);
+        header[4+i] = MPS_PRINTER_PAGE_HEIGHT >> (24 - 8*i);
+        phys[i]     = info->phys_x >> (24 - 8*i);
+        phys[4+i]   = info->phys_y >> (24 - 8*i);
     }
-    else
+    header[8]  = info->color.bitdepth;
+    header[9]  = info->color.colortype;
+    header[10] = 0;     /* deflate */
+    header[11] = 0;     /* adaptive filtering */
+    header[12] = 0;     /* not interlaced */
+    phys[8]    = info->phys_unit;
+
+    for (size_t i=0; i<info->color.palettesize; i++)
     {
-        DBGMSG("Saving PNG failed\n");
+        palette[3*i]   = info->color.palette[4*i];
+        palette[3*i+1] = info->color.palette[4*i+1];
+        palette[3*i+2] = info->color.palette[4*i+2];
     }
-#else
-    int fhd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666);
-    if (fhd) {
-        write(fhd, buffer, outsize);
-        close(fhd);
+
+    ok = PngWrite(signature, sizeof(signature)) &&
+         PngChunk("IHDR", header, sizeof(header)) &&
+         PngChunk("PLTE", palette, 3 * info->color.palettesize) &&
+         PngChunk("pHYs", phys, sizeof(phys));
+
+    /* =======  Image data, one band at a time */
+    DBGMSG("start PNG encoder");
+    error = lodepng_zlib_stream_init(&zlib, &lodepng_state.encoder.zlibsettings);
+    band = (uint8_t *) malloc(MPS_PRINTER_PNG_BAND_ROWS * (MPS_PRINTER_ROW_SIZE + 1));
+    if (!band)
+        error = 83;
+
+    for (int y=0; ok && !error && y<MPS_PRINTER_PAGE_HEIGHT; y+=MPS_PRINTER_PNG_BAND_ROWS)
+    {
+        int rows = MPS_PRINTER_PAGE_HEIGHT - y;
+        if (rows > MPS_PRINTER_PNG_BAND_ROWS)
+            rows = MPS_PRINTER_PNG_BAND_ROWS;
+
+        /* -------  Filter type 0 on each row, as lodepng does for palette images */
+        uint8_t **tile_row = &tiles[(y / MPS_PRINTER_TILE_SIZE) * MPS_PRINTER_TILES_X];
+        for (int r=0; r<rows; r++)
+        {
+            uint8_t *line = band + r * (MPS_PRINTER_ROW_SIZE + 1);
+            line[0] = 0;
+            for (int t=0; t<MPS_PRINTER_TILES_X; t++)
+                memcpy(line + 1 + t * MPS_PRINTER_TILE_BYTES, tile_row[t] + r * MPS_PRINTER_TILE_BYTES,
+                       MPS_PRINTER_TILE_BYTES);
+        }
+
+        error = lodepng_zlib_stream_add(&zlib, band, rows * (MPS_PRINTER_ROW_SIZE + 1),
+                                        y + rows == MPS_PRINTER_PAGE_HEIGHT);
+
+        /* -------  Write what is compressed so far */
+        size_t ready = lodepng_zlib_stream_ready(&zlib);
+        if (!error && ready)
+        {
+            ok = PngChunk("IDAT", zlib.out, ready);
+            lodepng_zlib_stream_consume(&zlib, ready);
+        }
     }
+
+    ok = ok && !error && PngChunk("IEND", NULL, 0);
+    DBGMSG("ended PNG encoder");
+
+    free(band);
+    lodepng_zlib_stream_cleanup(&zlib);
+
+    /* =======  Close PNG file */
+#ifndef NOT_ULTIMATE
+    fm->fclose(png_file);
+    ActivityLedOff();
+    if (ok)
+        DBGMSG("PNG saved");
     else
-    {
+        DBGMSG("Saving PNG failed\n");
+#else
+    close(png_file);
+    if (!ok)
         printf("Saving file failed\n");
-    }
 #endif
+}
+
+/************************************************************************
+*                       MpsPrinter::PngChunk(t,d,l)       Private       *
+*                       ~~~~~~~~~~~~~~~~~~~~~~~~~~~                     *
+* Function : Write a chunk to the PNG file being printed                *
+*-----------------------------------------------------------------------*
+* Inputs:                                                               *
+*                                                                       *
+*    type   : (char *) 4 letter chunk type                              *
+*    data   : (uint8_t *) chunk data                                    *
+*    length : (uint32_t) chunk data size in bytes                       *
+*                                                                       *
+*-----------------------------------------------------------------------*
+* Outputs:                                                              *
+*                                                                       *
+*    (bool) true if the chunk was written                               *
+*                                                                       *
+************************************************************************/
+
+bool
+MpsPrinter::PngChunk(const char *type, const uint8_t *data, uint32_t length)
+{
+    uint8_t *chunk = NULL;
+    size_t size = 0;
+
+    /* -------  Length, type, data and CRC */
+    bool ok = !lodepng_chunk_create(&chunk, &size, length, type, data) && PngWrite(chunk, size);
+
+    free(chunk);
+    return ok;
+}
+
+/************************************************************************
+*                       MpsPrinter::PngWrite(d,s)         Private       *
+*                       ~~~~~~~~~~~~~~~~~~~~~~~~~                       *
+* Function : Write bytes to the PNG file being printed                  *
+*-----------------------------------------------------------------------*
+* Inputs:                                                               *
+*                                                                       *
+*    data : (uint8_t *) bytes to write                                  *
+*    size : (uint32_t) number of bytes                                  *
+*                                                                       *
+*-----------------------------------------------------------------------*
+* Outputs:                                                              *
+*                                                                       *
+*    (bool) true if all bytes were written                              *
+*                                                                       *
+************************************************************************/
 
-    free(buffer);
+bool
+MpsPrinter::PngWrite(const uint8_t *data, uint32_t size)
+{
+#ifndef NOT_ULTIMATE
+    uint32_t bytes;
+    return png_file->write(data, size, &bytes) == FR_OK && bytes == size;
+#else
+    return write(png_file, data, size) == (ssize_t) size;
+#endif
 }
 
 /************************************************************************
@@ -650,83 +871,405 @@ MpsPrinter::Print(const char * filename)
 void
 MpsPrinter::Dot(uint16_t x, uint16_t y, bool b)
 {
+    /* -------  Bold adds a dot 2 pixels to the right, double strike one pixel down */
+    bool right = !b && bold;
+    bool down  = !b && double_strike;
+    uint8_t size = (dot_size > 2 ? 2 : dot_size) << 2;
+
+    /* =======  Drawing a character into a glyph, see Glyph() */
+    if (glyph)
+    {
+        /* -------  Position of the stamp in the glyph */
+        int gx = glyph_phase + x - glyph_x;
+        int gy = y - glyph_y;
+
+        if (gx < 0 || gy < 0 ||
+            (gx >> 2) + 3 > MPS_PRINTER_GLYPH_BYTES ||
+            gy + MPS_PRINTER_STAMP_ROWS > MPS_PRINTER_GLYPH_ROWS)
+        {
+            glyph_overflow = true;
+            return;
+        }
+
+        /* -------  Remember how far the dots go, to know when the glyph fits on the page */
+        if (x - glyph_x + (right ? 2 : 0) > glyph->max_x) glyph->max_x = x - glyph_x + (right ? 2 : 0);
+        if (y - glyph_y + (down ? 1 : 0) > glyph->max_y) glyph->max_y = y - glyph_y + (down ? 1 : 0);
+
+        mps_printer_stamp_t *stamp = &stamps[size | (right ? 2 : 0) | (down ? 1 : 0)];
+        AddStamp(&glyph->bits[gy + stamp->first][gx >> 2], MPS_PRINTER_GLYPH_BYTES, stamp, gx & 0x3);
+        return;
+    }
+
     /* =======  Check if position is out of range */
 
     if ( x > MPS_PRINTER_PAGE_PRINTABLE_WIDTH  ||
          y > MPS_PRINTER_PAGE_PRINTABLE_HEIGHT ) return;
 
-    /* =======  Draw dot */
+    /* -------  Bold and double strike dots out of the printable area are not printed either */
+    if (x+2 > MPS_PRINTER_PAGE_PRINTABLE_WIDTH) right = false;
+    if (y+1 > MPS_PRINTER_PAGE_PRINTABLE_HEIGHT) down = false;
+
+    /* =======  Calculate true position on page of the top left corner of the stamp */
+    uint16_t tx = x+MPS_PRINTER_PAGE_OFFSET_LEFT-1;
+    uint16_t ty = y+MPS_PRINTER_PAGE_OFFSET_TOP-1;
 
-    switch (dot_size)
+    mps_printer_stamp_t *stamp = &stamps[size | (right ? 2 : 0) | (down ? 1 : 0)];
+    uint16_t column = tx >> 2;
+
+    /* -------  Usually the whole stamp is on one tile */
+    if (column % MPS_PRINTER_TILE_BYTES <= MPS_PRINTER_TILE_BYTES - 3 &&
+        (ty + stamp->first) / MPS_PRINTER_TILE_SIZE == (ty + stamp->last) / MPS_PRINTER_TILE_SIZE)
     {
-        case 0:     // Density 0 : 1 single black point (diameter 1 pixel) mostly for debug
-            Ink(x,y);
-            break;
+        uint8_t *p = PageByte(column, ty + stamp->first);
+        if (p) AddStamp(p, MPS_PRINTER_TILE_BYTES, stamp, tx & 0x3);
+    }
+    /* -------  Otherwise one row at a time, it can be on up to 4 tiles */
+    else
+    {
+        for (int r=stamp->first; r<=stamp->last; r++)
+            AddInk(column, ty + r, stamp->row[tx & 0x3][r]);
+    }
 
-        case 1:     // Density 1 : 1 black point with gray around (looks like diameter 2)
-            Ink(x,y);
-            Ink(x-1,y-1,1);
-            Ink(x+1,y+1,1);
-            Ink(x-1,y+1,1);
-            Ink(x+1,y-1,1);
-            Ink(x,y-1,2);
-            Ink(x,y+1,2);
-            Ink(x-1,y,2);
-            Ink(x+1,y,2);
-            break;
+    /* -------  Now we know that the page is not blank */
+    clean  = false;
+}
 
-        case 2:     // Density 2 : 4 black points with gray around (looks like diameter 3)
-        default:
-            Ink(x,y);
-            Ink(x,y+1);
-            Ink(x+1,y);
-            Ink(x+1,y+1);
-
-            Ink(x-1,y-1,1);
-            Ink(x+2,y-1,1);
-            Ink(x-1,y+2,1);
-            Ink(x+2,y+2,1);
-
-            Ink(x,y-1,2);
-            Ink(x+1,y-1,2);
-            Ink(x,y+1,2);
-            Ink(x-1,y,2);
-            Ink(x-1,y+1,2);
-            Ink(x+2,y,2);
-            Ink(x+2,y+1,2);
-            Ink(x,y+2,2);
-            Ink(x+1,y+2,2);
+/************************************************************************
+*               MpsPrinter::AddStamp(p,stride,stamp,phase)    Private   *
+*               ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~              *
+* Function : Add the ink of a dot to a glyph or to a page tile          *
+*-----------------------------------------------------------------------*
+* Inputs:                                                               *
+*                                                                       *
+*    p      : (uint8_t *) byte holding the left corner of the first row *
+*             with ink of the stamp                                     *
+*    stride : (uint16_t) bytes from one row to the next                 *
+*    stamp  : (mps_printer_stamp_t *) dot to add                        *
+*    phase  : (uint8_t) position of the left corner in its byte         *
+*                                                                       *
+*-----------------------------------------------------------------------*
+* Outputs:                                                              *
+*                                                                       *
+*    none                                                               *
+*                                                                       *
+************************************************************************/
+
+void
+MpsPrinter::AddStamp(uint8_t *p, uint16_t stride, mps_printer_stamp_t *stamp, uint8_t phase)
+{
+    uint32_t *row = stamp->row[phase];
+
+    /* =======  Add ink to the 3 bytes covered by each row */
+    for (int r=stamp->first; r<=stamp->last; r++)
+    {
+        uint32_t current = ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8);
+        current = CombineRow(current, row[r]);
+        p[0] = current >> 24;
+        p[1] = current >> 16;
+        p[2] = current >> 8;
+        p += stride;
+    }
+}
+
+/************************************************************************
+*                       MpsPrinter::PageByte(column,y)        Private   *
+*                       ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~                  *
+* Function : Find a byte of the page bitmap in the tile that holds it.  *
+*            A blank tile is given memory of its own first              *
+*-----------------------------------------------------------------------*
+* Inputs:                                                               *
+*                                                                       *
+*    column : (uint16_t) byte from the left of the page                 *
+*    y      : (uint16_t) row from the top of the page                   *
+*                                                                       *
+*-----------------------------------------------------------------------*
+* Outputs:                                                              *
+*                                                                       *
+*    (uint8_t *) byte in the tile, NULL if out of memory                *
+*                                                                       *
+************************************************************************/
+
+uint8_t *
+MpsPrinter::PageByte(uint16_t column, uint16_t y)
+{
+    uint16_t t = (y / MPS_PRINTER_TILE_SIZE) * MPS_PRINTER_TILES_X + column / MPS_PRINTER_TILE_BYTES;
+
+    if (tiles[t] == blank_tile)
+    {
+        uint8_t *tile = (uint8_t *) malloc(sizeof(blank_tile));
+
+        if (!tile)
+        {
+            DBGMSG("no memory for a page tile, ink is lost");
+            return NULL;
+        }
+
+        bzero(tile, sizeof(blank_tile));
+        tiles[t] = tile;
+        inked_tiles[inked_count++] = t;
+    }
+
+    return tiles[t] + (y % MPS_PRINTER_TILE_SIZE) * MPS_PRINTER_TILE_BYTES + column % MPS_PRINTER_TILE_BYTES;
+}
+
+/************************************************************************
+*                       MpsPrinter::AddInk(column,y,ink)      Private   *
+*                       ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~                *
+* Function : Add 16 pixels of ink to a row of the page bitmap           *
+*-----------------------------------------------------------------------*
+* Inputs:                                                               *
+*                                                                       *
+*    column : (uint16_t) byte from the left of the page of the first    *
+*             4 pixels                                                  *
+*    y      : (uint16_t) row from the top of the page                   *
+*    ink    : (uint32_t) 2 bit pixels from bit 31, as in the bitmap     *
+*                                                                       *
+*-----------------------------------------------------------------------*
+* Outputs:                                                              *
+*                                                                       *
+*    none                                                               *
+*                                                                       *
+************************************************************************/
+
+void
+MpsPrinter::AddInk(uint16_t column, uint16_t y, uint32_t ink)
+{
+    /* =======  All 4 bytes in the same tile */
+    if (column % MPS_PRINTER_TILE_BYTES <= MPS_PRINTER_TILE_BYTES - 4)
+    {
+        uint8_t *p = PageByte(column, y);
+        if (p) AddWord(p, ink);
+        return;
+    }
+
+    /* =======  Across two tiles, a byte at a time, skipping those without ink */
+    for (int i=0; i<4 && column+i < MPS_PRINTER_ROW_SIZE; i++, ink <<= 8)
+    {
+        if (!(ink & 0xFF000000)) continue;
+
+        uint8_t *p = PageByte(column + i, y);
+        if (!p) continue;
+
+        *p = CombineRow((uint32_t) *p << 24, ink & 0xFF000000) >> 24;
+    }
+}
+
+/************************************************************************
+*                       MpsPrinter::AddWord(p,ink)            Private   *
+*                       ~~~~~~~~~~~~~~~~~~~~~~~~~~                      *
+* Function : Add 16 pixels of ink to 4 bytes of a tile                  *
+*-----------------------------------------------------------------------*
+* Inputs:                                                               *
+*                                                                       *
+*    p   : (uint8_t *) first byte in the tile                           *
+*    ink : (uint32_t) 2 bit pixels from bit 31, as in the bitmap        *
+*                                                                       *
+*-----------------------------------------------------------------------*
+* Outputs:                                                              *
+*                                                                       *
+*    none                                                               *
+*                                                                       *
+************************************************************************/
+
+inline void
+MpsPrinter::AddWord(uint8_t *p, uint32_t ink)
+{
+    uint32_t current = ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    current = CombineRow(current, ink);
+    p[0] = current >> 24;
+    p[1] = current >> 16;
+    p[2] = current >> 8;
+    p[3] = current;
+}
+
+/************************************************************************
+*                       MpsPrinter::Glyph(kind,c,x,y)         Private   *
+*                       ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~                   *
+* Function : Print a character from the glyph cache. The first time a   *
+*            character is printed with a given style and position in a  *
+*            bitmap byte, its dots are drawn into a glyph. The glyph is *
+*            then added to the page as a whole. A character that is not *
+*            completely inside the printable area is not printed here   *
+*-----------------------------------------------------------------------*
+* Inputs:                                                               *
+*                                                                       *
+*    kind : (uint8_t) MPS_PRINTER_GLYPH_DRAFT, _NLQ or _ITALIC          *
+*    c    : (uint16_t) char from the chargen table of that kind         *
+*    x    : (uint16_t) first pixel position from left of printable area *
+*    y    : (uint16_t) first pixel position from top of printable area  *
+*                                                                       *
+*-----------------------------------------------------------------------*
+* Outputs:                                                              *
+*                                                                       *
+*    (bool) true if printed, false if it must be printed dot by dot     *
+*                                                                       *
+************************************************************************/
+
+bool
+MpsPrinter::Glyph(uint8_t kind, uint16_t c, uint16_t x, uint16_t y)
+{
+    /* =======  Calculate true position on page of the top left corner of the glyph */
+    uint16_t tx = x+MPS_PRINTER_PAGE_OFFSET_LEFT-1;
+    uint16_t ty = y+MPS_PRINTER_PAGE_OFFSET_TOP-1;
+    uint8_t phase = tx & 0x3;
+
+    /* -------  Everything that changes the look of the character */
+    uint32_t key = 0x80000000 | c | (kind << 9) | (step << 11) | (script << 14) | (phase << 17) |
+                   ((dot_size > 2 ? 2 : dot_size) << 19) |
+                   (double_width  ? 1 << 21 : 0) |
+                   (reverse       ? 1 << 22 : 0) |
+                   (underline     ? 1 << 23 : 0) |
+                   (overline      ? 1 << 24 : 0) |
+                   (bold          ? 1 << 25 : 0) |
+                   (double_strike ? 1 << 26 : 0);
+
+    /* -------  Look in the ways of the set the key belongs to (high bits of the hash depend on all bits of the key) */
+    mps_printer_glyph_t *set = &glyphs[(((key * 2654435761U) >> 24) % (MPS_PRINTER_GLYPHS/MPS_PRINTER_GLYPH_WAYS)) * MPS_PRINTER_GLYPH_WAYS];
+    mps_printer_glyph_t *g = set;
+
+    for (int w=0; w<MPS_PRINTER_GLYPH_WAYS; w++)
+    {
+        if (set[w].key == key)
+        {
+            g = &set[w];
             break;
+        }
+
+        /* Otherwise the least recently used is replaced */
+        if (set[w].used < g->used) g = &set[w];
     }
 
+    g->used = ++glyph_clock;
 
-    if (!b)   /* This is not BIM related, we can double strike and bold */
+    /* =======  Draw the glyph when it is not in the cache */
+    if (g->key != key)
     {
-        /* -------  If double strike is ON, draw a second dot just to the right of the first one */
-        if (bold) Dot(x+2,y,true);
-        if (double_strike)
+        bzero(g, sizeof(mps_printer_glyph_t));
+        g->used = glyph_clock;
+
+        glyph          = g;
+        glyph_x        = x;
+        glyph_y        = y;
+        glyph_phase    = phase;
+        glyph_overflow = false;
+
+        switch (kind)
+        {
+            case MPS_PRINTER_GLYPH_NLQ:
+                DrawNLQ(c, x, y);
+                break;
+
+            case MPS_PRINTER_GLYPH_ITALIC:
+                DrawItalic(c, x, y);
+                break;
+
+            default:
+                DrawDraft(c, x, y);
+        }
+
+        glyph = NULL;
+
+        /* -------  Too large for a glyph, stays unused */
+        if (glyph_overflow) return false;
+
+        /* -------  Find where the ink is */
+        g->first = MPS_PRINTER_GLYPH_ROWS;
+        g->lead = MPS_PRINTER_GLYPH_BYTES;
+        for (int r=0; r<MPS_PRINTER_GLYPH_ROWS; r++)
+        {
+            for (int i=0; i<MPS_PRINTER_GLYPH_BYTES; i++)
+            {
+                if (g->bits[r][i])
+                {
+                    if (r < g->first) g->first = r;
+                    g->last = r;
+                    if (i/4 >= g->words) g->words = i/4 + 1;
+                    if (i < g->lead) g->lead = i;
+                    if (i >= g->bytes) g->bytes = i + 1;
+                }
+            }
+        }
+
+        g->key = key;
+    }
+
+    /* =======  Nothing to print (space) */
+    if (g->first > g->last) return true;
+
+    /* -------  Part of the character is out of range, only some dots are printed */
+    if ( x + g->max_x > MPS_PRINTER_PAGE_PRINTABLE_WIDTH  ||
+         y + g->max_y > MPS_PRINTER_PAGE_PRINTABLE_HEIGHT ) return false;
+
+    /* =======  Add ink to the page, 16 pixels at a time */
+    uint16_t column = tx >> 2;
+    uint16_t start = column % MPS_PRINTER_TILE_BYTES;
+    uint16_t left_column = column - start;
+    uint16_t split = MPS_PRINTER_TILE_BYTES - start;   /* bytes of a row on the left tile */
+    uint16_t shift = 8 * (start % 4);                  /* bits the glyph is off the words of the tiles */
+    int glyph_words = g->words;
+    int words = glyph_words + (shift ? 1 : 0);         /* words of the tiles with ink in each row */
+    int left_words = (split + start % 4) / 4;
+    int last = g->last;
+    bool left_tile = g->lead < split;
+    bool right_tile = g->bytes > split && left_column + MPS_PRINTER_TILE_BYTES < MPS_PRINTER_ROW_SIZE;
+    uint8_t *left = NULL;
+    uint8_t *right = NULL;
+
+    if (left_words > words) left_words = words;
+
+    for (int r=g->first; r<=last; r++)
+    {
+        uint16_t y = ty + r;
+        uint32_t ink[MPS_PRINTER_GLYPH_BYTES/4 + 1];
+
+        /* -------  The tiles are looked up for the first row in each tile row, on the next rows we only move down */
+        if (r == g->first || y % MPS_PRINTER_TILE_SIZE == 0)
+        {
+            left = left_tile ? PageByte(column - start % 4, y) : NULL;
+            right = right_tile ? PageByte(left_column + MPS_PRINTER_TILE_BYTES, y) : NULL;
+        }
+
+        /* -------  The ink of the row, shifted onto the words of the tiles */
+        uint8_t *s = g->bits[r];
+        uint32_t previous = 0;
+        for (int w=0; w<words; w++, s+=4)
         {
-            Dot(x,y+1,true);
-            if (bold) Dot(x+2,y+1,true);
+            uint32_t next = (w < glyph_words) ? ((uint32_t) s[0] << 24) | (s[1] << 16) | (s[2] << 8) | s[3] : 0;
+            ink[w] = shift ? (previous << (32 - shift)) | (next >> shift) : next;
+            previous = next;
+        }
+
+        if (left)
+        {
+            for (int w=0; w<left_words; w++)
+                if (ink[w]) AddWord(left + 4*w, ink[w]);
+            left += MPS_PRINTER_TILE_BYTES;
+        }
+
+        if (right)
+        {
+            for (int w=left_words; w<words; w++)
+                if (ink[w]) AddWord(right + 4*(w - left_words), ink[w]);
+            right += MPS_PRINTER_TILE_BYTES;
         }
     }
 
     /* -------  Now we know that the page is not blank */
     clean  = false;
+
+    return true;
 }
 
 /************************************************************************
-*                             MpsPrinter::Ink(x,y,c)          Private   *
-*                             ~~~~~~~~~~~~~~~~~~~~~~                    *
-* Function : Add ink on a single pixel position. If ink as already been *
-*            added on this position it will add more ink to be darker   *
+*                       MpsPrinter::BuildStamps()             Private   *
+*                       ~~~~~~~~~~~~~~~~~~~~~~~~~                       *
+* Function : Calculate the ink of a dot for each dot size, with and     *
+*            without bold and double strike, for each position of its   *
+*            left side in a bitmap byte                                 *
 *-----------------------------------------------------------------------*
 * Inputs:                                                               *
 *                                                                       *
-*    x : (uint16_t) pixel position from left of printable area of page  *
-*    y : (uint16_t) pixel position from top of printable area of page   *
-*    c : (uint8_t) grey level                                           *
-*        0=black (default), 1=dark grey, 2=light grey                   *
+*    none                                                               *
 *                                                                       *
 *-----------------------------------------------------------------------*
 * Outputs:                                                              *
@@ -736,50 +1279,53 @@ MpsPrinter::Dot(uint16_t x, uint16_t y, bool b)
 ************************************************************************/
 
 void
-MpsPrinter::Ink(uint16_t x, uint16_t y, uint8_t c)
+MpsPrinter::BuildStamps(void)
 {
-    /* =======  Calculate true x and y position on page */
-    uint16_t tx=x+MPS_PRINTER_PAGE_OFFSET_LEFT;
-    uint16_t ty=y+MPS_PRINTER_PAGE_OFFSET_TOP;
-    uint8_t current;
+    for (int s=0; s<MPS_PRINTER_STAMPS; s++)
+    {
+        uint8_t grid[MPS_PRINTER_STAMP_ROWS][MPS_PRINTER_STAMP_COLUMNS];
+        mps_printer_stamp_t *stamp = &stamps[s];
+        int8_t (*pattern)[3] = dot_pattern[s >> 2];
 
-    /* -------  Which byte address is it on raster buffer */
-    uint32_t byte = ((ty*MPS_PRINTER_PAGE_WIDTH+tx)*MPS_PRINTER_PAGE_DEPTH)>>3;
+        bzero(grid, sizeof(grid));
 
-    /* -------  Whitch bits on byte are coding the pixe (4 pixels per byte) */
-    uint8_t sub = tx & 0x3;
-    c &= 0x3;
+        /* =======  Add ink of each strike, the dot is at row 1, column 1 */
+        for (int strike=0; strike<4; strike++)
+        {
+            int sx = 1 + (strike & 1) * 2;
+            int sy = 1 + (strike >> 1);
 
-    /* =======  Add ink to the pixel */
-    switch (sub)
-    {
-        case 0:
-            current = (bitmap[byte] >> 6) & 0x03;
-            c = Combine(c, current);
-            bitmap[byte] &= 0x3F;
-            bitmap[byte] |= c << 6;
-            break;
+            if ((strike & 1) && !(s & 2)) continue;     /* bold */
+            if ((strike & 2) && !(s & 1)) continue;     /* double strike */
 
-        case 1:
-            current = (bitmap[byte] >> 4) & 0x03;
-            c = Combine(c, current);
-            bitmap[byte] &= 0xCF;
-            bitmap[byte] |= c << 4;
-            break;
+            for (int i=0; pattern[i][2]; i++)
+            {
+                uint8_t *pixel = &grid[sy+pattern[i][1]][sx+pattern[i][0]];
+                *pixel = Combine(*pixel, pattern[i][2]);
+            }
+        }
 
-        case 2:
-            current = (bitmap[byte] >> 2) & 0x03;
-            c = Combine(c, current);
-            bitmap[byte] &= 0xF3;
-            bitmap[byte] |= c << 2;
-            break;
+        /* =======  Pack the rows for each position in a byte */
+        stamp->first = MPS_PRINTER_STAMP_ROWS;
+        stamp->last  = 0;
+        for (int r=0; r<MPS_PRINTER_STAMP_ROWS; r++)
+        {
+            for (int phase=0; phase<MPS_PRINTER_STAMP_PHASES; phase++)
+            {
+                uint32_t bits = 0;
 
-        case 3:
-            current = bitmap[byte] & 0x03;
-            c = Combine(c, current);
-            bitmap[byte] &= 0xFC;
-            bitmap[byte] |= c;
-            break;
+                for (int c=0; c<MPS_PRINTER_STAMP_COLUMNS; c++)
+                    bits |= (uint32_t) grid[r][c] << (30 - 2*(phase+c));
+
+                stamp->row[phase][r] = bits;
+            }
+
+            if (stamp->row[0][r])
+            {
+                if (r < stamp->first) stamp->first = r;
+                stamp->last = r;
+            }
+        }
     }
 }
 
@@ -822,6 +1368,42 @@ MpsPrinter::Combine(uint8_t c1, uint8_t c2)
     return result;
 }
 
+/************************************************************************
+*                       MpsPrinter::CombineRow(r1,r2)         Private   *
+*                       ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~                   *
+* Function : Combine 16 pairs of grey levels at once, like Combine()    *
+*-----------------------------------------------------------------------*
+* Inputs:                                                               *
+*                                                                       *
+*    r1 : (uint32_t) first grey levels, 2 bits each                     *
+*    r2 : (uint32_t) second grey levels, 2 bits each                    *
+*                                                                       *
+*-----------------------------------------------------------------------*
+* Outputs:                                                              *
+*                                                                       *
+*    (uint32_t) resulting grey levels                                   *
+*                                                                       *
+************************************************************************/
+
+uint32_t
+MpsPrinter::CombineRow(uint32_t r1, uint32_t r2)
+{
+        /*-
+         *
+         *  Adds each pair of 2 bits, the carry of the low bits
+         *  goes into the high bits. When the high bits overflow
+         *  too, the result is black (3)
+         *
+        -*/
+
+    uint32_t carry = (r1 & r2 & 0x55555555) << 1;
+    uint32_t low   = (r1 ^ r2) & 0x55555555;
+    uint32_t high  = (r1 ^ r2 ^ carry) & 0xAAAAAAAA;
+    uint32_t over  = ((r1 & r2) | (r1 & carry) | (r2 & carry)) & 0xAAAAAAAA;
+
+    return high | low | over | (over >> 1);
+}
+
 /************************************************************************
 *                       MpsPrinter::CharItalic(c,x,y)         Private   *
 *                       ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~                   *
@@ -846,6 +1428,35 @@ MpsPrinter::CharItalic(uint16_t c, uint16_t x, uint16_t y)
     /* =======  Check is chargen is in italic chargen range */
     if (c > 128) return 0;
 
+    /* =======  Print from the glyph cache, or dot by dot */
+    if (!Glyph(MPS_PRINTER_GLYPH_ITALIC, c, x, y))
+        DrawItalic(c, x, y);
+
+    /* =======  This is the width of the printed char */
+    return spacing_x[step][12]<<(double_width?1:0);
+}
+
+/************************************************************************
+*                       MpsPrinter::DrawItalic(c,x,y)         Private   *
+*                       ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~                   *
+* Function : Draw the dots of a single italic draft quality character   *
+*-----------------------------------------------------------------------*
+* Inputs:                                                               *
+*                                                                       *
+*    c : (uint16_t) char from italic chargen table                      *
+*    x : (uint16_t) first pixel position from left of printable area    *
+*    y : (uint16_t) first pixel position from top of printable area     *
+*                                                                       *
+*-----------------------------------------------------------------------*
+* Outputs:                                                              *
+*                                                                       *
+*    none                                                               *
+*                                                                       *
+************************************************************************/
+
+void
+MpsPrinter::DrawItalic(uint16_t c, uint16_t x, uint16_t y)
+{
     uint8_t lst_head = 0;         // Last printed pattern to calculate reverse
     uint8_t shift = chargen_italic[c][11] & 1;    // 8 down pins from 9 ?
 
@@ -909,9 +1520,6 @@ MpsPrinter::CharItalic(uint16_t c, uint16_t x, uint16_t y)
             Dot(dx, dy);
         }
     }
-
-    /* =======  This is the width of the printed char */
-    return spacing_x[step][12]<<(double_width?1:0);
 }
 
 /************************************************************************
@@ -938,6 +1546,43 @@ MpsPrinter::CharDraft(uint16_t c, uint16_t x, uint16_t y)
     /* =======  Check is chargen is in draft chargen range */
     if (c > 403) return 0;
 
+    /* =======  Print from the glyph cache, or dot by dot */
+    if (!Glyph(MPS_PRINTER_GLYPH_DRAFT, c, x, y))
+        DrawDraft(c, x, y);
+
+    /* =======  If the char is completed by a second chargen below, go print it */
+    if (chargen_draft[c][11] & 0x80)
+    {
+        uint8_t shift = chargen_draft[c][11] & 1;     // 8 down pins from 9 ?
+        CharDraft((chargen_draft[c][11] & 0x70) >> 4, x, y+spacing_y[script][shift+8]);
+    }
+
+    /* =======  This is the width of the printed char */
+    return spacing_x[step][12]<<(double_width?1:0);
+}
+
+/************************************************************************
+*                       MpsPrinter::DrawDraft(c,x,y)          Private   *
+*                       ~~~~~~~~~~~~~~~~~~~~~~~~~~~~                    *
+* Function : Draw the dots of a single regular draft quality character, *
+*            without the second chargen below                           *
+*-----------------------------------------------------------------------*
+* Inputs:                                                               *
+*                                                                       *
+*    c : (uint16_t) char from draft chargen table                       *
+*    x : (uint16_t) first pixel position from left of printable area    *
+*    y : (uint16_t) first pixel position from top of printable area     *
+*                                                                       *
+*-----------------------------------------------------------------------*
+* Outputs:                                                              *
+*                                                                       *
+*    none                                                               *
+*                                                                       *
+************************************************************************/
+
+void
+MpsPrinter::DrawDraft(uint16_t c, uint16_t x, uint16_t y)
+{
     uint8_t lst_head = 0; // Last printed pattern to calculate reverse
     uint8_t shift = chargen_draft[c][11] & 1;     // 8 down pins from 9 ?
 
@@ -1009,15 +1654,6 @@ MpsPrinter::CharDraft(uint16_t c, uint16_t x, uint16_t y)
             Dot(dx, dy);
         }
     }
-
-    /* =======  If the char is completed by a second chargen below, go print it */
-    if (chargen_draft[c][11] & 0x80)
-    {
-        CharDraft((chargen_draft[c][11] & 0x70) >> 4, x, y+spacing_y[script][shift+8]);
-    }
-
-    /* =======  This is the width of the printed char */
-    return spacing_x[step][12]<<(double_width?1:0);
 }
 
 /************************************************************************
@@ -1044,6 +1680,43 @@ MpsPrinter::CharNLQ(uint16_t c, uint16_t x, uint16_t y)
     /* =======  Check is chargen is in NLQ chargen range */
     if (c > 403) return 0;
 
+    /* =======  Print from the glyph cache, or dot by dot */
+    if (!Glyph(MPS_PRINTER_GLYPH_NLQ, c, x, y))
+        DrawNLQ(c, x, y);
+
+    /* =======  If the char is completed by a second chargen below, go print it */
+    if (chargen_nlq_high[c][11] & 0x80)
+    {
+        uint8_t shift = chargen_nlq_high[c][11] & 1;  // 8 down pins from 9 ?
+        CharNLQ((chargen_nlq_high[c][11] & 0x70) >> 4, x, y+spacing_y[script][shift+8]);
+    }
+
+    /* =======  This is the width of the printed char */
+    return spacing_x[step][12]<<(double_width?1:0);
+}
+
+/************************************************************************
+*                       MpsPrinter::DrawNLQ(c,x,y)            Private   *
+*                       ~~~~~~~~~~~~~~~~~~~~~~~~~~                      *
+* Function : Draw the dots of a single regular NLQ character, without   *
+*            the second chargen below                                   *
+*-----------------------------------------------------------------------*
+* Inputs:                                                               *
+*                                                                       *
+*    c : (uint16_t) char from draft nlq (high and low) table            *
+*    x : (uint16_t) first pixel position from left of printable area    *
+*    y : (uint16_t) first pixel position from top of printable area     *
+*                                                                       *
+*-----------------------------------------------------------------------*
+* Outputs:                                                              *
+*                                                                       *
+*    none                                                               *
+*                                                                       *
+************************************************************************/
+
+void
+MpsPrinter::DrawNLQ(uint16_t c, uint16_t x, uint16_t y)
+{
     uint8_t lst_head_low = 0;     // Last low printed pattern to calculate reverse
     uint8_t lst_head_high = 0;    // Last high printed pattern to calculate reverse
     uint8_t shift = chargen_nlq_high[c][11] & 1;  // 8 down pins from 9 ?
@@ -1081,7 +1754,7 @@ MpsPrinter::CharNLQ(uint16_t c, uint16_t x, uint16_t y)
                 if (chargen_nlq_low[c][11] & 0x04)
                 {
                     /* Repeat last colums */
-                    cur_head_high = chargen_nlq_low[c][10];
+                    cur_head_low = chargen_nlq_low[c][10];
                 }
                 else
                 {
@@ -1164,15 +1837,6 @@ MpsPrinter::CharNLQ(uint16_t c, uint16_t x, uint16_t y)
             Dot(dx, dy);
         }
     }
-
-    /* =======  If the char is completed by a second chargen below, go print it */
-    if (chargen_nlq_high[c][11] & 0x80)
-    {
-        CharNLQ((chargen_nlq_high[c][11] & 0x70) >> 4, x, y+spacing_y[script][shift+8]);
-    }
-
-    /* =======  This is the width of the printed char */
-    return spacing_x[step][12]<<(double_width?1:0);
 }
 
 /************************************************************************
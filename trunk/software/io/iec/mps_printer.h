@@ -50,7 +50,19 @@
 #define MPS_PRINTER_MAX_VTABULATIONS        32
 #define MPS_PRINTER_MAX_VTABSTORES          8
 
-#define MPS_PRINTER_BITMAP_SIZE             ((MPS_PRINTER_PAGE_WIDTH*MPS_PRINTER_PAGE_HEIGHT*MPS_PRINTER_PAGE_DEPTH+7)>>3)
+#define MPS_PRINTER_ROW_SIZE                ((MPS_PRINTER_PAGE_WIDTH*MPS_PRINTER_PAGE_DEPTH+7)>>3)
+
+#define MPS_PRINTER_TILE_SIZE               64  /* pixels in each direction */
+#define MPS_PRINTER_TILE_BYTES              ((MPS_PRINTER_TILE_SIZE*MPS_PRINTER_PAGE_DEPTH)>>3)    /* per row */
+#define MPS_PRINTER_TILES_X                 (MPS_PRINTER_PAGE_WIDTH/MPS_PRINTER_TILE_SIZE)
+#define MPS_PRINTER_TILES_Y                 ((MPS_PRINTER_PAGE_HEIGHT+MPS_PRINTER_TILE_SIZE-1)/MPS_PRINTER_TILE_SIZE)
+#define MPS_PRINTER_TILES                   (MPS_PRINTER_TILES_X*MPS_PRINTER_TILES_Y)
+
+#define MPS_PRINTER_PNG_BAND_ROWS           MPS_PRINTER_TILE_SIZE   /* rows compressed and written at once */
+
+#define MPS_PRINTER_PNG_FAST                0   /* run length encoding */
+#define MPS_PRINTER_PNG_BALANCED            1   /* LZ77 */
+#define MPS_PRINTER_PNG_SMALL               2   /* LZ77 with lazy matching */
 
 #define MPS_PRINTER_MAX_BIM_SUB             256
 #define MPS_PRINTER_MAX_SPECIAL             46
@@ -59,6 +71,20 @@
 #define MPS_PRINTER_SCRIPT_SUPER            2
 #define MPS_PRINTER_SCRIPT_SUB              4
 
+#define MPS_PRINTER_STAMPS                  12  /* 3 dot sizes, bold or not, double strike or not */
+#define MPS_PRINTER_STAMP_ROWS              5   /* from 1 above the dot to 3 below it */
+#define MPS_PRINTER_STAMP_COLUMNS           6   /* from 1 left of the dot to 4 right of it */
+#define MPS_PRINTER_STAMP_PHASES            4   /* pixels per bitmap byte */
+
+#define MPS_PRINTER_GLYPHS                  256 /* characters kept ready to be drawn */
+#define MPS_PRINTER_GLYPH_WAYS              4   /* places a character can be kept at */
+#define MPS_PRINTER_GLYPH_ROWS              32
+#define MPS_PRINTER_GLYPH_BYTES             16  /* 64 pixels per row */
+
+#define MPS_PRINTER_GLYPH_DRAFT             0
+#define MPS_PRINTER_GLYPH_NLQ               1
+#define MPS_PRINTER_GLYPH_ITALIC            2
+
 #ifdef NIOS
 #define FS_ROOT "/Usb0/"
 #else
@@ -107,6 +133,30 @@ typedef enum mps_printer_step {
     MPS_PRINTER_STEPS
 } mps_printer_step_t;
 
+/* Ink of a complete dot, ready to be added to the bitmap one row at a time */
+typedef struct mps_printer_stamp {
+    uint8_t first;      /* first row with ink */
+    uint8_t last;       /* last row with ink */
+
+    /* For each position of the leftmost column in its bitmap byte, the 2 bit
+     * pixels of each row, aligned the way they are in the bitmap from bit 31 */
+    uint32_t row[MPS_PRINTER_STAMP_PHASES][MPS_PRINTER_STAMP_ROWS];
+} mps_printer_stamp_t;
+
+/* Ink of a complete character, laid out like the bitmap */
+typedef struct mps_printer_glyph {
+    uint32_t key;       /* character and everything that changes its look, 0 if unused */
+    uint32_t used;      /* when it was printed last */
+    uint8_t first;      /* first row with ink */
+    uint8_t last;       /* last row with ink */
+    uint8_t words;      /* 32 bit words with ink in each row */
+    uint8_t lead;       /* first byte with ink in any row */
+    uint8_t bytes;      /* bytes up to the last with ink in any row */
+    uint8_t max_x;      /* furthest dot from the left of the character */
+    uint8_t max_y;      /* furthest dot from the top of the character */
+    uint8_t bits[MPS_PRINTER_GLYPH_ROWS][MPS_PRINTER_GLYPH_BYTES];
+} mps_printer_glyph_t;
+
 /*======================================================================*/
 /* Class MpsPrinter                                                     */
 /*======================================================================*/
@@ -139,20 +189,51 @@ class MpsPrinter
         /* CBM character specia for quote mode */
         static uint8_t cbm_special[MPS_PRINTER_MAX_SPECIAL];
 
+        /* Ink around a single dot for each dot size */
+        static int8_t dot_pattern[3][18][3];
+
+        /* Page tile without ink, shared by all the tiles that have none */
+        static uint8_t blank_tile[MPS_PRINTER_TILE_SIZE*MPS_PRINTER_TILE_BYTES];
+
         /* =======  Configuration */
         /* PNG file basename */
         char outfile[32];
 
-        /* PNG palette */
+        /* PNG palette and compression */
         LodePNGState lodepng_state;
+        uint8_t png_compression;
+
+        /* PNG file being written, see Print() */
+#ifndef NOT_ULTIMATE
+        File *png_file;
+#else
+        int png_file;
+#endif
 
         /* tabulation stops */
         uint16_t htab[MPS_PRINTER_MAX_HTABULATIONS];
         uint16_t vtab_store[MPS_PRINTER_MAX_VTABSTORES][MPS_PRINTER_MAX_VTABULATIONS];
         uint16_t *vtab;
 
-        /* Page bitmap */
-        uint8_t bitmap[MPS_PRINTER_BITMAP_SIZE];
+        /* Page bitmap, in tiles from left to right then top to bottom. A
+         * tile gets memory of its own when the first ink lands on it */
+        uint8_t *tiles[MPS_PRINTER_TILES];
+        uint16_t inked_tiles[MPS_PRINTER_TILES];
+        uint16_t inked_count;
+
+        /* Precalculated dots, see BuildStamps() */
+        mps_printer_stamp_t stamps[MPS_PRINTER_STAMPS];
+
+        /* Characters drawn before, see Glyph() */
+        mps_printer_glyph_t glyphs[MPS_PRINTER_GLYPHS];
+
+        /* Character being drawn into a glyph instead of the page */
+        mps_printer_glyph_t *glyph;
+        uint32_t glyph_clock;
+        uint16_t glyph_x;
+        uint16_t glyph_y;
+        uint8_t glyph_phase;
+        bool glyph_overflow;
 
         /* How many pages printed since start */
         int page_num;
@@ -257,6 +338,7 @@ class MpsPrinter
         void setFilename(char * filename);
         void setCharsetVariant(uint8_t cs);
         void setDotSize(uint8_t ds);
+        void setPngCompression(uint8_t pc);
         void setInterpreter(mps_printer_interpreter_t it);
         void setCBMCharset(uint8_t in);
         void setEpsonCharset(uint8_t in);
@@ -270,19 +352,30 @@ class MpsPrinter
 
     private:
         uint8_t Combine(uint8_t c1, uint8_t c2);
+        uint32_t CombineRow(uint32_t r1, uint32_t r2);
+        void BuildStamps(void);
+        void AddStamp(uint8_t *p, uint16_t stride, mps_printer_stamp_t *stamp, uint8_t phase);
+        uint8_t *PageByte(uint16_t column, uint16_t y);
+        void AddInk(uint16_t column, uint16_t y, uint32_t ink);
+        void AddWord(uint8_t *p, uint32_t ink);
+        bool Glyph(uint8_t kind, uint16_t c, uint16_t x, uint16_t y);
         void Clear(void);
         void Init(void);
 #ifndef NOT_ULTIMATE
         void calcPageNum(void);
 #endif
         void Print(const char* filename);
-        void Ink(uint16_t x, uint16_t y, uint8_t c=3);
+        bool PngWrite(const uint8_t *data, uint32_t size);
+        bool PngChunk(const char *type, const uint8_t *data, uint32_t length);
         void Dot(uint16_t x, uint16_t y, bool b=false);
         uint16_t Charset2Chargen(uint8_t input);
         uint16_t Char(uint16_t c);
         uint16_t CharItalic(uint16_t c, uint16_t x, uint16_t y);
         uint16_t CharDraft(uint16_t c, uint16_t x, uint16_t y);
         uint16_t CharNLQ(uint16_t c, uint16_t x, uint16_t y);
+        void DrawItalic(uint16_t c, uint16_t x, uint16_t y);
+        void DrawDraft(uint16_t c, uint16_t x, uint16_t y);
+        void DrawNLQ(uint16_t c, uint16_t x, uint16_t y);
         void PrintString(const char *s, uint16_t x, uint16_t y);
         void PrintStringNlq(const char *s, uint16_t x, uint16_t y);
         bool IsPrintable(uint8_t input);
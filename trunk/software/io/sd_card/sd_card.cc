@@ -40,6 +40,7 @@ SdCard :: SdCard(void) : BlockDevice()
     sdhc = false;
     sd_type = 0;
     initialized = false;
+    multi_block = true;
 #ifdef OS
     mutex = xSemaphoreCreateMutex();
 #endif
@@ -92,6 +93,7 @@ DSTATUS SdCard :: init(void)
     sdhc = false;
     sd_type = 0;
     initialized = false;
+    multi_block = true;
 
 //    if(!(sdio_sense() & SD_CARD_DETECT))
 //        return STA_NODISK;
@@ -207,7 +209,9 @@ DSTATUS SdCard :: init(void)
 							read
 							====
   Abstract:
-	Reads one or more sectors from the SD-Card
+	Reads one or more sectors from the SD-Card. More than one sector is read
+	with READ_MULTIPLE_BLOCK commands of up to SD_MAX_BURST sectors each. When
+	such a command fails, the remaining sectors are read one by one.
 
   Parameters
 	address:	sector address to read from
@@ -231,6 +235,78 @@ DSTATUS SdCard :: init(void)
  */
 
 DRESULT SdCard :: read(uint8_t* buf, uint32_t address, int sectors)
+{
+    while((sectors > 1) && multi_block) {
+        int burst = (sectors > SD_MAX_BURST) ? SD_MAX_BURST : sectors;
+        int done = read_multi(buf, address, burst);
+        address += done;
+        buf += done * SD_SECTOR_SIZE;
+        sectors -= done;
+        if (done < burst) {
+            printf("SD: Multiple block read stopped at sector %d; reading %d sectors one by one.\n", address, sectors);
+            break;
+        }
+    }
+    if (sectors > 0)
+        return read_single(buf, address, sectors);
+    return RES_OK;
+}
+
+// Returns the number of sectors read
+int SdCard :: read_multi(uint8_t *buf, uint32_t address, int sectors)
+{
+    uint8_t cardresp;
+    uint32_t place = (sdhc)?(address):(address<<9);
+    int done = 0;
+
+    // Interrupts are only held off for one step at a time: the command, each
+    // block and the stop, as in read_single. The card waits for the clock.
+    ENTER_SAFE_SECTION
+    sdio_send_command(CMDREADMULTI, (uint16_t) (place >> 16), (uint16_t) place);
+    cardresp = Resp8b();
+    LEAVE_SAFE_SECTION
+    if (cardresp != 0x00) {
+        Resp8bError(cardresp);
+        if (cardresp & 0x04) // illegal command; don't try again
+            multi_block = false;
+        return 0;
+    }
+    while(done < sectors) {
+        ENTER_SAFE_SECTION
+        cardresp = sdio_read_block(buf);
+        LEAVE_SAFE_SECTION
+        if (cardresp != 0x00) {
+            printf("SD: Data error token %02x.\n", cardresp);
+            break;
+        }
+        done++;
+        buf += SD_SECTOR_SIZE;
+    }
+    ENTER_SAFE_SECTION
+    cardresp = stop_transmission();
+    LEAVE_SAFE_SECTION
+
+    if (cardresp != 0x00)
+        Resp8bError(cardresp);
+    return done;
+}
+
+// Ends a multiple block read. Returns the R1 response of the card.
+uint8_t SdCard :: stop_transmission(void)
+{
+    sdio_send_command(CMDSTOPTRANS, 0, 0);
+    SDIO_DATA = 0xff; // stuff byte
+    uint8_t resp = Resp8b();
+
+    int time_out = 600000; // like the write timeout
+    while(SDIO_DATA != 0xFF) { // busy
+        if(!--time_out)
+            return 0xFF;
+    }
+    return resp;
+}
+
+DRESULT SdCard :: read_single(uint8_t* buf, uint32_t address, int sectors)
 {
 	uint8_t cardresp;
 	uint8_t firstblock;
@@ -284,7 +360,10 @@ DRESULT SdCard :: read(uint8_t* buf, uint32_t address, int sectors)
 							write
 							=====
   Abstract:
-	Writes sectors on the SD-Card
+	Writes sectors on the SD-Card. More than one sector is written with
+	WRITE_MULTIPLE_BLOCK commands of up to SD_MAX_BURST sectors each, preceded
+	by the number of blocks to pre-erase (ACMD23). When such a command
+	fails, the remaining sectors are written one by one.
 
   Parameters
 	address:	sector address to write to
@@ -309,6 +388,70 @@ DRESULT SdCard :: read(uint8_t* buf, uint32_t address, int sectors)
  */
 
 DRESULT SdCard :: write(const uint8_t* buf, uint32_t address, int sectors )
+{
+    while((sectors > 1) && multi_block) {
+        int burst = (sectors > SD_MAX_BURST) ? SD_MAX_BURST : sectors;
+        int done = write_multi(buf, address, burst);
+        address += done;
+        buf += done * SD_SECTOR_SIZE;
+        sectors -= done;
+        if (done < burst) {
+            printf("SD: Multiple block write stopped at sector %d; writing %d sectors one by one.\n", address, sectors);
+            break;
+        }
+    }
+    if (sectors > 0)
+        return write_single(buf, address, sectors);
+    return RES_OK;
+}
+
+// Returns the number of sectors that were accepted by the card
+int SdCard :: write_multi(const uint8_t *buf, uint32_t address, int sectors)
+{
+    uint8_t resp;
+    uint32_t place = (sdhc)?(address):(address<<9);
+    int done = 0;
+
+    // one safe section per step, as in read_multi
+    ENTER_SAFE_SECTION
+    // pre-erase hint, only an optimization for the card; the result does not matter
+    sdio_send_command(CMDAPPCMD, 0, 0);
+    Resp8b();
+    sdio_send_command(CMDSETERASECOUNT, (uint16_t)(sectors >> 16), (uint16_t)sectors);
+    Resp8b();
+
+    sdio_send_command(CMDWRITEMULTI, (uint16_t)(place >> 16), (uint16_t) place);
+    resp = Resp8b();
+    LEAVE_SAFE_SECTION
+    if (resp != 0x00) {
+        Resp8bError(resp);
+        if (resp & 0x04) // illegal command; don't try again
+            multi_block = false;
+        return 0;
+    }
+    while(done < sectors) {
+        ENTER_SAFE_SECTION
+        bool accepted = sdio_write_block(buf, SD_TOKEN_START_MULTI);
+        LEAVE_SAFE_SECTION
+        if (!accepted) {
+            printf("SD: Block %d of multiple block write not accepted.\n", address + done);
+            break;
+        }
+        done++;
+        buf += SD_SECTOR_SIZE;
+    }
+    ENTER_SAFE_SECTION
+    bool stopped = sdio_stop_write();
+    LEAVE_SAFE_SECTION
+
+    if (!stopped) {
+        printf("SD: Timeout at end of multiple block write.\n");
+        return 0; // don't know what the card did; write all again
+    }
+    return done;
+}
+
+DRESULT SdCard :: write_single(const uint8_t* buf, uint32_t address, int sectors )
 {
 	uint32_t place;
 	uint8_t  resp;
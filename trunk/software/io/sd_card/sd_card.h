@@ -10,10 +10,14 @@
 #include "semphr.h"
 #endif
 
+#define CMDSTOPTRANS 12
 #define CMDGETSTATUS 13
 #define CMDSETBLKLEN 16
 #define	CMDREAD      17
+#define	CMDREADMULTI 18
+#define	CMDSETERASECOUNT 23 // application command: number of blocks to pre-erase
 #define	CMDWRITE     24
+#define	CMDWRITEMULTI 25
 #define	CMDREADCSD    9
 #define	CMDREADCID   10
 #define CMDCRCONOFF  59
@@ -21,12 +25,14 @@
 #define CMDREADOCR   58
 
 #define SD_SECTOR_SIZE 512
+#define SD_MAX_BURST    8  // sectors per multiple block command; to be raised once measured on hardware
 
 class SdCard : public BlockDevice
 {
     int     sd_type;
     bool    sdhc;
     bool    initialized;
+    bool    multi_block; // cleared when the card rejects multiple block commands
 #ifdef OS
     SemaphoreHandle_t mutex;
 #endif
@@ -37,6 +43,11 @@ class SdCard : public BlockDevice
     void    Resp8bError(uint8_t value);
     DRESULT verify(const uint8_t* buf, uint32_t address );
     DRESULT get_drive_size(uint32_t* drive_size);
+    uint8_t stop_transmission(void);
+    int     read_multi(uint8_t *buf, uint32_t address, int sectors);
+    int     write_multi(const uint8_t *buf, uint32_t address, int sectors);
+    DRESULT read_single(uint8_t *buf, uint32_t address, int sectors);
+    DRESULT write_single(const uint8_t *buf, uint32_t address, int sectors);
 
 public: /* block device api */
     SdCard();
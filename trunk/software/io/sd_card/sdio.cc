@@ -56,10 +56,9 @@ uint8_t sdio_read_block(uint8_t *buf)
     if (b != 0xFE)
     	return b;
 
-	uint32_t *pul, ul;
-    ul = (uint32_t)buf;
+	uint32_t *pul;
     pul = (uint32_t *)buf;
-    if((ul & 3)==0) {
+    if(((uintptr_t)buf & 3)==0) {
 		for(int i=0;i<128;i++) {
 			*(pul++) = SDIO_DATA_32;
 		}
@@ -76,14 +75,13 @@ uint8_t sdio_read_block(uint8_t *buf)
     return 0;
 }
 
-bool sdio_write_block(const uint8_t *buf)
+bool sdio_write_block(const uint8_t *buf, uint8_t token)
 {
-    uint32_t *pul, ul;
-    ul = (uint32_t)buf;
+    uint32_t *pul;
     pul = (uint32_t *)buf;
 
-    SDIO_DATA = 0xFE; // start of block
-    if((ul & 3)==0) {
+    SDIO_DATA = token; // start of block
+    if(((uintptr_t)buf & 3)==0) {
 		for(int i=0;i<128;i++) {
 			SDIO_DATA_32 = *(pul++);
 		}
@@ -92,9 +90,9 @@ bool sdio_write_block(const uint8_t *buf)
 			SDIO_DATA = *(buf++);
 		}
     }
-	SDIO_DATA = 0xFF; // dummy (crc, etc)
-    SDIO_DATA = 0xFF;
+	SDIO_DATA = 0xFF; // dummy (crc)
     SDIO_DATA = 0xFF;
+    uint8_t resp = SDIO_DATA; // data response: xxx0sss1, sss = 010 when accepted
 
     // Timeout for SD writes = 250 ms (fixed by SDA).
     // Because the SPI read is in the loop below, running at 25 MHz,
@@ -111,5 +109,19 @@ bool sdio_write_block(const uint8_t *buf)
 		if(!time_out)
 			return false; // error!
 	}
-    return true; // ok
+    return ((resp & 0x1F) == 0x05);
+}
+
+bool sdio_stop_write(void)
+{
+    SDIO_DATA = SD_TOKEN_STOP_TRAN;
+    SDIO_DATA = 0xFF; // the card starts to signal busy one byte later
+
+    int time_out = 600000; // same as for a block
+    while(SDIO_DATA != 0xFF) {
+    	--time_out;
+		if(!time_out)
+			return false;
+	}
+    return true;
 }
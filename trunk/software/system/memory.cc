@@ -111,10 +111,13 @@ MemManager mem_manager;
 
 extern char _heap[];
 
+uint32_t mem_allocations = 0;
+
 void * get_mem(size_t size) 
 {
     //printf("New operator for size = %d, returned: \n", size);
     void *ret;
+    mem_allocations++;
 #if USE_MEM_TRACE == 1
     if(mem_manager.enabled) {
         ret = mem_manager.qalloc(size);
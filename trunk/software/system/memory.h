@@ -8,8 +8,12 @@
 #ifndef MEMORY_H_
 #define MEMORY_H_
 
+#include <stdint.h>
+
 #define NUM_MALLOCS 4000
 
+extern uint32_t mem_allocations; // number of calls to get_mem since boot
+
 class MemManager
 {
 public:
@@ -5,12 +5,15 @@ extern "C" {
     #include "small_printf.h"
 }
 #include "FreeRTOS.h"
+#include "memory.h"
 
+uint32_t mem_allocations = 0;
 
 void * get_mem(size_t size) 
 {
     //printf("New operator for size = %d, returned: \n", size);
     void *ret;
+    mem_allocations++;
 	ret = pvPortMalloc(size);
 
 	if (!ret) {
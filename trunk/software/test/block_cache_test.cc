@@ -0,0 +1,180 @@
+/*
+ * block_cache_test.cc
+ *
+ * Runs BlockDevice_Cached on top of a RAM block device with random reads,
+ * writes and syncs of random sizes, and checks every read against a
+ * reference copy of what was written. After a sync, the device itself must
+ * hold the reference. Runs once with the default geometry of the cache and
+ * once with a small one, such that lines are replaced all the time.
+ *
+ * Usage: block_cache_test [operations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blockdev_cached.h"
+
+#define TEST_SECTORS     2048
+#define TEST_SECTOR_SIZE 512
+#define TEST_MAX_COUNT   (BLOCK_CACHE_BYPASS + 8) // also some transfers that bypass the cache
+
+class TestDevice : public BlockDevice
+{
+public:
+    uint8_t data[TEST_SECTORS * TEST_SECTOR_SIZE];
+    int reads;
+    int writes;
+    int out_of_range;
+
+    TestDevice() {
+        memset(data, 0, sizeof(data));
+        reads = 0;
+        writes = 0;
+        out_of_range = 0;
+    }
+    DSTATUS init(void) { return 0; }
+    DSTATUS status(void) { return 0; }
+    DRESULT read(uint8_t *buffer, uint32_t sector, int count) {
+        reads++;
+        if (sector + count > TEST_SECTORS) {
+            out_of_range++;
+            return RES_PARERR;
+        }
+        memcpy(buffer, data + sector * TEST_SECTOR_SIZE, count * TEST_SECTOR_SIZE);
+        return RES_OK;
+    }
+    DRESULT write(const uint8_t *buffer, uint32_t sector, int count) {
+        writes++;
+        if (sector + count > TEST_SECTORS) {
+            out_of_range++;
+            return RES_PARERR;
+        }
+        memcpy(data + sector * TEST_SECTOR_SIZE, buffer, count * TEST_SECTOR_SIZE);
+        return RES_OK;
+    }
+    DRESULT ioctl(uint8_t command, void *data) {
+        if (command == GET_SECTOR_COUNT) {
+            *(uint32_t *)data = TEST_SECTORS;
+            return RES_OK;
+        }
+        return RES_OK;
+    }
+};
+
+static uint8_t reference[TEST_SECTORS * TEST_SECTOR_SIZE];
+static uint8_t buffer[TEST_MAX_COUNT * TEST_SECTOR_SIZE];
+
+// contents to write; cheaper than rand() per byte
+static void fill(uint8_t *p, int len)
+{
+    static uint32_t x = 2463534242u;
+    for(int i=0;i<len;i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        p[i] = uint8_t(x);
+    }
+}
+
+// Mostly short transfers close to the previous one, such that the cache
+// gets hits, sequential runs and read ahead; now and then a jump or a
+// large transfer.
+static void pick(uint32_t &sector, int &count, uint32_t previous)
+{
+    int r = rand() % 100;
+    if (r < 5)
+        count = BLOCK_CACHE_BYPASS + 1 + rand() % (TEST_MAX_COUNT - BLOCK_CACHE_BYPASS);
+    else if (r < 30)
+        count = 1 + rand() % 16;
+    else
+        count = 1 + rand() % 2;
+
+    r = rand() % 100;
+    if (r < 40)
+        sector = previous;
+    else if (r < 80)
+        sector = previous + (rand() % 64) - 32;
+    else
+        sector = rand() % TEST_SECTORS;
+    if ((int)sector < 0)
+        sector = 0;
+    if (sector + count > TEST_SECTORS)
+        sector = TEST_SECTORS - count;
+}
+
+static int run(const char *name, int sets, int ways, int read_ahead, int operations)
+{
+    TestDevice *dev = new TestDevice;
+    BlockDevice_Cached *cache = new BlockDevice_Cached(dev, TEST_SECTOR_SIZE, sets, ways, read_ahead);
+    int errors = 0;
+    int reads = 0, writes = 0, syncs = 0;
+    uint32_t previous = 0;
+
+    fill(reference, sizeof(reference));
+    memcpy(dev->data, reference, sizeof(reference));
+
+    for(int op=0;(op < operations) && (errors < 10);op++) {
+        uint32_t sector;
+        int count;
+        pick(sector, count, previous);
+        int r = rand() % 100;
+        if (r < 55) {
+            reads++;
+            if (cache->read(buffer, sector, count) != RES_OK) {
+                printf("%s: operation %d: read of %d sectors at %u failed.\n", name, op, count, sector);
+                errors++;
+            } else if (memcmp(buffer, reference + sector * TEST_SECTOR_SIZE, count * TEST_SECTOR_SIZE)) {
+                printf("%s: operation %d: read of %d sectors at %u returned stale data.\n", name, op, count, sector);
+                errors++;
+            }
+        } else if (r < 98) {
+            writes++;
+            fill(buffer, count * TEST_SECTOR_SIZE);
+            memcpy(reference + sector * TEST_SECTOR_SIZE, buffer, count * TEST_SECTOR_SIZE);
+            if (cache->write(buffer, sector, count) != RES_OK) {
+                printf("%s: operation %d: write of %d sectors at %u failed.\n", name, op, count, sector);
+                errors++;
+            }
+        } else {
+            syncs++;
+            DRESULT res = (r == 98) ? cache->sync() : cache->ioctl(CTRL_SYNC, NULL);
+            if (res != RES_OK) {
+                printf("%s: operation %d: sync failed.\n", name, op);
+                errors++;
+            } else if (memcmp(dev->data, reference, sizeof(reference))) {
+                printf("%s: operation %d: device differs after sync.\n", name, op);
+                errors++;
+            }
+        }
+        previous = sector + count;
+    }
+
+    if ((cache->sync() != RES_OK) || memcmp(dev->data, reference, sizeof(reference))) {
+        printf("%s: device differs after the final sync.\n", name);
+        errors++;
+    }
+    if (dev->out_of_range) {
+        printf("%s: %d requests went past the end of the device.\n", name, dev->out_of_range);
+        errors++;
+    }
+    printf("%-8s %d sets of %d: %d reads, %d writes, %d syncs; device: %d reads, %d writes. %s\n",
+            name, sets, ways, reads, writes, syncs, dev->reads, dev->writes, errors ? "FAILED" : "ok");
+    cache->print_info();
+
+    delete cache;
+    delete dev;
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    int operations = 200000;
+    if (argc > 1)
+        operations = atoi(argv[1]);
+
+    srand(13);
+    int errors = run("default", BLOCK_CACHE_SETS, BLOCK_CACHE_WAYS, BLOCK_CACHE_READ_AHEAD, operations);
+    errors += run("small", 4, 2, 4, operations);
+    return errors ? 2 : 0;
+}
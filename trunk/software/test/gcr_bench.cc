@@ -0,0 +1,370 @@
+/*
+ * gcr_bench.cc
+ *
+ * Host benchmark for the software GCR coder. Converts a full D64 image
+ * (sector headers and data blocks, laid out as on the real disk) to GCR
+ * and back, verifies the result and reports the throughput.
+ * Then formats the image into circular G64 tracks, with syncs and gaps,
+ * and compares the previous track scanner against GcrCodec::decode_track.
+ *
+ * Usage: gcr_bench [image.d64] [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "gcr_codec.h"
+
+#define D64_SECTORS   683
+#define D64_SIZE      (D64_SECTORS * 256)
+#define GCR_PER_SECT  (10 + 325) // header block + data block
+#define G64_ROUNDS    5
+
+static const int sectors_per_track[] = { 21, 19, 18, 17 };
+static const int region_end[] = { 17, 24, 30, 35 };
+static const int track_lengths[] = { 0x1E00, 0x1BE0, 0x1A00, 0x1860 };
+static const int sector_gap_lengths[] = { 9, 19, 13, 10 };
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec) + double(ts.tv_nsec) * 1e-9;
+}
+
+static uint8_t *encode_disk(uint8_t *bin, uint8_t *gcr)
+{
+    uint8_t header[8];
+    uint8_t sector[260];
+    int region = 0;
+    for(int t=0;t<35;t++) {
+        if (t >= region_end[region])
+            region++;
+        for(int s=0;s<sectors_per_track[region];s++) {
+            header[0] = 8;
+            header[2] = uint8_t(s);
+            header[3] = uint8_t(t+1);
+            header[4] = 0x30;
+            header[5] = 0x31;
+            header[6] = 0x0F;
+            header[7] = 0x0F;
+            header[1] = header[2] ^ header[3] ^ header[4] ^ header[5];
+            gcr = GcrCodec :: encode_block_sw(header, gcr, 8);
+
+            uint8_t chk = 0;
+            sector[0] = 7;
+            for(int i=0;i<256;i++) {
+                chk ^= bin[i];
+                sector[i+1] = bin[i];
+            }
+            sector[257] = chk;
+            sector[258] = 0;
+            sector[259] = 0;
+            gcr = GcrCodec :: encode_block_sw(sector, gcr, 260);
+            bin += 256;
+        }
+    }
+    return gcr;
+}
+
+static int decode_disk(uint8_t *gcr, uint8_t *bin)
+{
+    uint8_t header[8];
+    uint8_t sector[260];
+    int errors = 0;
+    int err;
+    for(int i=0;i<D64_SECTORS;i++) {
+        GcrCodec :: decode_block_sw(gcr, header, 8, &err);
+        errors += err;
+        gcr += 10;
+        GcrCodec :: decode_block_sw(gcr, sector, 260, &err);
+        errors += err;
+        gcr += 325;
+        memcpy(bin, &sector[1], 256);
+        bin += 256;
+    }
+    return errors;
+}
+
+// Lays out a track like GcrImage does, rotated by 'rotate' bytes, such
+// that some sectors cross the end of the track.
+static void format_track(uint8_t *bin, int t, int region, uint8_t *track, int rotate)
+{
+    int len = track_lengths[region];
+    uint8_t *lin = new uint8_t[len];
+    uint8_t *gcr = lin;
+    uint8_t header[8];
+    uint8_t sector[260];
+
+    for(int s=0;s<sectors_per_track[region];s++) {
+        for(int i=0;i<5;i++)
+            *(gcr++) = 0xFF;
+        header[0] = 8;
+        header[2] = uint8_t(s);
+        header[3] = uint8_t(t+1);
+        header[4] = 0x30;
+        header[5] = 0x31;
+        header[6] = 0x0F;
+        header[7] = 0x0F;
+        header[1] = header[2] ^ header[3] ^ header[4] ^ header[5];
+        gcr = GcrCodec :: encode_block_sw(header, gcr, 8);
+        for(int i=0;i<9;i++)
+            *(gcr++) = 0x55;
+        for(int i=0;i<5;i++)
+            *(gcr++) = 0xFF;
+        uint8_t chk = 0;
+        sector[0] = 7;
+        for(int i=0;i<256;i++) {
+            chk ^= bin[i];
+            sector[i+1] = bin[i];
+        }
+        sector[257] = chk;
+        sector[258] = 0;
+        sector[259] = 0;
+        gcr = GcrCodec :: encode_block_sw(sector, gcr, 260);
+        for(int i=0;i<sector_gap_lengths[region];i++)
+            *(gcr++) = 0x55;
+        bin += 256;
+    }
+    while(gcr < lin + len)
+        *(gcr++) = 0x55;
+
+    for(int i=0;i<len;i++)
+        track[(i + rotate) % len] = lin[i];
+    delete[] lin;
+}
+
+// The track scanner as it was before GcrCodec::decode_track: byte wise
+// sync search, with wrap checks and copies for every block.
+static uint8_t *old_find_sync(uint8_t *gcr_data, uint8_t *begin, uint8_t *end)
+{
+    bool wrap = false;
+    int sync_count = 0;
+
+    do {
+        if(*gcr_data == 0xFF) {
+            sync_count++;
+        } else {
+            if(sync_count > 2)
+                return gcr_data;
+            sync_count = 0;
+        }
+        if(gcr_data < end) {
+            gcr_data++;
+        } else {
+            if(wrap)
+                return NULL;
+            wrap = true;
+            gcr_data = begin;
+        }
+    } while(1);
+    return NULL;
+}
+
+static uint8_t *old_wrap(uint8_t **current, uint8_t *begin, uint8_t *end, int count, uint8_t *buffer)
+{
+    uint8_t *gcr = *current;
+
+    if(gcr > (end - count)) {
+        uint8_t *d = buffer;
+        uint8_t *s = gcr;
+        *current = (gcr + count) - (end - begin);
+        while((s < end)&&(count--))
+            *(d++) = *(s++);
+        s = begin;
+        while(count--)
+            *(d++) = *(s++);
+        return buffer;
+    }
+    *current = gcr + count;
+    return gcr;
+}
+
+static int old_decode_track(uint8_t *gcr, int trackNumber, int trackLen, int maxSector, uint8_t *bin)
+{
+    uint8_t header[8];
+    uint8_t sector_buffer[352];
+    uint8_t *begin = gcr;
+    uint8_t *end = begin + trackLen;
+    uint8_t *current = gcr;
+    uint8_t *dest = bin;
+    uint8_t *gcr_data;
+    bool expect_data = false;
+    bool wrapped = false;
+    int secs = 0;
+
+    while(secs < maxSector) {
+        uint8_t *new_gcr = old_find_sync(current, begin, end);
+        if(new_gcr < current) {
+            if (wrapped)
+                break;
+            wrapped = true;
+        }
+        current = new_gcr;
+        gcr_data = old_wrap(&current, begin, end, 5, sector_buffer);
+        GcrCodec :: decode_5bytes_sw(gcr_data, &header[0]);
+        if(header[0] == 8) {
+            gcr_data = old_wrap(&current, begin, end, 5, sector_buffer);
+            GcrCodec :: decode_5bytes_sw(gcr_data, &header[4]);
+            int s = header[2];
+            dest = bin + (256 * s);
+            expect_data = (s < maxSector);
+            continue;
+        }
+        if((header[0] == 7) && expect_data) {
+            expect_data = false;
+            secs++;
+            memcpy(dest, &header[1], 3);
+            dest += 3;
+            gcr_data = old_wrap(&current, begin, end, 320, sector_buffer);
+            for(int i=0;i<63;i++) {
+                GcrCodec :: decode_5bytes_sw(gcr_data, dest);
+                gcr_data += 5;
+                dest += 4;
+            }
+            GcrCodec :: decode_5bytes_sw(gcr_data, &header[4]);
+            *(dest++) = header[4];
+        }
+    }
+    return secs;
+}
+
+typedef int (*track_decoder_t)(uint8_t *gcr, int trackNumber, int trackLen, int maxSector, uint8_t *bin);
+
+static int new_decode_track(uint8_t *gcr, int trackNumber, int trackLen, int maxSector, uint8_t *bin)
+{
+    return GcrCodec :: decode_track(gcr, trackNumber, trackLen, maxSector, bin, NULL, NULL);
+}
+
+static int decode_g64(uint8_t **tracks, uint8_t *bin, track_decoder_t decoder)
+{
+    int region = 0;
+    int missing = 0;
+    for(int t=0;t<35;t++) {
+        if (t >= region_end[region])
+            region++;
+        int secs = decoder(tracks[t], t+1, track_lengths[region], sectors_per_track[region], bin);
+        missing += sectors_per_track[region] - secs;
+        bin += 256 * sectors_per_track[region];
+    }
+    return missing;
+}
+
+static int bench_g64(uint8_t *bin, uint8_t *back, int iterations)
+{
+    uint8_t *tracks[35];
+    int region = 0;
+    for(int t=0;t<35;t++) {
+        if (t >= region_end[region])
+            region++;
+        tracks[t] = new uint8_t[track_lengths[region]];
+    }
+    const char *names[] = { "old scanner", "decode_track" };
+    track_decoder_t decoders[] = { old_decode_track, new_decode_track };
+    double elapsed[2];
+
+    // every track start rotated differently, so some sectors cross the end
+    uint8_t *b = bin;
+    region = 0;
+    for(int t=0;t<35;t++) {
+        if (t >= region_end[region])
+            region++;
+        format_track(b, t, region, tracks[t], (t * 997) % track_lengths[region]);
+        b += 256 * sectors_per_track[region];
+    }
+
+    // the decoders take turns, and the best round of each counts, such that
+    // other load on the machine does not favour either of them
+    elapsed[0] = elapsed[1] = 1e9;
+    for(int round=0;round<G64_ROUNDS;round++) {
+        for(int d=0;d<2;d++) {
+            memset(back, 0, D64_SIZE);
+            double t0 = now();
+            int missing = 0;
+            for(int i=0;i<iterations;i++)
+                missing += decode_g64(tracks, back, decoders[d]);
+            double t = now() - t0;
+            if (missing || memcmp(bin, back, D64_SIZE)) {
+                printf("G64 -> D64 with %s FAILED: %d sectors missing.\n", names[d], missing);
+                return 2;
+            }
+            if (t < elapsed[d])
+                elapsed[d] = t;
+        }
+    }
+    for(int d=0;d<2;d++)
+        printf("G64 -> D64 (%s): %8.2f disks/s\n", names[d], iterations / elapsed[d]);
+    printf("Speed up: %.2fx\n", elapsed[0] / elapsed[1]);
+
+    for(int t=0;t<35;t++)
+        delete[] tracks[t];
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 200;
+    uint8_t *bin  = new uint8_t[D64_SIZE];
+    uint8_t *back = new uint8_t[D64_SIZE];
+    uint8_t *gcr  = new uint8_t[D64_SECTORS * GCR_PER_SECT];
+
+    GcrCodec :: init();
+
+    if ((argc > 1) && strcmp(argv[1], "-")) {
+        FILE *f = fopen(argv[1], "rb");
+        if (!f) {
+            printf("Can't open '%s'.\n", argv[1]);
+            return 1;
+        }
+        size_t n = fread(bin, 1, D64_SIZE, f);
+        fclose(f);
+        if (n != D64_SIZE) {
+            printf("'%s' is too small for a 35 track D64 image.\n", argv[1]);
+            return 1;
+        }
+    } else {
+        srand(1541);
+        for(int i=0;i<D64_SIZE;i++)
+            bin[i] = uint8_t(rand());
+    }
+    if (argc > 2)
+        iterations = atoi(argv[2]);
+
+    // sanity check on the tables: every byte must survive a round trip
+    uint8_t all[256], all_gcr[320], all_back[256];
+    for(int i=0;i<256;i++)
+        all[i] = uint8_t(i);
+    GcrCodec :: encode_block_sw(all, all_gcr, 256);
+    int err;
+    GcrCodec :: decode_block_sw(all_gcr, all_back, 256, &err);
+    if (err || memcmp(all, all_back, 256)) {
+        printf("Table round trip FAILED.\n");
+        return 2;
+    }
+
+    double t0 = now();
+    for(int i=0;i<iterations;i++)
+        encode_disk(bin, gcr);
+    double t1 = now();
+    int errors = 0;
+    for(int i=0;i<iterations;i++)
+        errors += decode_disk(gcr, back);
+    double t2 = now();
+
+    if (errors || memcmp(bin, back, D64_SIZE)) {
+        printf("Round trip FAILED: %d invalid codes.\n", errors);
+        return 2;
+    }
+
+    double mb = double(D64_SIZE) * iterations / (1024.0 * 1024.0);
+    printf("D64 -> GCR: %8.2f disks/s, %8.2f MB/s\n", iterations / (t1 - t0), mb / (t1 - t0));
+    printf("GCR -> D64: %8.2f disks/s, %8.2f MB/s\n", iterations / (t2 - t1), mb / (t2 - t1));
+
+    int result = bench_g64(bin, back, iterations);
+
+    delete[] bin;
+    delete[] back;
+    delete[] gcr;
+    return result;
+}
@@ -0,0 +1,230 @@
+/*
+ * mps_bench.cc
+ *
+ * Host benchmark for the MPS printer emulation. Feeds reference print jobs
+ * to the interpreters, one page each, and reports how many pages per second
+ * are rendered into the page bitmap and how many are written out as PNG,
+ * for each PNG compression setting. The PNG file of each job is checksummed,
+ * such that a change in rendering shows up as a different checksum.
+ *
+ * Built with NOT_ULTIMATE, so the pages go to the host file system.
+ *
+ * Usage: mps_bench [pages] [output prefix]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "mps_printer.h"
+
+#define JOB_MAX_SIZE (128 * 1024)
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec) + double(ts.tv_nsec) * 1e-9;
+}
+
+struct Job {
+    const char *name;
+    mps_printer_interpreter_t interpreter;
+    uint8_t dot_size;
+    uint8_t data[JOB_MAX_SIZE];
+    int length;
+
+    void add(uint8_t b) {
+        if (length < JOB_MAX_SIZE)
+            data[length++] = b;
+    }
+    void add(const char *s) {
+        while(*s)
+            add((uint8_t)*s++);
+    }
+};
+
+#define JOBS 5
+
+static Job jobs[JOBS];
+
+static uint32_t random_state = 12345;
+
+static uint32_t next_random(void)
+{
+    random_state = random_state * 1103515245 + 12345;
+    return random_state >> 8;
+}
+
+// A BASIC listing, as printed with LIST from a C64: the most common job.
+static void make_cbm_listing(Job &job)
+{
+    static const char *statements[] = {
+        "PRINT \"HELLO WORLD\";", "POKE 53280,0:POKE 53281,0", "FOR I=1 TO 100:NEXT I",
+        "IF A$=\"\" THEN GOTO 100", "GOSUB 2000:RETURN", "DATA 169,0,141,32,208,96",
+        "INPUT \"NAME\";N$", "X=X+1:Y=Y*2:Z=SQR(X*X+Y*Y)" };
+    char line[96];
+
+    job.name = "cbm listing";
+    job.interpreter = MPS_PRINTER_INTERPRETER_CBM;
+    job.dot_size = 1;
+    for(int i=0;i<56;i++) {
+        sprintf(line, "%d %s:%s", 10 * (i+1), statements[i % 8], statements[(i * 3 + 1) % 8]);
+        if (i % 8 == 7) {
+            job.add(0x12); // reverse on
+            job.add(line);
+            job.add(0x92); // reverse off
+        } else {
+            job.add(line);
+        }
+        job.add('\r');
+    }
+}
+
+// A few lines on an otherwise empty page, like most pages that are printed.
+static void make_cbm_note(Job &job)
+{
+    job.name = "cbm short note";
+    job.interpreter = MPS_PRINTER_INTERPRETER_CBM;
+    job.dot_size = 1;
+    job.add("DEAR READER,\r\r");
+    job.add("THIS PAGE IS MOSTLY EMPTY.\r");
+    job.add("THE REST OF IT IS PAPER.\r\r");
+    job.add("READY.\r");
+}
+
+// Emphasized and double strike text, which prints every dot four times.
+static void make_epson_text(Job &job)
+{
+    job.name = "epson bold text";
+    job.interpreter = MPS_PRINTER_INTERPRETER_EPSONFX80;
+    job.dot_size = 2;
+    job.add("\x1b" "@" "\x1b" "E" "\x1b" "G");
+    for(int i=0;i<56;i++) {
+        job.add("The quick brown fox jumps over the lazy dog. 0123456789 ABCDEFGHIJKLMNOPQRST\r\n");
+    }
+}
+
+// Letter quality, italic, underlined, double width, superscript and
+// condensed text, one style per line.
+static void make_epson_styles(Job &job)
+{
+    static const char *styles[] = {
+        "\x1b" "x1", "\x1b" "4", "\x1b" "-1", "\x1b" "W1", "\x1b" "S0", "\x0f", "\x1b" "x1" "\x1b" "-1" };
+
+    job.name = "epson styles";
+    job.interpreter = MPS_PRINTER_INTERPRETER_EPSONFX80;
+    job.dot_size = 1;
+    for(int i=0;i<56;i++) {
+        job.add("\x1b" "@");
+        job.add(styles[i % 7]);
+        job.add("Sphinx of black quartz, judge my vow!\r\n");
+    }
+}
+
+// A screen dump in double density bit image mode; lines of 960 columns
+// that touch each other.
+static void make_epson_graphics(Job &job)
+{
+    job.name = "epson graphics";
+    job.interpreter = MPS_PRINTER_INTERPRETER_EPSONFX80;
+    job.dot_size = 1;
+    job.add("\x1b" "@");
+    for(int i=0;i<88;i++) {
+        job.add(0x1B);
+        job.add('L');
+        job.add(960 & 0xFF);
+        job.add(960 >> 8);
+        for(int c=0;c<960;c++) {
+            uint32_t r = next_random();
+            job.add(((r >> 4) & 0xFF) | ((c & 0x40) ? 0xF0 : 0x00));
+        }
+        job.add("\r" "\x1b" "J");
+        job.add(24);
+    }
+}
+
+static long file_size(const char *filename)
+{
+    struct stat st;
+    if (stat(filename, &st))
+        return 0;
+    return st.st_size;
+}
+
+static uint32_t checksum_file(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return 0;
+    uint32_t hash = 2166136261U;
+    int c;
+    while((c = fgetc(f)) != EOF) {
+        hash = (hash ^ (uint8_t)c) * 16777619U;
+    }
+    fclose(f);
+    return hash;
+}
+
+int main(int argc, char **argv)
+{
+    int pages = (argc > 1) ? atoi(argv[1]) : 4;
+    const char *prefix = (argc > 2) ? argv[2] : "mps_bench";
+    char basename[256];
+    char filename[280];
+
+    if (strlen(prefix) > 24) { // the printer keeps 32 characters of a file name
+        printf("Output prefix too long.\n");
+        return 1;
+    }
+
+    make_cbm_listing(jobs[0]);
+    make_epson_text(jobs[1]);
+    make_epson_styles(jobs[2]);
+    make_epson_graphics(jobs[3]);
+    make_cbm_note(jobs[4]);
+
+    MpsPrinter *mps = MpsPrinter :: getMpsPrinter();
+
+    static const char *compressions[] = { "fast", "balanced", "small" };
+
+    for(int c=0;c<3;c++) {
+        double total_render = 0;
+        double total_png = 0;
+        long total_size = 0;
+        mps->setPngCompression(c);
+        printf("PNG compression %s\n", compressions[c]);
+
+        for(int j=0;j<JOBS;j++) {
+            Job &job = jobs[j];
+            sprintf(basename, "%s-%d%d", prefix, c, j);
+            mps->setFilename(basename);
+            mps->setInterpreter(job.interpreter);
+            mps->setDotSize(job.dot_size);
+
+            double render = 0;
+            double png = 0;
+            for(int p=0;p<pages;p++) {
+                mps->Reset();
+                double start = now();
+                mps->Interpreter(job.data, job.length);
+                double rendered = now();
+                mps->FormFeed();
+                double written = now();
+                render += rendered - start;
+                png += written - rendered;
+            }
+            total_render += render;
+            total_png += png;
+
+            sprintf(filename, "%s-001.png", basename);
+            total_size += file_size(filename);
+            printf("  %-16s %6d bytes: render %8.2f pages/s, PNG %6.2f pages/s, %7ld bytes, checksum %08x\n",
+                    job.name, job.length, pages / render, pages / png, file_size(filename), checksum_file(filename));
+        }
+        printf("  %d pages: render %.3f s, PNG %.3f s, %.2f pages/s overall, %ld bytes per page\n", JOBS * pages,
+                total_render, total_png, (JOBS * pages) / (total_render + total_png), total_size / JOBS);
+    }
+    return 0;
+}
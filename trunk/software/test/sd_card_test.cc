@@ -0,0 +1,104 @@
+/*
+ * sd_card_test.cc
+ *
+ * Runs the SdCard driver against the SPI model of a card in sdio_model.cc:
+ * initialization, single and multiple block transfers, and the fall back
+ * to single blocks when a multiple block transfer fails.
+ *
+ * Usage: sd_card_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sd_card.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    printf("%-60s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failures++;
+}
+
+static uint8_t reference[SDIO_MODEL_SECTORS * 512];
+
+static bool card_matches(void)
+{
+    return memcmp(sdio_model.data, reference, sizeof(reference)) == 0;
+}
+
+// number of multiple block commands for a transfer
+static int bursts(int sectors)
+{
+    return (sectors + SD_MAX_BURST - 1) / SD_MAX_BURST;
+}
+
+int main(int argc, char **argv)
+{
+    static uint8_t buffer[64 * 512];
+    SdCard card;
+
+    srand(512);
+    for(int i=0;i<SDIO_MODEL_SECTORS * 512;i++)
+        reference[i] = uint8_t(rand());
+    memcpy(sdio_model.data, reference, sizeof(reference));
+
+    check(card.init() == 0, "init");
+    uint32_t count = 0;
+    check((card.ioctl(GET_SECTOR_COUNT, &count) == RES_OK) && (count == SDIO_MODEL_SECTORS), "sector count from CSD");
+
+    sdio_model.reset();
+    check(card.read(buffer, 100, 1) == RES_OK, "read one sector");
+    check(!memcmp(buffer, &reference[100 * 512], 512), "  data");
+    check((sdio_model.commands[17] == 1) && !sdio_model.commands[18], "  with CMD17");
+
+    sdio_model.reset();
+    check(card.read(buffer, 200, 40) == RES_OK, "read 40 sectors");
+    check(!memcmp(buffer, &reference[200 * 512], 40 * 512), "  data");
+    check((sdio_model.commands[18] == bursts(40)) && (sdio_model.commands[12] == bursts(40)) && !sdio_model.commands[17],
+            "  in CMD18 bursts, each stopped with CMD12");
+    int multi_bytes = sdio_model.bytes;
+
+    sdio_model.reset();
+    for(int i=0;i<40;i++)
+        card.read(buffer + i * 512, 200 + i, 1);
+    printf("Bus bytes for 40 sectors: %d with CMD18, %d with CMD17.\n", multi_bytes, sdio_model.bytes);
+
+    sdio_model.reset();
+    for(int i=0;i<20*512;i++)
+        buffer[i] = reference[300 * 512 + i] = uint8_t(rand());
+    check(card.write(buffer, 300, 20) == RES_OK, "write 20 sectors");
+    check(card_matches(), "  data");
+    check((sdio_model.commands[25] == bursts(20)) && !sdio_model.commands[24], "  in CMD25 bursts");
+    check((sdio_model.commands[23] == bursts(20)) && (sdio_model.erase_count == 20 - (bursts(20) - 1) * SD_MAX_BURST),
+            "  each announced with ACMD23");
+
+    sdio_model.reset();
+    sdio_model.fail_read_sector = 405;
+    check(card.read(buffer, 400, 10) == RES_OK, "read 10 sectors, error token at the 6th");
+    check(!memcmp(buffer, &reference[400 * 512], 10 * 512), "  data");
+    check((sdio_model.commands[18] == 1) && (sdio_model.commands[17] == 5), "  rest read with CMD17");
+
+    sdio_model.reset();
+    sdio_model.fail_write_sector = 503;
+    for(int i=0;i<8*512;i++)
+        buffer[i] = reference[500 * 512 + i] = uint8_t(rand());
+    check(card.write(buffer, 500, 8) == RES_OK, "write 8 sectors, 4th rejected");
+    check(card_matches(), "  data");
+    check((sdio_model.commands[25] == 1) && (sdio_model.commands[24] == 5), "  rest written with CMD24");
+
+    sdio_model.reset();
+    sdio_model.multi_block = false;
+    check(card.read(buffer, 600, 10) == RES_OK, "read 10 sectors from a card without CMD18");
+    check(!memcmp(buffer, &reference[600 * 512], 10 * 512), "  data");
+    check(card.write(buffer, 700, 10) == RES_OK, "write 10 sectors");
+    memcpy(&reference[700 * 512], buffer, 10 * 512);
+    check(card_matches(), "  data");
+    check((sdio_model.commands[18] == 1) && !sdio_model.commands[25] && (sdio_model.commands[17] == 10) &&
+            (sdio_model.commands[24] == 10), "  multiple block commands tried only once");
+
+    printf("%s\n", failures ? "FAILED" : "All tests passed.");
+    return failures ? 1 : 0;
+}
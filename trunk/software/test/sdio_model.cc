@@ -0,0 +1,272 @@
+/*
+ * sdio_model.cc
+ *
+ * SD card in SPI mode, as far as the driver in io/sd_card uses it: the
+ * initialization sequence, CID/CSD, single and multiple block transfers.
+ * Checksums are not checked.
+ */
+
+#include "sdio_model.h"
+
+SdioModel sdio_model;
+
+SdioModel :: SdioModel()
+{
+    memset(data, 0, sizeof(data));
+    high_capacity = true;
+    multi_block = true;
+    sense.value = 0x04; // card detected, not write protected (see sdio_sense)
+    reset();
+}
+
+void SdioModel :: reset(void)
+{
+    state = e_idle;
+    command_length = 0;
+    app_command = false;
+    ready = false;
+    init_polls = 0;
+    queue_head = queue_tail = 0;
+    fail_read_sector = -1;
+    fail_write_sector = -1;
+    erase_count = 0;
+    bytes = 0;
+    memset(commands, 0, sizeof(commands));
+}
+
+void SdioModel :: push(uint8_t b)
+{
+    queue[queue_tail] = b;
+    queue_tail = (queue_tail + 1) % sizeof(queue);
+}
+
+void SdioModel :: push_block(uint32_t sector)
+{
+    push(0xFF); // access time
+    if ((sector >= SDIO_MODEL_SECTORS) || (int(sector) == fail_read_sector)) {
+        if (int(sector) == fail_read_sector)
+            fail_read_sector = -1;
+        push(0x08); // data error token: out of range
+        return;
+    }
+    push(0xFE);
+    for(int i=0;i<512;i++)
+        push(data[sector * 512 + i]);
+    push(0x00); // checksum
+    push(0x00);
+}
+
+void SdioModel :: execute(void)
+{
+    int cmd = command[0] & 0x3F;
+    uint32_t arg = (uint32_t(command[1]) << 24) | (uint32_t(command[2]) << 16) |
+                   (uint32_t(command[3]) << 8) | uint32_t(command[4]);
+    uint32_t sector = high_capacity ? arg : (arg >> 9);
+    bool app = app_command;
+    app_command = false;
+    commands[cmd]++;
+
+    queue_head = queue_tail = 0;
+    if (cmd == 12) {
+        push(0x3F); // stuff byte, still part of the data
+        push(0x00);
+        push(0x00); // busy
+        push(0x00);
+        state = e_idle;
+        return;
+    }
+    push(0xFF); // command response time
+
+    uint8_t r1 = ready ? 0x00 : 0x01;
+    switch(cmd) {
+    case 0:
+        state = e_idle;
+        ready = false;
+        init_polls = 0;
+        push(0x01);
+        break;
+    case 8:
+        push(0x01);
+        push(0x00);
+        push(0x00);
+        push(0x01); // voltage accepted
+        push(uint8_t(arg)); // check pattern
+        break;
+    case 55:
+        app_command = true;
+        push(r1);
+        break;
+    case 41:
+        if (app && (++init_polls >= 3))
+            ready = true;
+        push(ready ? 0x00 : 0x01);
+        break;
+    case 58:
+        push(r1);
+        push(high_capacity ? 0xC0 : 0x80);
+        push(0xFF);
+        push(0x80);
+        push(0x00);
+        break;
+    case 9:
+    case 10: {
+        uint8_t reg[16];
+        memset(reg, 0, 16);
+        if (cmd == 9) { // CSD version 2.0, 512K per C_SIZE + 1
+            uint32_t c_size = (SDIO_MODEL_SECTORS / 1024) - 1;
+            reg[0] = 0x40;
+            reg[7] = uint8_t(c_size >> 16) & 0x3F;
+            reg[8] = uint8_t(c_size >> 8);
+            reg[9] = uint8_t(c_size);
+        }
+        push(0x00);
+        push(0xFE);
+        for(int i=0;i<16;i++)
+            push(reg[i]);
+        push(0x00);
+        push(0x00);
+        break; }
+    case 13:
+        push(0x00);
+        push(0x00);
+        break;
+    case 16:
+    case 59:
+        push(r1);
+        break;
+    case 17:
+        push(0x00);
+        push_block(sector);
+        break;
+    case 18:
+        if (!multi_block) {
+            push(0x04);
+            break;
+        }
+        push(0x00);
+        address = sector;
+        state = e_read_multi;
+        break;
+    case 23:
+        if (!app) { // SET_BLOCK_COUNT is not for SD cards in SPI mode
+            push(0x04);
+            break;
+        }
+        erase_count = arg & 0x7FFFFF;
+        push(0x00);
+        break;
+    case 24:
+        push(0x00);
+        address = sector;
+        state = e_write_single;
+        break;
+    case 25:
+        if (!multi_block) {
+            push(0x04);
+            break;
+        }
+        push(0x00);
+        address = sector;
+        state = e_write_multi;
+        break;
+    default:
+        push(0x04); // illegal command
+    }
+}
+
+uint8_t SdioModel :: exchange(uint8_t out)
+{
+    bytes++;
+
+    uint8_t in = 0xFF;
+    if (queue_head != queue_tail) {
+        in = queue[queue_head];
+        queue_head = (queue_head + 1) % sizeof(queue);
+    } else if ((state == e_read_multi) && !command_length) {
+        push_block(address++);
+        in = queue[queue_head++];
+    }
+
+    switch(state) {
+    case e_idle:
+    case e_read_multi:
+        if (command_length) {
+            command[command_length++] = out;
+            if (command_length == 6) {
+                command_length = 0;
+                execute();
+            }
+        } else if ((out & 0xC0) == 0x40) {
+            command[0] = out;
+            command_length = 1;
+        }
+        break;
+    case e_write_single:
+        if (out == 0xFE) {
+            block_length = 0;
+            receive_return = e_idle;
+            state = e_receive;
+        }
+        break;
+    case e_write_multi:
+        if (out == 0xFC) {
+            block_length = 0;
+            receive_return = e_write_multi;
+            state = e_receive;
+        } else if (out == 0xFD) {
+            push(0xFF);
+            push(0x00); // busy
+            push(0x00);
+            state = e_idle;
+        }
+        break;
+    case e_receive:
+        block[block_length++] = out;
+        if (block_length == 514) {
+            if ((address >= SDIO_MODEL_SECTORS) || (int(address) == fail_write_sector)) {
+                if (int(address) == fail_write_sector)
+                    fail_write_sector = -1;
+                push(0x0D); // data rejected, write error
+            } else {
+                memcpy(&data[address * 512], block, 512);
+                push(0x05); // data accepted
+            }
+            push(0x00); // busy
+            push(0x00);
+            address++;
+            state = receive_return;
+        }
+        break;
+    }
+    return in;
+}
+
+SdioModel :: DataPort :: operator uint8_t()
+{
+    return sdio_model.exchange(0xFF);
+}
+
+SdioModel :: DataPort &SdioModel :: DataPort :: operator=(uint8_t b)
+{
+    sdio_model.exchange(b);
+    return *this;
+}
+
+SdioModel :: DataPort32 :: operator uint32_t()
+{
+    uint8_t b[4];
+    uint32_t w;
+    for(int i=0;i<4;i++)
+        b[i] = sdio_model.exchange(0xFF);
+    memcpy(&w, b, 4); // bytes in memory in the order of the bus
+    return w;
+}
+
+SdioModel :: DataPort32 &SdioModel :: DataPort32 :: operator=(uint32_t w)
+{
+    uint8_t b[4];
+    memcpy(b, &w, 4);
+    for(int i=0;i<4;i++)
+        sdio_model.exchange(b[i]);
+    return *this;
+}
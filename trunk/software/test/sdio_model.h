@@ -0,0 +1,99 @@
+/*
+ * sdio_model.h
+ *
+ * Host side model of the SPI port of the SD card interface, with an SD card
+ * in SPI mode behind it. Included before sdio.h (gcc -include), such that
+ * the SDIO_* registers used by sdio.cc and sd_card.cc end up in the model.
+ *
+ * Every access to the data register is one byte on the bus: a write sends
+ * the byte, a read sends 0xFF and returns what the card sent back.
+ */
+
+#ifndef SDIO_MODEL_H
+#define SDIO_MODEL_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define SDIO_MODEL_SECTORS 4096
+
+class SdioModel
+{
+    enum t_state {
+        e_idle,        // waiting for a command
+        e_read_multi,  // sending blocks until CMD12
+        e_write_single,
+        e_write_multi, // receiving blocks until the stop token
+        e_receive      // receiving the data of a block
+    };
+
+    t_state state;
+    t_state receive_return; // state after receiving a block
+
+    uint8_t  command[6];
+    int      command_length;
+    bool     app_command;
+    bool     ready;       // left the idle state (ACMD41)
+    int      init_polls;
+
+    uint8_t  queue[1024]; // bytes to send
+    int      queue_head;
+    int      queue_tail;
+
+    uint32_t address;     // sector of the current transfer
+    uint8_t  block[514];  // data and checksum
+    int      block_length;
+
+    void push(uint8_t b);
+    void push_block(uint32_t sector);
+    void execute(void);
+public:
+    // what the card holds
+    uint8_t  data[SDIO_MODEL_SECTORS * 512];
+    bool     high_capacity;
+    bool     multi_block;        // false: CMD18 and CMD25 are illegal commands
+    int      fail_read_sector;   // sends an error token instead of this sector, once; -1 = never
+    int      fail_write_sector;  // rejects the data of this sector, once; -1 = never
+
+    // what the card saw
+    int      commands[64];
+    int      erase_count;        // last ACMD23 argument
+    int      bytes;              // bus transfers
+
+    SdioModel();
+    void reset(void);
+    uint8_t exchange(uint8_t out); // one byte on the bus
+
+    // register access, as done through the SDIO_* macros
+    struct DataPort {
+        operator uint8_t();
+        DataPort &operator=(uint8_t b);
+    };
+    struct DataPort32 {
+        operator uint32_t();
+        DataPort32 &operator=(uint32_t w);
+    };
+    struct Register {
+        uint8_t value;
+        operator uint8_t() { return value; }
+        Register &operator=(uint8_t b) { value = b; return *this; }
+    };
+
+    DataPort   port;
+    DataPort32 port32;
+    Register   speed;
+    Register   ctrl;
+    Register   crc;
+    Register   sense;
+};
+
+extern SdioModel sdio_model;
+
+#define SDIO_DATA     sdio_model.port
+#define SDIO_DATA_32  sdio_model.port32
+#define SDIO_SPEED    sdio_model.speed
+#define SDIO_CTRL     sdio_model.ctrl
+#define SDIO_CRC      sdio_model.crc
+#define SDIO_SWITCH   sdio_model.sense
+
+#endif
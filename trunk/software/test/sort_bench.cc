@@ -0,0 +1,148 @@
+/*
+ * sort_bench.cc
+ *
+ * Host benchmark for IndexedList::sort. Sorts a directory listing of
+ * FileInfo entries, the way FileManager::get_directory does, with the
+ * previous comb sort and with the current stable merge sort. Checks that
+ * both give the same order, and that the merge sort keeps entries that
+ * compare equal in their original order.
+ *
+ * Usage: sort_bench [entries] [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "file_info.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec) + double(ts.tv_nsec) * 1e-9;
+}
+
+static int compares;
+static int locked_swaps;
+
+static int count_compare(FileInfo *a, FileInfo *b)
+{
+    compares++;
+    return FileInfo :: compare(a, b);
+}
+
+// The sort as it was: a comb sort with an index based compare and a
+// locked swap per exchange.
+static int old_compare(IndexedList<FileInfo *> *list, int a, int b)
+{
+    return count_compare((*list)[a], (*list)[b]);
+}
+
+static void comb_sort(IndexedList<FileInfo *> *list, int (*compare)(IndexedList<FileInfo *> *, int, int))
+{
+    int elements = list->get_elements();
+    int swaps;
+    int gap = elements-1;
+
+    if(elements < 2)
+        return;
+    do {
+        if (gap > 1) {
+            gap = (10 * gap)/13;
+            if ((gap == 10) || (gap == 9))
+                gap = 11;
+        }
+        swaps = 0;
+        for(int i=0;(i+gap)<elements;i++) {
+            if (compare(list, i, i+gap) > 0) {
+                list->swap(i, i+gap);
+                swaps++;
+                locked_swaps++;
+            }
+        }
+    } while(swaps || (gap > 1));
+}
+
+// Names like on a large SD card: games in a few series, some directories,
+// some names that differ only in case.
+static void fill(IndexedList<FileInfo *> &list, int count)
+{
+    static const char *series[] = { "Ultima", "Giana", "Turrican", "Commando", "Boulder Dash", "Wizball", "Elite", "Paradroid" };
+    static const char *ext[] = { "d64", "prg", "g64", "crt", "t64", "sid" };
+    char name[64];
+
+    srand(42);
+    for(int i=0;i<count;i++) {
+        FileInfo *inf = new FileInfo(128);
+        int r = rand();
+        if ((r % 7) == 0)
+            sprintf(name, "%s %d", series[r % 8], (r >> 8) % 100);
+        else
+            sprintf(name, "%s %d (%d).%s", series[r % 8], (r >> 8) % 100, (r >> 16) % 8, ext[(r >> 4) % 6]);
+        if (((r >> 12) % 16) == 0)
+            name[0] = name[0] | 0x20; // lower case copy
+        strcpy(inf->lfname, name);
+        inf->attrib = ((r % 7) == 0) ? AM_DIR : 0;
+        inf->cluster = i; // original position
+        list.append(inf);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int count = (argc > 1) ? atoi(argv[1]) : 10000;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 10;
+    double elapsed[2] = { 0, 0 };
+    int compare_count[2] = { 0, 0 };
+    int swap_count = 0;
+    int result = 0;
+
+    for(int it=0;it<iterations;it++) {
+        IndexedList<FileInfo *> lists[2] = { IndexedList<FileInfo *>(8, NULL), IndexedList<FileInfo *>(8, NULL) };
+        fill(lists[0], count);
+        fill(lists[1], count);
+
+        compares = 0;
+        locked_swaps = 0;
+        double t0 = now();
+        comb_sort(&lists[0], old_compare);
+        double t1 = now();
+        compare_count[0] += compares;
+        swap_count += locked_swaps;
+
+        compares = 0;
+        double t2 = now();
+        lists[1].sort(count_compare);
+        double t3 = now();
+        compare_count[1] += compares;
+
+        elapsed[0] += t1 - t0;
+        elapsed[1] += t3 - t2;
+
+        for(int i=0;i<count;i++) {
+            if (FileInfo :: compare(lists[0][i], lists[1][i]) != 0) {
+                printf("Sort results differ at %d: '%s' - '%s'\n", i, lists[0][i]->lfname, lists[1][i]->lfname);
+                result = 2;
+                break;
+            }
+            if ((i > 0) && (FileInfo :: compare(lists[1][i-1], lists[1][i]) == 0) &&
+                    (lists[1][i-1]->cluster > lists[1][i]->cluster)) {
+                printf("Sort is not stable at %d: '%s'\n", i, lists[1][i]->lfname);
+                result = 2;
+                break;
+            }
+        }
+        for(int l=0;l<2;l++) {
+            for(int i=0;i<count;i++)
+                delete lists[l][i];
+        }
+        if (result)
+            return result;
+    }
+    printf("%d entries, %d iterations\n", count, iterations);
+    printf("Comb sort : %8.3f ms, %9d compares, %9d locks\n", 1000.0 * elapsed[0] / iterations, compare_count[0] / iterations, swap_count / iterations);
+    printf("Merge sort: %8.3f ms, %9d compares, %9d locks\n", 1000.0 * elapsed[1] / iterations, compare_count[1] / iterations, 1);
+    printf("Speed up: %.2fx\n", elapsed[0] / elapsed[1]);
+    return result;
+}
@@ -15,6 +15,7 @@
 #include "browsable_root.h"
 #include "keyboard_usb.h"
 #include "home_directory.h"
+#include "file_jobs.h"
 
 static const char *helptext=
 		"CRSR UP/DN: Selection up/down\n"
@@ -35,7 +36,10 @@ static const char *helptext=
 		"C=-A        Select all\n"
 		"C=-N        Deselect all\n"
 		"C=-C        Copy current selection\n"
+		"C=-X        Cut current selection\n"
 		"C=-V        Paste selection here.\n"
+		"            Runs in the background;\n"
+		"            F5 shows the progress.\n"
 		"\n"
         "HOME:       Enter home directory\n"
         "C=-HOME:    Set current dir as home\n"
@@ -297,6 +301,8 @@ void TreeBrowser :: checkFileManagerEvent(void)
     	default:
     		break;
     	}
+		fm->release_path(path);
+		delete event;
     }
 }
 
@@ -385,7 +391,10 @@ int TreeBrowser :: handle_key(int c)
         	state->select_all(false);
         	break;
         case KEY_CTRL_C: // copy
-        	copy_selection();
+        	copy_selection(false);
+        	break;
+        case KEY_CTRL_X: // cut
+        	copy_selection(true);
         	break;
         case KEY_CTRL_V: // paste
         	paste();
@@ -451,10 +460,11 @@ void TreeBrowser :: reset_quick_seek(void)
     quick_seek_length = 0;
 }
 
-void TreeBrowser :: copy_selection(void)
+void TreeBrowser :: copy_selection(bool cut)
 {
 	clipboard.reset();
 	clipboard.setPath(path->get_path());
+	clipboard.setCut(cut);
 	for(int i=0;i<state->children->get_elements();i++) {
 		Browsable *t = (*state->children)[i];
 		if (t && t->getSelection()) {
@@ -473,20 +483,21 @@ void TreeBrowser :: paste(void)
 	printf("Going to paste %d files from path %s\n", clipboard.getNumberOfFiles(), clipboard.getPath());
 
 	int items = clipboard.getNumberOfFiles();
-	user_interface->show_progress("Copying...", items);
+	if (!items)
+		return;
+
+	// the copy runs in the background; the job tells us to refresh when it is done
+	FileJob *job = new FileJob(clipboard.isCut() ? e_job_move : e_job_copy, clipboard.getPath(), this->getPath());
 	for (int i=0;i<items;i++) {
-		const char *fn = clipboard.getFileNameByIndex(i);
-		FRESULT res = fm->fcopy(clipboard.getPath(), fn, this->getPath());  // from path, filename, dest path
-		if (res != FR_OK) {
-			printf("Error while copying: %d %s to %s\n", res, fn, this->getPath());
-			int resp = user_interface->popup("Copy error occurred. Continue?", BUTTON_YES | BUTTON_NO);
-			if (resp == BUTTON_NO)
-				break;
-		}
-		user_interface->update_progress(0, 1);
+		job->add(clipboard.getFileNameByIndex(i));
+	}
+	if (!FileJobs :: getFileJobs() -> submit(job)) {
+		user_interface->popup("Too many copies in progress.", BUTTON_OK);
+		return;
+	}
+	if (clipboard.isCut()) { // the files will not be where the clipboard says anymore
+		clipboard.reset();
 	}
-	user_interface->hide_progress();
-	state->refresh = true;
 }
 
 
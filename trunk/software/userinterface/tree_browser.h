@@ -17,14 +17,22 @@ class ClipBoard
 {
 	mstring source_path;
 	IndexedList<mstring *> source_files;
+	bool cut; // the files move when pasted
 public:
-	ClipBoard() : source_path(""), source_files(8, NULL) { }
+	ClipBoard() : source_path(""), source_files(8, NULL) { cut = false; }
 
 	void reset(void) {
 		for(int i=0;i<source_files.get_elements();i++) {
 			delete source_files[i];
 		}
 		source_files.clear_list();
+		cut = false;
+	}
+	void setCut(bool c) {
+		cut = c;
+	}
+	bool isCut(void) {
+		return cut;
 	}
 	void setPath(const char *path) {
 		source_path = path;
@@ -89,7 +97,7 @@ public:
     void task_menu(void);
     void config(void);
     void test_editor(void);
-    void copy_selection(void);
+    void copy_selection(bool cut);
     void paste(void);
     void cd(const char *path);
     